@@ -13,14 +13,23 @@
 
 
 
+#include <algorithm>
 #include <array>
+#include <bitset>
+#include <cmath>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <random>
+#include <sstream>
 #include <chrono>
 #include <unordered_map>
 #include <string>
 
+#ifdef _WIN32
 #pragma comment(lib, "winmm.lib")
 
 #ifndef UNICODE
@@ -29,12 +38,62 @@ Character Set -> Use Unicode. Thanks! - Javidx9
 #endif
 
 #include <windows.h>
+#endif
 
 #include <atomic>
 #include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#ifdef __cpp_impl_coroutine
+#include <coroutine>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
 
 #define SUPPRESS_PROC_INFO
 
+#if defined(__GNUC__) || defined(__clang__)
+#define FORCE_INLINE inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define FORCE_INLINE __forceinline
+#else
+#define FORCE_INLINE inline
+#endif
+
 
 enum COLOUR
 {
@@ -87,12 +146,25 @@ typedef unsigned char BYTE;
 
 const constexpr unsigned WIDTH = 64;
 const constexpr unsigned HEIGHT = 32;
+static_assert(HEIGHT <= 32, "Chip8::dirtyRows has one bit per row");
 const constexpr unsigned RAM = 4096; // 4kB RAM
+const constexpr unsigned ADDR_MASK = RAM - 1; // Wraps addresses into RAM
+const constexpr unsigned XO_RAM = 65536; // XO-CHIP address space
+const constexpr unsigned PLANES = 2; // XO-CHIP bitplanes
 const constexpr unsigned FONTSET_SIZE = 16 * 5;
+const constexpr unsigned PACKED_SIZE = WIDTH * HEIGHT / 8; // Display at 1 bit per pixel
 const constexpr unsigned SCALE = 20;
+const constexpr unsigned CYCLES_PER_FRAME = 10; // Instructions per 60Hz timer tick
+const constexpr unsigned SAMPLE_RATE = 44100;
+const constexpr unsigned SAMPLES_PER_FRAME = SAMPLE_RATE / 60;
+const constexpr unsigned AUDIO_BLOCK = 256;		// Samples handed to a sink at once (~6ms)
+const constexpr unsigned BEEP_FREQUENCY = 440;
+const constexpr unsigned AUDIO_PRIME = SAMPLES_PER_FRAME + AUDIO_BLOCK;			// Samples queued before playing starts
+const constexpr unsigned AUDIO_LATENCY = 2 * SAMPLES_PER_FRAME + AUDIO_BLOCK;	// Samples queued before the audio thread skips
+const constexpr unsigned FRAME_RATE = 60;
 const constexpr char*	 FILENAME = "invaders.c8";
 
-BYTE fontset[FONTSET_SIZE] =
+const constexpr BYTE fontset[FONTSET_SIZE] =
 {
 	0xF0, 0x90, 0x90, 0x90, 0xF0,		// 0
 	0x20, 0x60, 0x20, 0x20, 0x70,		// 1
@@ -120,1391 +192,8756 @@ std::unordered_map<BYTE, int> keymap =
 	{ 0xA, 'Y'		},{ 0x0, 'X'	},{ 0xB, 'C'	},{ 0xF, 'V'	}
 };
 
-class Chip8
+////////////////////////////////////////////////////////////////
+// DECODING
+//
+// Chip8::Execute runs from a table with one decoded entry per
+// address instead of fetching and switching on raw opcodes. The
+// decoder also fuses common idioms into superinstructions that
+// run in a single dispatch. A fused entry only lives at the
+// address of its first instruction, every address keeps its own
+// entry, so a jump into the middle of a fused sequence still
+// runs the plain instruction found there.
+//
+// The decoder also tracks the liveness of VF across a fused
+// arithmetic pair: when the second instruction overwrites VF
+// without reading it, the first one skips its flag store. The
+// check is made once per decode, not per dispatch, and the pair
+// stores the flag as usual when it is cut short by the cycle
+// budget, so the state between Execute calls never differs.
+//
+/////////////////////////////////////////////////////////////////
+
+enum OP
 {
-public:
+	OP_UNDECODED = 0,	// Decoded on first use
+	OP_UNKNOWN,
+	OP_TRAP,			// Breakpoint, stops before the instruction runs
+
+	OP_CLS, OP_RET, OP_JP, OP_CALL, OP_SE, OP_SNE, OP_SE_XY, OP_LD, OP_ADD,
+	OP_LD_XY, OP_OR, OP_AND, OP_XOR, OP_ADD_XY, OP_SUB, OP_SHR, OP_SUBN, OP_SHL,
+	OP_SNE_XY, OP_LD_I, OP_JP_V, OP_RND, OP_DRW, OP_SKP, OP_SKNP,
+	OP_LD_X, OP_LD_K, OP_LD_DT, OP_LD_ST, OP_ADD_I, OP_LD_F, OP_LD_B, OP_LD_55, OP_LD_65,
+
+	// XO-CHIP
+	OP_LD_I_LONG,	// F000 NNNN
+	OP_SAVE_XY,		// 5XY2
+	OP_LOAD_XY,		// 5XY3
+	OP_PLANE,		// FN01
+
+	// Superinstructions
+	OP_LD_SKP,		// 6XKK EX9E	Key check
+	OP_LD_SKNP,		// 6XKK EXA1	Key check
+	OP_LD_I_DRW,	// ANNN DXYN	Sprite draw
+	OP_WAIT_DT,		// FX07 3X00 1NNN	Timer wait
+	OP_COUNT_LOOP,	// 7XKK 3X00 1NNN, NNN = own address	Busy loop
+	OP_SKIP_JP,		// 3XKK / 4XKK / 5XY0 / 9XY0 / EX9E / EXA1, then 1NNN / 2NNN	Branch
+	OP_ALU_PAIR,	// Two of 7XKK / 8XYN	Arithmetic
+	OP_ALU_PAIR_DEAD_VF,	// OP_ALU_PAIR, the second overwrites the first's VF	Arithmetic
+};
 
-	bool interrupt;
-	bool drawFlag;
 
-	BYTE delay_timer;
-	BYTE sound_timer;
+struct Decoded
+{
+	WORD opcode;
+	BYTE op;		// OP
+};
 
-	//////////////////////////////////////////////
-	/// \brief Intializes registers and memory
-	///
-	//////////////////////////////////////////////
-	void Initialize()
-	{
-		pc = 0x200;	// Program counter starts at 0x200
-		opcode = 0;		// Reset opcode
-		I = 0;		// Reset index register
-		sp = 0;		// Reset stack pointer
 
-		std::fill(std::begin(gfx), std::end(gfx), 0x00); // Clear display
-		std::fill(std::begin(stack), std::end(stack), 0x00); // Clear stack
-		std::fill(std::begin(memory), std::end(memory), 0x00); // Clear RAM
-		std::fill(std::begin(V), std::end(V), 0x00); // Clear Registers
+////////////////////////////////////////////////////////////////
+// COPY-ON-WRITE STATE
+//
+// Memory is split into pages that hold their bytes together with
+// the decoded entries of their addresses, and the display and the
+// XO-CHIP memory above RAM are one more block each. Copying a Chip8 shares all of them, a machine takes
+// a private copy of a block the first time it writes to it. This
+// makes copying a machine a fork in O(1) no matter how much
+// memory it uses. Decoded entries are written through the same
+// path, so a lazily decoded entry never shows up in another
+// machine that shares the page
+//
+/////////////////////////////////////////////////////////////////
 
-		for (int i = 0; i < FONTSET_SIZE; i++)				   // Load fontset
-			memory[i] = fontset[i];
+const constexpr unsigned PAGE_SIZE = 256;
+const constexpr unsigned PAGES = RAM / PAGE_SIZE;
 
-		interrupt = false;
-		drawFlag = false;
-	}
 
+struct Page
+{
+	BYTE bytes[PAGE_SIZE];
+	Decoded code[PAGE_SIZE];	// Decoded instruction at every address
+};
 
-	//////////////////////////////////////////////
-	/// \brief Loads a ROM into memory
-	///
-	/// \param filepath The path to the ROM
-	//////////////////////////////////////////////
-	void LoadGame(std::string filepath)
-	{
-		// Open File
-		std::ifstream file(filepath, std::ios::binary);
 
-		// All bytes in the file will be stored at 0x200 in memory
-		int offset = 0;
-		while (file.good())
-		{
-			memory[0x200 + offset++] = (BYTE)file.get();
-		}
-	}
+static_assert(WIDTH == 64, "Display rows are one 64 bit word");
 
-	//////////////////////////////////////////////
-	/// \brief Returns the current display
-	///
-	//////////////////////////////////////////////
-	BYTE* getDisplay() { return gfx; }
 
+//////////////////////////////////////////////
+/// \brief The display, one packed word per row
+///        and plane
+///
+/// Sprites are drawn and cleared on the rows.
+/// Machines that share it unpack it for
+/// Chip8::getDisplay into their own pixels
+//////////////////////////////////////////////
+struct Display
+{
+	uint64_t rows[PLANES][HEIGHT];	// Bit 63 is the leftmost pixel
+};
 
-	//////////////////////////////////////////////
-	/// \brief Goes through one emulation cycle
-	///
-	//////////////////////////////////////////////
-	void EmulateCycle()
-	{
-		// Fetch opcode
-		opcode = (memory[pc] << 8) | memory[pc + 1];
 
-#ifndef SUPPRESS_PROC_INFO
-		std::cout << std::uppercase << std::hex << opcode << ": ";
-#endif
+//////////////////////////////////////////////
+/// \brief XO-CHIP memory above RAM
+///
+/// Only I reaches it, instructions are always
+/// fetched below RAM, so it is a single block
+/// without decoded entries
+//////////////////////////////////////////////
+struct HighMemory
+{
+	BYTE bytes[XO_RAM - RAM];
+};
 
-		BYTE x = (opcode & 0x0F00) >> 8;
-		BYTE y = (opcode & 0x00F0) >> 4;
-		BYTE n = (opcode & 0x000F);
-		BYTE kk = (opcode & 0x00FF);
-		WORD nnn = (opcode & 0x0FFF);
 
-		// Decode opcode
-		// Execute opcode
+//////////////////////////////////////////////
+/// \brief The memory of a freshly loaded ROM,
+///        made by Chip8::Image
+///
+/// Every page is decoded, so machines loaded
+/// from the same image keep sharing it until
+/// they write to a page
+//////////////////////////////////////////////
+struct RomImage
+{
+	std::shared_ptr<Page> pages[PAGES];
+	std::shared_ptr<HighMemory> high;	// Null for CHIP-8
+};
 
-		switch (opcode & 0xF000)
+
+//////////////////////////////////////////////
+/// \brief Classifies an opcode, following the
+///        same rules as Chip8::EmulateCycle
+///
+/// \param xoChip Whether XO-CHIP opcodes exist
+//////////////////////////////////////////////
+constexpr OP DecodeOp(WORD opcode, bool xoChip = false)
+{
+	switch (opcode & 0xF000)
+	{
+	case 0x0000:
+		switch (opcode & 0x00FF)
 		{
-		case 0x0000:	// Multi case opcode
-			switch (opcode & 0x00FF)
-			{
-			case 0xE0:	// Clear display
-				CLS();
-				break;
+		case 0xE0: return OP_CLS;
+		case 0xEE: return OP_RET;
+		default: return OP_UNKNOWN;
+		}
 
-			case 0xEE:	// Return from subroutine
-				RET();
-				break;
+	case 0x1000: return OP_JP;
+	case 0x2000: return OP_CALL;
+	case 0x3000: return OP_SE;
+	case 0x4000: return OP_SNE;
+	case 0x5000:
+		if (xoChip && (opcode & 0x000F) == 0x2)
+			return OP_SAVE_XY;
+		if (xoChip && (opcode & 0x000F) == 0x3)
+			return OP_LOAD_XY;
+		return OP_SE_XY;
+
+	case 0x6000: return OP_LD;
+	case 0x7000: return OP_ADD;
+
+	case 0x8000:
+		switch (opcode & 0x000F)
+		{
+		case 0x0: return OP_LD_XY;
+		case 0x1: return OP_OR;
+		case 0x2: return OP_AND;
+		case 0x3: return OP_XOR;
+		case 0x4: return OP_ADD_XY;
+		case 0x5: return OP_SUB;
+		case 0x6: return OP_SHR;
+		case 0x7: return OP_SUBN;
+		case 0xE: return OP_SHL;
+		default: return OP_UNKNOWN;
+		}
 
-			default:
-				std::cerr << "Unknown OpCode" << std::endl;
-				interrupt = true;
-				//interrupt = true;
-				break;
-			}
-			break;
+	case 0x9000: return OP_SNE_XY;
+	case 0xA000: return OP_LD_I;
+	case 0xB000: return OP_JP_V;
+	case 0xC000: return OP_RND;
+	case 0xD000: return OP_DRW;
 
+	case 0xE000:
+		switch (opcode & 0x00FF)
+		{
+		case 0x9E: return OP_SKP;
+		case 0xA1: return OP_SKNP;
+		default: return OP_UNKNOWN;
+		}
 
-		case 0x1000:	// 1NNN: Set Program counter to NNN
-			JP(nnn);
-			break;
+	case 0xF000:
+		switch (opcode & 0x00FF)
+		{
+		case 0x00: return (xoChip && opcode == 0xF000) ? OP_LD_I_LONG : OP_UNKNOWN;
+		case 0x01: return xoChip ? OP_PLANE : OP_UNKNOWN;
+		case 0x07: return OP_LD_X;
+		case 0x0A: return OP_LD_K;
+		case 0x15: return OP_LD_DT;
+		case 0x18: return OP_LD_ST;
+		case 0x1E: return OP_ADD_I;
+		case 0x29: return OP_LD_F;
+		case 0x33: return OP_LD_B;
+		case 0x55: return OP_LD_55;
+		case 0x65: return OP_LD_65;
+		default: return OP_UNKNOWN;
+		}
+	}
 
+	return OP_UNKNOWN;
+}
 
-		case 0x2000:	// 2NNN: Calls subroutine at NNN
-			CALL(nnn);
-			break;
 
+inline bool IsAlu(OP op)
+{
+	return op == OP_ADD || (op >= OP_LD_XY && op <= OP_SHL);
+}
 
-		case 0x3000:	// 3XKK: If VX == KK, skip next instruction
-			SE(x, kk);
-			break;
 
+//////////////////////////////////////////////
+/// \brief Whether an 8XYN opcode stores a flag
+///        in VF that no other register of it
+///        depends on
+///
+//////////////////////////////////////////////
+inline bool StoresFlag(WORD opcode)
+{
+	BYTE x = (opcode & 0x0F00) >> 8;
+	BYTE y = (opcode & 0x00F0) >> 4;
+	BYTE n = opcode & 0x000F;
+	bool flags = n == 0x4 || n == 0x5 || n == 0x6 || n == 0x7 || n == 0xE;
+	return (opcode & 0xF000) == 0x8000 && flags && x != 0xF && y != 0xF;
+}
 
-		case 0x4000:	// 4XKK: If VX != KK, skip next instruction
-			SNE(x, kk);
-			break;
 
-		case 0x5000:
-			SE_XY(x, y);
-			break;
+//////////////////////////////////////////////
+/// \brief Whether a 7XKK or 8XYN opcode writes
+///        VF without reading it first
+///
+//////////////////////////////////////////////
+inline bool OverwritesFlag(WORD opcode)
+{
+	BYTE x = (opcode & 0x0F00) >> 8;
+	BYTE y = (opcode & 0x00F0) >> 4;
+	BYTE n = opcode & 0x000F;
+
+	if ((opcode & 0xF000) != 0x8000)
+		return false;	// 7FKK adds to VF
+	if (n == 0x0)
+		return x == 0xF && y != 0xF;
+	if (n == 0x6 || n == 0xE)
+		return x != 0xF;
+	return (n == 0x4 || n == 0x5 || n == 0x7) && x != 0xF && y != 0xF;
+}
 
 
-		case 0x6000:	// 6XKK: Sets VX to KK
-			LD(x, kk);
-			break;
+inline bool IsSkip(OP op)
+{
+	return op == OP_SE || op == OP_SNE || op == OP_SE_XY || op == OP_SNE_XY || op == OP_SKP || op == OP_SKNP;
+}
 
 
-		case 0x7000:	// 7XKK: Adds KK to the value of VX
-			ADD(x, kk);
-			break;
 
+////////////////////////////////////////////////////////////////
+// COMPILE-TIME BOOT
+//
+// Boot runs a ROM at compile time for as long as its outcome
+// cannot depend on anything outside the machine. It plays whole
+// frames, CYCLES_PER_FRAME instructions and a timer tick, like
+// Screen does, and stops before the first frame that would run
+// RND, read a key or read the delay timer. Chip8::LoadBoot then
+// continues from there exactly as if the frames had just run
+//
+/////////////////////////////////////////////////////////////////
 
-		case 0x8000:	// Multi case opcode
-			switch (opcode & 0x000F)
-			{
-			case 0x0:	// 8XY0: Set VX = VY
-				LD_XY(x, y);
-				break;
+const constexpr unsigned BOOT_MAX_FRAMES = FRAME_RATE * 10;
 
-			case 0x1:	// 8XY1: Set VX = VX | VY
-				OR(x, y);
-				break;
 
+struct BootState
+{
+	BYTE memory[RAM] = {};
+	BYTE V[16] = {};
+	WORD I = 0;
+	WORD pc = 0x200;
+	WORD stack[16] = {};
+	WORD sp = 0;
+	WORD opcode = 0;
+	BYTE gfx[WIDTH * HEIGHT] = {};
+	BYTE delay_timer = 0;
+	BYTE sound_timer = 0;
+	unsigned frames = 0;		// Frames already run
+};
 
-			case 0x2:	// 8XY2: VX = VX & VY
-				AND(x, y);
-				break;
 
+//////////////////////////////////////////////
+/// \brief Runs one instruction, the same way
+///        Chip8::EmulateCycle would
+///
+/// \return False if the instruction depends on
+///         input, randomness or the delay timer
+///         and was not run
+//////////////////////////////////////////////
+constexpr bool BootStep(BootState& s)
+{
+	const WORD opcode = (s.memory[s.pc & ADDR_MASK] << 8) | s.memory[(s.pc + 1) & ADDR_MASK];
+	const BYTE x = (opcode & 0x0F00) >> 8;
+	const BYTE y = (opcode & 0x00F0) >> 4;
+	const BYTE kk = opcode & 0x00FF;
+	const WORD nnn = opcode & 0x0FFF;
 
-			case 0x3:	// 8XY3: VX = VX ^ VY
-				XOR(x, y);
-				break;
+	BYTE* V = s.V;
+	WORD next = s.pc + 2;
 
+	switch (DecodeOp(opcode))
+	{
+	case OP_CLS:
+		for (BYTE& pixel : s.gfx)
+			pixel = 0;
+		break;
+
+	case OP_RET:
+		s.sp = (s.sp - 1) & 0xF;
+		next = s.stack[s.sp] + 2;
+		break;
+
+	case OP_JP: next = nnn; break;
+
+	case OP_CALL:
+		s.stack[s.sp] = s.pc;
+		s.sp = (s.sp + 1) & 0xF;
+		next = nnn;
+		break;
+
+	case OP_SE: if (V[x] == kk) next += 2; break;
+	case OP_SNE: if (V[x] != kk) next += 2; break;
+	case OP_SE_XY: if (V[x] == V[y]) next += 2; break;
+	case OP_SNE_XY: if (V[x] != V[y]) next += 2; break;
+	case OP_LD: V[x] = kk; break;
+	case OP_ADD: V[x] += kk; break;
+	case OP_LD_XY: V[x] = V[y]; break;
+	case OP_OR: V[x] |= V[y]; break;
+	case OP_AND: V[x] &= V[y]; break;
+	case OP_XOR: V[x] ^= V[y]; break;
+
+	// VF is written before the result, like the opcode handlers do
+	case OP_ADD_XY: V[0xF] = V[y] > 0xFF - V[x]; V[x] = (V[x] + V[y]) & 0xFF; break;
+	case OP_SUB: V[0xF] = V[x] > V[y]; V[x] = (V[x] - V[y]) & 0xFF; break;
+	case OP_SHR: V[0xF] = V[x] & 0x1; V[x] >>= 1; break;
+	case OP_SUBN: V[0xF] = V[y] > V[x]; V[x] = (V[y] - V[x]) & 0xFF; break;
+	case OP_SHL: V[0xF] = V[x] & 0x80; V[x] <<= 1; break;
+
+	case OP_LD_I: s.I = nnn; break;
+	case OP_JP_V: next = nnn + V[0x0]; break;
+
+	case OP_DRW:
+		V[0xF] = 0;
+		for (BYTE row = 0; row < (opcode & 0x000F); row++)
+		{
+			BYTE line = s.memory[(s.I + row) & ADDR_MASK];
+			for (BYTE col = 0; col < 8; col++)
+			{
+				if ((line & (0x80 >> col)) == 0)
+					continue;
 
-			case 0x4:	// 8XY4: VX = VX + VY; Carry = overflow
-				ADD_XY(x, y);
-				break;
+				WORD index = ((V[y] + row) & (HEIGHT - 1)) * WIDTH + ((V[x] + col) & (WIDTH - 1));
+				if (s.gfx[index] == 1)
+					V[0xF] = 1;
+				s.gfx[index] ^= 1;
+			}
+		}
+		break;
+
+	case OP_LD_DT: s.delay_timer = V[x]; break;
+	case OP_LD_ST: s.sound_timer = V[x]; break;
+	case OP_ADD_I: s.I += V[x]; break;
+	case OP_LD_F: s.I = V[x] * 5; break;
+
+	case OP_LD_B:
+		s.memory[s.I & ADDR_MASK] = V[x] / 100;
+		s.memory[(s.I + 1) & ADDR_MASK] = (V[x] / 10) % 10;
+		s.memory[(s.I + 2) & ADDR_MASK] = V[x] % 10;
+		break;
+
+	case OP_LD_55:
+		for (int offset = 0; offset <= x; offset++)
+			s.memory[(s.I + offset) & ADDR_MASK] = V[offset];
+		break;
+
+	case OP_LD_65:
+		for (int offset = 0; offset <= x; offset++)
+			V[offset] = s.memory[(s.I + offset) & ADDR_MASK];
+		break;
+
+	default:	// RND, SKP, SKNP, LD_K, LD_X and unknown opcodes
+		return false;
+	}
 
+	s.opcode = opcode;
+	s.pc = next;
+	return true;
+}
 
-			case 0x5:	// 8XY5: VX = VX - VY, set VF = NOT borrow
-				SUB(x, y);
-				break;
 
+//////////////////////////////////////////////
+/// \brief Runs the boot frames of a ROM
+///
+/// \param rom  The ROM bytes
+/// \param size Number of bytes
+//////////////////////////////////////////////
+constexpr BootState Boot(const BYTE* rom, size_t size)
+{
+	BootState state;
+	for (unsigned i = 0; i < FONTSET_SIZE; i++)
+		state.memory[i] = fontset[i];
+	for (size_t i = 0; i < size && i < RAM - 0x200; i++)
+		state.memory[0x200 + i] = rom[i];
 
-			case 0x6:	// 8XY6: VX = VX >> 1. VF = VX least significant bit
-				SHR(x, y);
-				break;
+	while (state.frames < BOOT_MAX_FRAMES)
+	{
+		BootState frame = state;
+		for (unsigned cycle = 0; cycle < CYCLES_PER_FRAME; cycle++)
+		{
+			if (!BootStep(frame))
+				return state;
+		}
 
+		if (frame.delay_timer != 0)
+			frame.delay_timer--;
+		if (frame.sound_timer != 0)
+			frame.sound_timer--;
 
-			case 0x7:	// 8XY7: VX = VY - VX, set VF = NOT borrow
-				SUBN(x, y);
-				break;
+		frame.frames++;
+		state = frame;
+	}
 
+	return state;
+}
 
-			case 0xE:
-				SHL(x, y);
-				break;
 
 
-			default:
-				std::cerr << "Unknown OpCode" << std::endl;
-				interrupt = true;
-				//interrupt = true;
-				break;
-			} break;
+////////////////////////////////////////////////////////////////
+// DEBUGGING
+//
+// Breakpoints swap the decoded entry of their address for a trap,
+// so they cost nothing until they are hit. Watchpoints are kept
+// as a mask of 256 byte pages that LD_B and LD_55 test before
+// looking at the exact ranges. Register conditions are the only
+// thing checked per instruction, and only while one is set.
+// A machine stopped by the debugger sets interrupt until Resume
+//
+/////////////////////////////////////////////////////////////////
 
+enum STOP
+{
+	STOP_NONE = 0,
+	STOP_BREAKPOINT,	// stopAddress is the breakpoint, not run yet
+	STOP_WRITE,			// stopAddress is the byte written
+	STOP_REGISTER,		// stopAddress is the instruction that changed it
+};
 
-		case 0x9000:	// 9XY0: Skip next instruction of VX != VY
-			SNE_XY(x, y);
-			break;
+const constexpr unsigned MAX_WATCHES = 8;
+const constexpr unsigned MAX_CONDITIONS = 8;
+const constexpr BYTE REG_I = 16;			// Register number of I in conditions
+const constexpr WORD NO_TRAP = 0xFFFF;
 
 
-		case 0xA000:	// ANNN: Set register I to NNN
-			LD(nnn);
-			break;
+struct Watch
+{
+	WORD from;
+	WORD to;		// One past the last address
+};
 
 
-		case 0xB000:	// BNNN: Jump to location NNN + V0
-			JP_V(nnn);
-			break;
+struct Condition
+{
+	BYTE reg;		// V0 - VF or REG_I
+	int value;		// Stop when the register becomes this, -1 on any change
+	WORD last;
+};
 
 
-		case 0xC000:	// Set VX to a random byte & kk
-			RND(x, kk);
-			break;
+//////////////////////////////////////////////
+/// \brief Where the machines of a thread
+///        publish pc and the call stack for
+///        GuestProfiler
+///
+/// A seqlock with the thread as its only writer.
+/// sequence is odd while it writes, a reader
+/// that sees it change retries
+//////////////////////////////////////////////
+struct ProfileSlot
+{
+	std::atomic<bool> wanted{ true };		// Set by the reader, cleared when served
+	std::atomic<uint32_t> sequence{ 0 };	// 0 until the first write
+	std::atomic<WORD> pc{ 0 };
+	std::atomic<WORD> depth{ 0 };
+	std::atomic<WORD> calls[16] = {};		// Address of every CALL on the stack
 
+	uint32_t jitter = 0x9E3779B9;			// xorshift state, writer only
 
-		case 0xD000:	// DXYN: Draw the N byte long sprite stored at I at position (VX, VY). Set VF = 1 if collision
-			DRW(x, y, n);
-			break;
+	uint32_t Jitter()
+	{
+		jitter ^= jitter << 13;
+		jitter ^= jitter >> 17;
+		jitter ^= jitter << 5;
+		return jitter;
+	}
+};
 
 
-		case 0xE000:	// Multi case opcode
-			switch (opcode & 0x00FF)
-			{
-			case 0x9E:	// EX9E: Skip next instruction is key with value VX is pressed
-				SKP(x);
-				break;
 
+class Chip8
+{
+public:
 
-			case 0xA1:	// EXA1: Skip next instruction is key with value VX is not pressed
-				SKNP(x);
-				break;
+	bool interrupt;
+	bool drawFlag;
+	BYTE stopReason;		// STOP, why the debugger stopped the machine
+	WORD stopAddress;
+	uint32_t dirtyRows;		// Bit y is set if row y changed since it was last shown
 
+	BYTE delay_timer;
+	BYTE sound_timer;
 
-			default:
-				std::cerr << "Unknown OpCode" << std::endl;
-				interrupt = true;
-				//interrupt = true;
-				break;
-			}
-			break;
+	//////////////////////////////////////////////
+	/// \brief Intializes registers and memory
+	///
+	//////////////////////////////////////////////
+	void Initialize()
+	{
+		pc = 0x200;	// Program counter starts at 0x200
+		opcode = 0;		// Reset opcode
+		I = 0;		// Reset index register
+		sp = 0;		// Reset stack pointer
 
+		display = BlankDisplay(); // Clear display
+		stale = ~0u;
+		std::fill(std::begin(stack), std::end(stack), 0x00); // Clear stack
+		std::fill(std::begin(V), std::end(V), 0x00); // Clear Registers
+		std::fill(std::begin(key), std::end(key), 0x00); // Release keys
+		delay_timer = 0;
+		sound_timer = 0;
 
-		case 0xF000:	// Multi case opcode
-			switch (opcode & 0x00FF)
-			{
-			case 0x07:	// FX07: Set VX = delay_timer
-				LD_X(x);
-				break;
+		// Clear RAM and load the fontset. These pages are shared by
+		// all machines, the first write makes a private copy
+		pages[0] = FontPage();
+		std::fill(std::begin(pages) + 1, std::end(pages), ZeroPage());
+		high.reset();	// CHIP-8 until EnableXoChip
+		planes = 1;
 
+		interrupt = false;
+		drawFlag = false;
+		dirtyRows = ~0u;
 
-			case 0x0A:	// FX0A: Halt program until key is pressed. Save key to VX
-				LD_K(x);
-				break;
+		rngCounter = 0;	// Restart the random sequence of the current seed
 
+		breakpoints.reset();
+		watchedPages = 0;
+		watchCount = 0;
+		conditionCount = 0;
+		stopReason = STOP_NONE;
+		skipTrap = NO_TRAP;
+	}
 
-			case 0x15:	// FX15: Set delay_timer = VX
-				LD_DT(x);
-				break;
 
+	//////////////////////////////////////////////
+	/// \brief Switches to XO-CHIP: 64KB of memory
+	///        for I to reach, F000 NNNN, 5XY2 /
+	///        5XY3 and two planes selected by FN01
+	///
+	/// Call after Initialize, before loading a ROM
+	//////////////////////////////////////////////
+	void EnableXoChip()
+	{
+		high = ZeroHigh();
+	}
 
-			case 0x18:	// FX18: Set sound:timer = VX
-				LD_ST(x);
-				break;
+	bool XoChip() const
+	{
+		return high != nullptr;
+	}
 
 
-			case 0x1E:	// FX1E: Set I = I + VX
-				ADD_I(x);
-				break;
+	//////////////////////////////////////////////
+	/// \brief Seeds the random number generator
+	///
+	/// Every machine owns its generator, so two
+	/// machines with the same seed, ROM and input
+	/// produce the same run
+	///
+	/// \param seed The seed
+	//////////////////////////////////////////////
+	void Seed(uint64_t seed)
+	{
+		rngKey = seed;
+		rngCounter = 0;
+	}
 
 
-			case 0x29:	// FX_29: Set I to font according to VX
-				LD_F(x);
-				break;
+	//////////////////////////////////////////////
+	/// \brief Writes the machine state to a stream
+	///
+	/// \param stream The output stream
+	//////////////////////////////////////////////
+	void SaveState(std::ostream& stream) const
+	{
+		stream.write((const char*)&opcode, sizeof(opcode));
+		for (auto& page : pages)
+			stream.write((const char*)page->bytes, sizeof(page->bytes));
+		stream.write((const char*)V, sizeof(V));
+		stream.write((const char*)&I, sizeof(I));
+		stream.write((const char*)&pc, sizeof(pc));
+		for (unsigned y = 0; y < HEIGHT; y++)
+		{
+			BYTE row[WIDTH];
+			UnpackRow(y, row);
+			stream.write((const char*)row, sizeof(row));
+		}
+		stream.write((const char*)stack, sizeof(stack));
+		stream.write((const char*)&sp, sizeof(sp));
+		stream.write((const char*)key, sizeof(key));
+		stream.write((const char*)&delay_timer, sizeof(delay_timer));
+		stream.write((const char*)&sound_timer, sizeof(sound_timer));
+		stream.write((const char*)&rngKey, sizeof(rngKey));
+		stream.write((const char*)&rngCounter, sizeof(rngCounter));
+
+		BYTE xoChip = XoChip();
+		stream.write((const char*)&xoChip, sizeof(xoChip));
+		stream.write((const char*)&planes, sizeof(planes));
+		if (xoChip)
+			stream.write((const char*)high->bytes, sizeof(high->bytes));
+	}
 
 
-			case 0x33:	// FX33: Store BCD representation of VX in memory locations I, I+1 and I+2
-				LD_B(x);
-				break;
+	//////////////////////////////////////////////
+	/// \brief Reads a machine state written by
+	///        SaveState
+	///
+	/// \param stream The input stream
+	/// \return Whether the whole state could be read
+	//////////////////////////////////////////////
+	bool LoadState(std::istream& stream)
+	{
+		stream.read((char*)&opcode, sizeof(opcode));
+		for (auto& page : pages)
+		{
+			page = std::make_shared<Page>();	// Nothing decoded
+			stream.read((char*)page->bytes, sizeof(page->bytes));
+		}
 
+		stream.read((char*)V, sizeof(V));
+		stream.read((char*)&I, sizeof(I));
+		stream.read((char*)&pc, sizeof(pc));
+		BYTE pixels[WIDTH * HEIGHT];
+		stream.read((char*)pixels, sizeof(pixels));
+		display = std::make_shared<Display>();
+		SetPixels(pixels);
+		stream.read((char*)stack, sizeof(stack));
+		stream.read((char*)&sp, sizeof(sp));
+		stream.read((char*)key, sizeof(key));
+		stream.read((char*)&delay_timer, sizeof(delay_timer));
+		stream.read((char*)&sound_timer, sizeof(sound_timer));
+		stream.read((char*)&rngKey, sizeof(rngKey));
+		stream.read((char*)&rngCounter, sizeof(rngCounter));
+
+		BYTE xoChip = 0;
+		stream.read((char*)&xoChip, sizeof(xoChip));
+		stream.read((char*)&planes, sizeof(planes));
+		high.reset();
+		if (xoChip)
+		{
+			high = std::make_shared<HighMemory>();
+			stream.read((char*)high->bytes, sizeof(high->bytes));
+		}
 
-			case 0x55:	// Fill memory starting at I with values from V0 to VX
-				LD_55(x);
-				break;
+		interrupt = false;
+		drawFlag = true;
+		dirtyRows = ~0u;
+		stopReason = STOP_NONE;
+		skipTrap = NO_TRAP;
 
+		return stream.good();
+	}
 
-			case 0x65:	// FX65: Fill V0 - VX with memory values starting at I
-				LD_65(x);
-				break;
 
-			default:
-				std::cerr << "Unknown OpCode" << std::endl;
-				interrupt = true;
-				//interrupt = true;
-				break;
+	//////////////////////////////////////////////
+	/// \brief Hashes the state SaveState writes,
+	///        except the last opcode and the keys
+	///
+	/// Two machines that will run the same from
+	/// here on hash the same, whatever engine got
+	/// them there
+	///
+	/// \return The hash
+	//////////////////////////////////////////////
+	uint64_t Hash() const
+	{
+		uint64_t hash = HashBytes(0, V, sizeof(V));
+		WORD words[4] = { I, pc, sp, (WORD)((delay_timer << 8) | sound_timer) };
+		hash = HashBytes(hash, words, sizeof(words));
+		hash = HashBytes(hash, stack, sizeof(stack));
+		hash = HashBytes(hash, &rngCounter, sizeof(rngCounter));
 
-			} break;
+		for (auto& page : pages)
+			hash = HashBytes(hash, page->bytes, sizeof(page->bytes));
+
+		if (high)
+		{
+			hash = HashBytes(hash, high->bytes, sizeof(high->bytes));
+			hash = HashBytes(hash, &planes, sizeof(planes));
+		}
 
+		// Same as hashing getDisplay in one go
+		for (unsigned y = 0; y < HEIGHT; y++)
+		{
+			BYTE row[WIDTH];
+			UnpackRow(y, row);
+			hash = HashBytes(hash, row, sizeof(row));
+		}
+		return hash;
+	}
 
 
-		default:
-			std::cerr << "Unknown OpCode" << std::endl;
-			interrupt = true;
-			//interrupt = true;
-			break;
+	//////////////////////////////////////////////
+	/// \brief Folds bytes into a hash, 8 at a time
+	///
+	/// \param hash The hash so far
+	/// \param data The bytes
+	/// \param size Number of bytes
+	/// \return The new hash
+	//////////////////////////////////////////////
+	static uint64_t HashBytes(uint64_t hash, const void* data, size_t size)
+	{
+		const BYTE* bytes = (const BYTE*)data;
+		while (size != 0)
+		{
+			uint64_t word = 0;
+			size_t n = (size < 8) ? size : 8;
+			memcpy(&word, bytes, n);
+			bytes += n;
+			size -= n;
+
+			hash = (hash ^ word) * 0x9E3779B97F4A7C15ull;
+			hash ^= hash >> 29;
 		}
 
-		// Update timers
+		return hash;
 	}
 
-private:
-	WORD opcode;
-
-	BYTE memory[RAM];
-	BYTE V[16];
 
-	WORD I;
-	WORD pc;
+	//////////////////////////////////////////////
+	/// \brief Loads a ROM into memory
+	///
+	/// A .xo8 ROM switches the machine to XO-CHIP
+	///
+	/// \param filepath The path to the ROM
+	//////////////////////////////////////////////
+	void LoadGame(std::string filepath)
+	{
+		if (IsXoChipRom(filepath))
+			EnableXoChip();
 
-	BYTE gfx[WIDTH * HEIGHT];
+		// Open File
+		std::ifstream file(filepath, std::ios::binary);
 
-	WORD stack[16];
-	WORD sp;
+		// All bytes in the file will be stored at 0x200 in memory
+		int offset = 0;
+		while (file.good() && offset < (int)(MemorySize() - 0x200))
+		{
+			Write(0x200 + offset++, (BYTE)file.get());
+		}
 
-	BYTE key[16];
+		Predecode(0x200, (WORD)std::min<unsigned>(0x200 + offset, RAM));
+	}
 
-private:	// Opcodes
 
-	///////////////////0x00E0///////////////////
-	/// \brief Clears display
+	//////////////////////////////////////////////
+	/// \brief Loads a ROM from a buffer into memory
 	///
-	////////////////////////////////////////////
-	void CLS()
+	/// \param data The ROM bytes
+	/// \param size Number of bytes, anything past
+	///             the end of memory is dropped
+	//////////////////////////////////////////////
+	void LoadGame(const BYTE* data, size_t size)
 	{
-		std::fill(std::begin(gfx), std::end(gfx), 0);
-		pc += 0x02;
+		if (size > MemorySize() - 0x200)
+			size = MemorySize() - 0x200;
 
-#ifndef SUPPRESS_PROC_INFO
-		std::cout << "Screen cleared" << std::endl;
-#endif
+		for (size_t i = 0; i < size; i++)
+			Write((WORD)(0x200 + i), data[i]);
+
+		Predecode(0x200, (WORD)std::min<size_t>(0x200 + size, RAM));
 	}
 
 
-	///////////////////0x00EE///////////////////
-	/// \brief Returns from subroutine
+	//////////////////////////////////////////////
+	/// \brief Loads a ROM from an image shared
+	///        with other machines
 	///
-	////////////////////////////////////////////
-	void RET()
+	/// \param image Made by Chip8::Image
+	//////////////////////////////////////////////
+	void LoadGame(const RomImage& image)
 	{
-		pc = stack[--sp] + 0x02;
-
-#ifndef SUPPRESS_PROC_INFO
-		std::cout << "Returned from subroutine" << std::endl;
-#endif
+		std::copy(std::begin(image.pages), std::end(image.pages), std::begin(pages));
+		high = image.high;
 	}
 
-	///////////////////0x1NNN///////////////////
-	/// \brief Jumps to NNN
+
+	//////////////////////////////////////////////
+	/// \brief Continues from a state computed by
+	///        Boot, on an initialized machine
 	///
-	/// \param address NNN
+	/// Only pages that differ from a fresh machine
+	/// get allocated
 	///
-	////////////////////////////////////////////
-	void JP(WORD address)
+	/// \param state The booted state
+	//////////////////////////////////////////////
+	void LoadBoot(const BootState& state)
 	{
-		pc = address;
+		for (WORD addr = 0; addr < RAM; addr++)
+		{
+			if (state.memory[addr] != Read(addr))
+				Write(addr, state.memory[addr]);
+		}
 
-#ifndef SUPPRESS_PROC_INFO
-		std::cout << "Jumped to 0x" << address << std::endl;
-#endif
+		std::copy(std::begin(state.V), std::end(state.V), std::begin(V));
+		std::copy(std::begin(state.stack), std::end(state.stack), std::begin(stack));
+		SetPixels(state.gfx);
+
+		I = state.I;
+		pc = state.pc;
+		sp = state.sp;
+		opcode = state.opcode;
+		delay_timer = state.delay_timer;
+		sound_timer = state.sound_timer;
+
+		drawFlag = true;
+		dirtyRows = ~0u;
 	}
 
-	///////////////////0x2NNN///////////////////
-	/// \brief Calls subroutine at NNN
+
+	//////////////////////////////////////////////
+	/// \brief Loads and decodes a ROM once, for
+	///        any number of machines to share
 	///
-	/// \param address NNN
-	////////////////////////////////////////////
-	void CALL(WORD address)
+	/// \param data   The ROM bytes
+	/// \param size   Number of bytes
+	/// \param xoChip Whether it is an XO-CHIP ROM
+	//////////////////////////////////////////////
+	static RomImage Image(const BYTE* data, size_t size, bool xoChip = false)
 	{
-		stack[sp++] = pc;
-		pc = address;
+		Chip8 machine;
+		machine.Initialize();
+		if (xoChip)
+			machine.EnableXoChip();
+		machine.LoadGame(data, size);
+		machine.Predecode(0, RAM);
+
+		RomImage image;
+		std::copy(std::begin(machine.pages), std::end(machine.pages), std::begin(image.pages));
+		image.high = machine.high;
+		return image;
+	}
 
-#ifndef SUPPRESS_PROC_INFO
-		std::cout << "Called subroutine at 0x" << address << std::endl;
-#endif
+	static RomImage Image(const std::string& filepath)
+	{
+		std::ifstream file(filepath, std::ios::binary);
+		std::vector<BYTE> rom((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+		return Image(rom.data(), rom.size(), IsXoChipRom(filepath));
 	}
 
 
-	///////////////////0x3XKK///////////////////
-	/// \brief Skip next instr if VX = KK
-	///
-	/// \param regX X
-	/// \param byte KK
+	//////////////////////////////////////////////
+	/// \brief Whether a ROM is XO-CHIP, by the .xo8
+	///        extension Octo gives them
 	///
-	////////////////////////////////////////////
-	void SE(BYTE regX, BYTE kk)
+	//////////////////////////////////////////////
+	static bool IsXoChipRom(const std::string& filepath)
 	{
-		if (V[regX] == kk) 
-		{
-			pc += 0x04;
-
-#ifndef SUPPRESS_PROC_INFO
-			std::cout << "Skipped instruction because V" << (WORD)regX << " == " << (WORD)kk << std::endl;
-#endif
-		}
-		else 
-		{
-			pc += 0x02;
+		return filepath.size() >= 4 && filepath.compare(filepath.size() - 4, 4, ".xo8") == 0;
+	}
 
-#ifndef SUPPRESS_PROC_INFO
-			std::cout << "Didn't skip instruction because V" << (WORD)regX << " != " << (WORD)kk << std::endl;
-#endif
-		}
 
+	//////////////////////////////////////////////
+	/// \brief Decodes a range of memory ahead of
+	///        time. Anything not predecoded gets
+	///        decoded the first time it runs
+	///
+	/// \param from First address
+	/// \param to   One past the last address
+	//////////////////////////////////////////////
+	void Predecode(WORD from, WORD to)
+	{
+		for (WORD addr = from; addr < to && addr < RAM; addr++)
+			Decode(addr);
 	}
 
 
-	///////////////////0x4XKK///////////////////
-	/// \brief Skip next instr if VX != KK
-	///
-	/// \param regX X
-	/// \param byte KK
+	//////////////////////////////////////////////
+	/// \brief Sets the state of a key
 	///
-	////////////////////////////////////////////
-	void SNE(BYTE regX, BYTE kk)
+	/// \param k       The key (0x0 - 0xF)
+	/// \param pressed Whether the key is held down
+	//////////////////////////////////////////////
+	void SetKey(BYTE k, bool pressed)
 	{
-		if (V[regX] != kk)
-		{
-			pc += 0x04;
+		key[k & 0xF] = pressed;
+	}
 
-#ifndef SUPPRESS_PROC_INFO
-			std::cout << "Skipped instruction because V" << (WORD)regX << " != " << (WORD)kk << std::endl;
-#endif
-		}
-		else
-		{
-			pc += 0x02;
 
-#ifndef SUPPRESS_PROC_INFO
-			std::cout << "Didn't skip instruction because V" << (WORD)regX << " == " << (WORD)kk << std::endl;
-#endif
-		}
+	//////////////////////////////////////////////
+	/// \brief Stops the machine before it runs the
+	///        instruction at an address
+	///
+	/// \param addr The address
+	//////////////////////////////////////////////
+	void SetBreakpoint(WORD addr)
+	{
+		addr &= ADDR_MASK;
+		OwnBreakpoints().set(addr);
+		Invalidate(addr);	// Also unfuses anything that ran over it
+	}
 
+	//////////////////////////////////////////////
+	/// \brief Removes a breakpoint
+	///
+	/// \param addr The address
+	//////////////////////////////////////////////
+	void ClearBreakpoint(WORD addr)
+	{
+		addr &= ADDR_MASK;
+		if (!breakpoints)
+			return;
+
+		OwnBreakpoints().reset(addr);
+		Invalidate(addr);
 	}
 
 
-	///////////////////0x5XY0///////////////////
-	/// \brief Skip next instr if VX == VY
+	//////////////////////////////////////////////
+	/// \brief Stops the machine after it wrote to
+	///        a range of memory
 	///
-	/// \param regX X
-	/// \param regY Y
-	///
-	////////////////////////////////////////////
-	void SE_XY(BYTE regX, BYTE regY)
+	/// \param from First address
+	/// \param to   One past the last address
+	/// \return False if there are too many watches
+	//////////////////////////////////////////////
+	bool WatchWrites(WORD from, WORD to)
 	{
-		if (V[regX] == V[regY])
-		{
-			pc += 0x04;
-
-#ifndef SUPPRESS_PROC_INFO
-			std::cout << "Skipped instruction because V" << (WORD)regX << " != V" << (WORD)regY << std::endl;
-#endif
-		}
-		else
-		{
-			pc += 0x02;
+		if (watchCount == MAX_WATCHES || from >= to || to > RAM)
+			return false;
 
-#ifndef SUPPRESS_PROC_INFO
-			std::cout << "Didn't skip instruction because V" << (WORD)regX << " == V" << (WORD)regY << std::endl;
-#endif
-		}
+		watches[watchCount++] = Watch{ from, to };
+		for (WORD page = from >> 8; page <= (to - 1) >> 8; page++)
+			watchedPages |= 1 << page;
 
+		return true;
 	}
 
 
-	///////////////////0x6XKK///////////////////
-	/// \brief Sets VX to KK
+	//////////////////////////////////////////////
+	/// \brief Stops the machine after an
+	///        instruction changed a register
 	///
-	/// \param regX X
-	/// \param byte KK
-	////////////////////////////////////////////
-	void LD(BYTE regX, BYTE byte)
+	/// \param reg   V0 - VF, or REG_I
+	/// \param value Only stop when it becomes this
+	///              value, -1 for any change
+	/// \return False if there are too many conditions
+	//////////////////////////////////////////////
+	bool BreakOnRegister(BYTE reg, int value = -1)
 	{
-		V[regX] = byte;
-		pc += 0x02;
+		if (conditionCount == MAX_CONDITIONS || reg > REG_I)
+			return false;
 
-#ifndef SUPPRESS_PROC_INFO
-		std::cout << "Set V" << (WORD)regX << " to 0x" << (WORD)byte << std::endl;
-#endif
+		conditions[conditionCount++] = Condition{ reg, value, Register(reg) };
+		return true;
 	}
 
-
-	//////////////////0x7XKK///////////////////
-	/// \brief Adds KK to VX
+	//////////////////////////////////////////////
+	/// \brief Removes all watches and register
+	///        conditions
 	///
-	/// \param regX X
-	/// \param byte KK
-	////////////////////////////////////////////
-	void ADD(BYTE regX, BYTE byte)
+	//////////////////////////////////////////////
+	void ClearWatches()
 	{
-		V[regX] += byte;
-		pc += 0x02;
-
-#ifndef SUPPRESS_PROC_INFO
-		std::cout << "Added 0x" << (WORD)byte << " to V" << (WORD)regX << std::endl;
-#endif
+		watchedPages = 0;
+		watchCount = 0;
+		conditionCount = 0;
 	}
 
 
-	//////////////////0x8XY0///////////////////
-	/// \brief Stores value of VY in VX
+	//////////////////////////////////////////////
+	/// \brief Lets a machine stopped by the
+	///        debugger run again
 	///
-	/// \param regX X
-	/// \param regY Y
-	////////////////////////////////////////////
-	void LD_XY(BYTE regX, BYTE regY)
+	//////////////////////////////////////////////
+	void Resume()
 	{
-		V[regX] = V[regY];
+		if (stopReason == STOP_NONE)
+			return;
 
-		pc += 0x02;
+		// The next Execute runs the instruction under the breakpoint
+		if (stopReason == STOP_BREAKPOINT)
+			skipTrap = stopAddress;
 
-#ifndef SUPPRESS_PROC_INFO
-		std::cout << "V" << (WORD)regY << "(0x" << (WORD) V[regY] << ") => V" << (WORD)regX << std::endl;
-#endif
+		stopReason = STOP_NONE;
+		interrupt = false;
 	}
 
 
-	//////////////////0x8XY1///////////////////
-	/// \brief VX = VX | VY
+	//////////////////////////////////////////////
+	/// \brief Prints the registers
 	///
-	/// \param regX X
-	/// \param regY Y
-	////////////////////////////////////////////
-	void OR(BYTE regX, BYTE regY)
+	//////////////////////////////////////////////
+	void DumpRegisters(std::ostream& stream) const
 	{
-		V[regX] |= V[regY];
+		stream << std::uppercase << std::hex
+			<< "PC " << pc << "  OP " << Fetch(pc) << "  I " << I << "  SP " << sp
+			<< "  DT " << (WORD)delay_timer << "  ST " << (WORD)sound_timer << std::endl;
 
-		pc += 0x02;
+		for (int i = 0; i < 16; i++)
+			stream << "V" << i << " " << (WORD)V[i] << ((i % 8 == 7) ? "\n" : "  ");
 
-#ifndef SUPPRESS_PROC_INFO
-		std::cout << "V" << (WORD)regX << " |= V" << (WORD)regY << "(0x" << (WORD)V[regY] << ") => " << (WORD)V[regX] << std::endl;
-#endif
+		stream << std::dec;
 	}
 
 
-	//////////////////0x8XY2///////////////////
-	/// \brief VX = VX & VY
+	//////////////////////////////////////////////
+	/// \brief Sets all keys at once
 	///
-	/// \param regX X
-	/// \param regY Y
-	////////////////////////////////////////////
-	void AND(BYTE regX, BYTE regY)
+	/// \param mask Bit k is set if key k is held
+	//////////////////////////////////////////////
+	void SetKeys(WORD mask)
 	{
-		V[regX] &= V[regY];
-
-		pc += 0x02;
-
-#ifndef SUPPRESS_PROC_INFO
-		std::cout << "V" << (WORD)regX << " &= V" << (WORD)regY << "(0x" << (WORD)V[regY] << ") => " << (WORD)V[regX] << std::endl;
-#endif
+		for (BYTE k = 0; k < 16; k++)
+			key[k] = (mask >> k) & 1;
 	}
 
 
-	//////////////////0x8XY3///////////////////
-	/// \brief VX = VX ^ VY
+	//////////////////////////////////////////////
+	/// \brief Returns all keys at once
 	///
-	/// \param regX X
-	/// \param regY Y
-	////////////////////////////////////////////
-	void XOR(BYTE regX, BYTE regY)
+	/// \return Bit k is set if key k is held
+	//////////////////////////////////////////////
+	WORD GetKeys() const
 	{
-		V[regX] ^= V[regY];
+		WORD mask = 0;
+		for (BYTE k = 0; k < 16; k++)
+			mask |= (WORD)(key[k] != 0) << k;
+		return mask;
+	}
 
-		pc += 0x02;
 
-#ifndef SUPPRESS_PROC_INFO
-		std::cout << "V" << (WORD)regX << " ^= V" << (WORD)regY << "(0x" << (WORD)V[regY] << ") => " << (WORD)V[regX] << std::endl;
-#endif
+	//////////////////////////////////////////////
+	/// \brief Returns a copy of the machine
+	///
+	/// The copy shares memory and display with
+	/// this machine until one of them writes to
+	/// them, so forking does not depend on the
+	/// size of the state. Forks can run on other
+	/// threads than their parent
+	//////////////////////////////////////////////
+	Chip8 Fork() const
+	{
+		return *this;
 	}
 
 
-	//////////////////0x8XY4///////////////////
-	/// \brief VX = VX + VY, VF = carry
+	//////////////////////////////////////////////
+	/// \brief Whether the machine is stuck on FX0A
+	///        until a key goes down
 	///
-	/// \param regX X
-	/// \param regY Y
-	////////////////////////////////////////////
-	void ADD_XY(BYTE regX, BYTE regY)
+	//////////////////////////////////////////////
+	bool WaitingForKey() const
 	{
-		if (V[regY] > 0xFF - V[regX])
-			V[0xF] = 1;
-		else
-			V[0xF] = 0;
+		if (DecodeOp(Fetch(pc)) != OP_LD_K)
+			return false;
 
-		V[regX] = (V[regX] + V[regY]) & 0xFF;
-		pc += 0x02;
+		for (BYTE k = 0x0; k < 0xF; k++)	// Same keys LD_K looks at
+		{
+			if (key[k])
+				return false;
+		}
 
-#ifndef SUPPRESS_PROC_INFO
-		std::cout << "V" << (WORD)regX << " += V" << (WORD)regY << "(0x" << (WORD)V[regY] << ") => " << (WORD)V[regX] << ", Carry = " << (WORD)V[0xF] << std::endl;
-#endif
+		return true;
 	}
 
 
-	//////////////////0x8XY5///////////////////
-	/// \brief VX = VX - VY, VF = NOT borrow
+	//////////////////////////////////////////////
+	/// \brief Reads a byte of memory
 	///
-	/// \param regX X
-	/// \param regY Y
-	////////////////////////////////////////////
-	void SUB(BYTE regX, BYTE regY)
+	//////////////////////////////////////////////
+	BYTE Peek(WORD addr) const
 	{
-		if (V[regX] > V[regY])
-			V[0xF] = 1;
-		else
-			V[0xF] = 0;
-
-		V[regX] = (V[regX] - V[regY]) & 0xFF;
-		pc += 0x02;
-
-#ifndef SUPPRESS_PROC_INFO
-		std::cout << "V" << (WORD)regX << " -= V" << (WORD)regY << "(0x" << (WORD)V[regY] << ") => " << (WORD)V[regX] << ", Carry = " << (WORD)V[0xF] << std::endl;
-#endif
+		return Read(addr);
 	}
 
 
-	//////////////////0x8XY6///////////////////
-	/// \brief VX = VX >> 1, VF = LSB of VX
+	//////////////////////////////////////////////
+	/// \brief Reads a register
 	///
-	/// \param regX X
-	/// \param regY Y
-	////////////////////////////////////////////
-	void SHR(BYTE regX, BYTE regY)
+	/// \param reg V0 - VF, or REG_I
+	//////////////////////////////////////////////
+	WORD Register(BYTE reg) const
 	{
-		V[0xF] = V[regX] & 0x1;
-		V[regX] >>= 1;
+		return (reg == REG_I) ? I : V[reg & 0xF];
+	}
 
-		pc += 0x02;
 
-#ifndef SUPPRESS_PROC_INFO
-		std::cout << "Shifted V" << (WORD)regX << " right once. VF = " << (WORD)V[0xF] << std::endl;
-#endif
+	//////////////////////////////////////////////
+	/// \brief Has every machine the calling thread
+	///        runs publish pc and the call stack
+	///        when a profiler asks for them
+	///
+	/// A machine checks the slot once per Execute
+	/// and only writes to it when asked
+	///
+	/// \param slot Null to stop
+	//////////////////////////////////////////////
+	static void PublishTo(ProfileSlot* slot)
+	{
+		t_profileSlot = slot;
 	}
 
 
-	//////////////////0x8XY7///////////////////
-	/// \brief VX = VY - VX, VF = NOT borrow
+	//////////////////////////////////////////////
+	/// \brief Counts the timers down by one tick.
+	///        Should be called at 60Hz
 	///
-	/// \param regX X
-	/// \param regY Y
-	////////////////////////////////////////////
-	void SUBN(BYTE regX, BYTE regY)
+	//////////////////////////////////////////////
+	void UpdateTimers()
 	{
-		if (V[regY] > V[regX])
-			V[0xF] = 1;
-		else
-			V[0xF] = 0;
-
-		V[regX] = (V[regY] - V[regX]) & 0xFF;
-		pc += 0x02;
+		if (delay_timer != 0)
+			delay_timer--;
 
-#ifndef SUPPRESS_PROC_INFO
-		std::cout << "V" << (WORD)regX << " = V" << (WORD)regY << "(0x" << (WORD)V[regY] << ") - V" << (WORD)regX << " => " << (WORD)V[regX] << ", Carry = " << (WORD)V[0xF] << std::endl;
-#endif
+		if (sound_timer != 0)
+			sound_timer--;
 	}
 
-
-	//////////////////0x8XYE///////////////////
-	/// \brief VX = VX >> 1, VF = LSB of VX
+	//////////////////////////////////////////////
+	/// \brief Returns the current display, one
+	///        byte per pixel
 	///
-	/// \param regX X
-	/// \param regY Y
-	////////////////////////////////////////////
-	void SHL(BYTE regX, BYTE regY)
+	/// Bit n of a pixel is set if it is lit in
+	/// plane n, so CHIP-8 pixels are 0 or 1. Only
+	/// rows drawn since the last call are unpacked,
+	/// into a buffer of this machine, so a display
+	/// shared with forks is never copied for it
+	//////////////////////////////////////////////
+	const BYTE* getDisplay()
 	{
-		V[0xF] = V[regX] & 0x80;
-		V[regX] <<= 1;
-
-		pc += 0x02;
+		if (stale != 0)
+		{
+			for (unsigned y = 0; y < HEIGHT; y++)
+			{
+				if (stale & (1u << y))
+					UnpackRow(y, unpacked + y * WIDTH);
+			}
+			stale = 0;
+		}
 
-#ifndef SUPPRESS_PROC_INFO
-		std::cout << "Shifted V" << (WORD)regX << " left once. VF = " << (WORD)V[0xF] << std::endl;
-#endif
+		return unpacked;
 	}
 
 
-	///////////////////0x9XY0///////////////////
-	/// \brief Skip next instr if VX != VY
+	//////////////////////////////////////////////
+	/// \brief Packs the display to 1 bit per pixel
 	///
-	/// \param regX X
-	/// \param regY Y
+	/// Rows are 8 bytes each, the most significant
+	/// bit of a byte is the leftmost pixel. A pixel
+	/// is set if it is lit in any plane
 	///
-	////////////////////////////////////////////
-	void SNE_XY(BYTE regX, BYTE regY)
+	/// \param packed PACKED_SIZE bytes of output
+	//////////////////////////////////////////////
+	void GetPackedDisplay(BYTE* packed) const
 	{
-		if (V[regX] != V[regY])
+		for (unsigned y = 0; y < HEIGHT; y++)
 		{
-			pc += 0x04;
-
-#ifndef SUPPRESS_PROC_INFO
-			std::cout << "Skipped instruction because V" << (WORD)regX << " != V" << (WORD)regY << std::endl;
-#endif
+			uint64_t row = display->rows[0][y] | display->rows[1][y];
+			for (unsigned i = 0; i < 8; i++)
+				packed[y * 8 + i] = (BYTE)(row >> (56 - i * 8));
 		}
-		else
-		{
-			pc += 0x02;
+	}
+
+
+	//////////////////////////////////////////////
+	/// \brief Goes through one emulation cycle
+	///
+	//////////////////////////////////////////////
+	void EmulateCycle()
+	{
+		// Fetch opcode
+		opcode = Fetch(pc);
 
 #ifndef SUPPRESS_PROC_INFO
-			std::cout << "Didn't skip instruction because V" << (WORD)regX << " == V" << (WORD)regY << std::endl;
+		std::cout << std::uppercase << std::hex << opcode << ": ";
 #endif
-		}
 
-	}
+		BYTE x = (opcode & 0x0F00) >> 8;
+		BYTE y = (opcode & 0x00F0) >> 4;
+		BYTE n = (opcode & 0x000F);
+		BYTE kk = (opcode & 0x00FF);
+		WORD nnn = (opcode & 0x0FFF);
 
+		// Decode opcode
+		// Execute opcode
 
-	///////////////////0xANNN///////////////////
-	/// \brief Sets I to NNN
-	///
-	/// \param address NNN
-	////////////////////////////////////////////
-	void LD(WORD address)
-	{
-		I = address;
-		pc += 0x02;
+		switch (opcode & 0xF000)
+		{
+		case 0x0000:	// Multi case opcode
+			switch (opcode & 0x00FF)
+			{
+			case 0xE0:	// Clear display
+				CLS();
+				break;
+
+			case 0xEE:	// Return from subroutine
+				RET();
+				break;
+
+			default:
+				UnknownOpcode();
+				break;
+			}
+			break;
+
+
+		case 0x1000:	// 1NNN: Set Program counter to NNN
+			JP(nnn);
+			break;
+
+
+		case 0x2000:	// 2NNN: Calls subroutine at NNN
+			CALL(nnn);
+			break;
+
+
+		case 0x3000:	// 3XKK: If VX == KK, skip next instruction
+			SE(x, kk);
+			break;
+
+
+		case 0x4000:	// 4XKK: If VX != KK, skip next instruction
+			SNE(x, kk);
+			break;
+
+		case 0x5000:
+			if (XoChip() && n == 0x2)		// 5XY2: Store VX - VY at I (XO-CHIP)
+				SAVE_XY(x, y);
+			else if (XoChip() && n == 0x3)	// 5XY3: Load VX - VY from I (XO-CHIP)
+				LOAD_XY(x, y);
+			else
+				SE_XY(x, y);
+			break;
+
+
+		case 0x6000:	// 6XKK: Sets VX to KK
+			LD(x, kk);
+			break;
+
+
+		case 0x7000:	// 7XKK: Adds KK to the value of VX
+			ADD(x, kk);
+			break;
+
+
+		case 0x8000:	// Multi case opcode
+			switch (opcode & 0x000F)
+			{
+			case 0x0:	// 8XY0: Set VX = VY
+				LD_XY(x, y);
+				break;
+
+			case 0x1:	// 8XY1: Set VX = VX | VY
+				OR(x, y);
+				break;
+
+
+			case 0x2:	// 8XY2: VX = VX & VY
+				AND(x, y);
+				break;
+
+
+			case 0x3:	// 8XY3: VX = VX ^ VY
+				XOR(x, y);
+				break;
+
+
+			case 0x4:	// 8XY4: VX = VX + VY; Carry = overflow
+				ADD_XY(x, y);
+				break;
+
+
+			case 0x5:	// 8XY5: VX = VX - VY, set VF = NOT borrow
+				SUB(x, y);
+				break;
+
+
+			case 0x6:	// 8XY6: VX = VX >> 1. VF = VX least significant bit
+				SHR(x, y);
+				break;
+
+
+			case 0x7:	// 8XY7: VX = VY - VX, set VF = NOT borrow
+				SUBN(x, y);
+				break;
+
+
+			case 0xE:
+				SHL(x, y);
+				break;
+
+
+			default:
+				UnknownOpcode();
+				break;
+			} break;
+
+
+		case 0x9000:	// 9XY0: Skip next instruction of VX != VY
+			SNE_XY(x, y);
+			break;
+
+
+		case 0xA000:	// ANNN: Set register I to NNN
+			LD(nnn);
+			break;
+
+
+		case 0xB000:	// BNNN: Jump to location NNN + V0
+			JP_V(nnn);
+			break;
+
+
+		case 0xC000:	// Set VX to a random byte & kk
+			RND(x, kk);
+			break;
+
+
+		case 0xD000:	// DXYN: Draw the N byte long sprite stored at I at position (VX, VY). Set VF = 1 if collision
+			DRW(x, y, n);
+			break;
+
+
+		case 0xE000:	// Multi case opcode
+			switch (opcode & 0x00FF)
+			{
+			case 0x9E:	// EX9E: Skip next instruction is key with value VX is pressed
+				SKP(x);
+				break;
+
+
+			case 0xA1:	// EXA1: Skip next instruction is key with value VX is not pressed
+				SKNP(x);
+				break;
+
+
+			default:
+				UnknownOpcode();
+				break;
+			}
+			break;
+
+
+		case 0xF000:	// Multi case opcode
+			switch (opcode & 0x00FF)
+			{
+			case 0x00:	// F000 NNNN: Set I = NNNN (XO-CHIP)
+				if (XoChip() && x == 0)
+					LD_I_LONG();
+				else
+					UnknownOpcode();
+				break;
+
+
+			case 0x01:	// FN01: Draw to the planes in N (XO-CHIP)
+				if (XoChip())
+					PLANE(x);
+				else
+					UnknownOpcode();
+				break;
+
+
+			case 0x07:	// FX07: Set VX = delay_timer
+				LD_X(x);
+				break;
+
+
+			case 0x0A:	// FX0A: Halt program until key is pressed. Save key to VX
+				LD_K(x);
+				break;
+
+
+			case 0x15:	// FX15: Set delay_timer = VX
+				LD_DT(x);
+				break;
+
+
+			case 0x18:	// FX18: Set sound:timer = VX
+				LD_ST(x);
+				break;
+
+
+			case 0x1E:	// FX1E: Set I = I + VX
+				ADD_I(x);
+				break;
+
+
+			case 0x29:	// FX_29: Set I to font according to VX
+				LD_F(x);
+				break;
+
+
+			case 0x33:	// FX33: Store BCD representation of VX in memory locations I, I+1 and I+2
+				LD_B(x);
+				break;
+
+
+			case 0x55:	// Fill memory starting at I with values from V0 to VX
+				LD_55(x);
+				break;
+
+
+			case 0x65:	// FX65: Fill V0 - VX with memory values starting at I
+				LD_65(x);
+				break;
+
+			default:
+				UnknownOpcode();
+				break;
+
+			} break;
+
+
+
+		default:
+			UnknownOpcode();
+			break;
+		}
+
+		// Update timers
+	}
+
+
+	//////////////////////////////////////////////
+	/// \brief Runs instructions from the decoded
+	///        table. Same results as calling
+	///        EmulateCycle the same number of times
+	///
+	/// \param cycles Instructions to run
+	/// \return Instructions actually run, fewer if
+	///         the machine stopped
+	//////////////////////////////////////////////
+	unsigned Execute(unsigned cycles)
+	{
+		if (conditionCount != 0)
+			return ExecuteChecked(cycles);
+
+		// Only a thread with a profiler checks for its requests
+		return t_profileSlot ? Dispatch<true>(cycles) : Dispatch<false>(cycles);
+	}
+
+private:
+	//////////////////////////////////////////////
+	/// \brief The loop of Execute
+	///
+	/// \param bProfiled Whether the thread has a
+	///                  ProfileSlot
+	//////////////////////////////////////////////
+	template<bool bProfiled>
+	unsigned Dispatch(unsigned cycles)
+	{
+		unsigned done = 0;
+		ProfileSlot* slot = t_profileSlot;
+		WORD previous = pc;		// Where the last dispatch started
+		unsigned started = 0;	// done when it started
+
+		// A profiler request that came while the machine was idle is
+		// served at a random one of these instructions, one that comes
+		// while it runs at the next dispatch
+		bool bWaiting = bProfiled && slot->wanted.load(std::memory_order_relaxed);
+		unsigned sampleAt = bWaiting ? slot->Jitter() % std::max(cycles, 1u) : 0;
+
+		while (done < cycles && !interrupt)
+		{
+			if (bProfiled && done >= sampleAt && slot->wanted.load(std::memory_order_relaxed))
+			{
+				// Time inside a superinstruction is charged to where it started
+				bool bInside = bWaiting ? done > sampleAt : done - started > 1;
+				Publish(*slot, bInside ? previous : pc);
+				bWaiting = false;
+				sampleAt = 0;
+			}
+			started = done;
+
+			WORD addr = pc & ADDR_MASK;
+			previous = addr;
+			Decoded d = pages[addr >> 8]->code[addr & (PAGE_SIZE - 1)];
+
+			opcode = d.opcode;
+			BYTE x = (opcode & 0x0F00) >> 8;
+			BYTE y = (opcode & 0x00F0) >> 4;
+			BYTE n = (opcode & 0x000F);
+			BYTE kk = (opcode & 0x00FF);
+			WORD nnn = (opcode & 0x0FFF);
+
+			// Superinstructions only run whole if they fit into
+			// the budget, otherwise they run their first part
+			unsigned left = cycles - done;
+
+			switch (d.op)
+			{
+			case OP_UNDECODED:	Decode(addr); continue;
+			case OP_UNKNOWN:	UnknownOpcode(); continue;
+
+			case OP_TRAP:
+				if (addr != skipTrap)
+				{
+					interrupt = true;
+					stopReason = STOP_BREAKPOINT;
+					stopAddress = addr;
+					continue;
+				}
+
+				skipTrap = NO_TRAP;
+				EmulateCycle();
+				break;
+
+			case OP_CLS:		CLS(); break;
+			case OP_RET:		RET(); break;
+			case OP_JP:			JP(nnn); break;
+			case OP_CALL:		CALL(nnn); break;
+			case OP_SE:			SE(x, kk); break;
+			case OP_SNE:		SNE(x, kk); break;
+			case OP_SE_XY:		SE_XY(x, y); break;
+			case OP_LD:			LD(x, kk); break;
+			case OP_SNE_XY:		SNE_XY(x, y); break;
+			case OP_LD_I:		LD(nnn); break;
+			case OP_JP_V:		JP_V(nnn); break;
+			case OP_RND:		RND(x, kk); break;
+			case OP_DRW:		DRW(x, y, n); break;
+			case OP_SKP:		SKP(x); break;
+			case OP_SKNP:		SKNP(x); break;
+			case OP_LD_X:		LD_X(x); break;
+			case OP_LD_K:		LD_K(x); break;
+			case OP_LD_DT:		LD_DT(x); break;
+			case OP_LD_ST:		LD_ST(x); break;
+			case OP_ADD_I:		ADD_I(x); break;
+			case OP_LD_F:		LD_F(x); break;
+			case OP_LD_B:		LD_B(x); break;
+			case OP_LD_55:		LD_55(x); break;
+			case OP_LD_65:		LD_65(x); break;
+			case OP_LD_I_LONG:	LD_I_LONG(); break;
+			case OP_SAVE_XY:	SAVE_XY(x, y); break;
+			case OP_LOAD_XY:	LOAD_XY(x, y); break;
+			case OP_PLANE:		PLANE(x); break;
+
+			case OP_ADD: case OP_LD_XY: case OP_OR: case OP_AND: case OP_XOR:
+			case OP_ADD_XY: case OP_SUB: case OP_SHR: case OP_SUBN: case OP_SHL:
+				InlineAlu(opcode);
+				break;
+
+			case OP_LD_SKP:
+				LD(x, kk);
+				if (left < 2)
+					break;
+
+				opcode = Fetch(addr + 2);
+				SKP(x);
+				done++;
+				break;
+
+			case OP_LD_SKNP:
+				LD(x, kk);
+				if (left < 2)
+					break;
+
+				opcode = Fetch(addr + 2);
+				SKNP(x);
+				done++;
+				break;
+
+			case OP_LD_I_DRW:
+				LD(nnn);
+				if (left < 2)
+					break;
+
+				opcode = Fetch(addr + 2);
+				DRW((opcode & 0x0F00) >> 8, (opcode & 0x00F0) >> 4, opcode & 0x000F);
+				done++;
+				break;
+
+			case OP_ALU_PAIR:
+				InlineAlu(opcode);
+				if (left < 2)
+					break;
+
+				opcode = Fetch(addr + 2);
+				InlineAlu(opcode);
+				done++;
+				break;
+
+			case OP_ALU_PAIR_DEAD_VF:
+				// The flag is only dead if the second one runs
+				if (left < 2)
+				{
+					InlineAlu(opcode);
+					break;
+				}
+
+				InlineAlu<false>(opcode);
+				opcode = Fetch(addr + 2);
+				InlineAlu(opcode);
+				done++;
+				break;
+
+			case OP_SKIP_JP:
+				Skip(opcode);
+				if (left < 2 || pc != addr + 2)
+					break;
+
+				opcode = Fetch(addr + 2);
+				if ((opcode & 0xF000) == 0x1000)
+					JP(opcode & 0x0FFF);
+				else
+					CALL(opcode & 0x0FFF);
+				done++;
+				break;
+
+			case OP_WAIT_DT:
+				if (left < 3)
+				{
+					LD_X(x);
+					break;
+				}
+
+				V[x] = delay_timer;
+				if (V[x] == 0)
+				{
+					// 3X00 skips the jump
+					opcode = Fetch(addr + 2);
+					pc += 6;
+					done++;
+					break;
+				}
+
+				opcode = Fetch(addr + 4);
+				pc = opcode & 0x0FFF;
+				if (pc != addr)
+				{
+					done += 2;
+					break;
+				}
+
+				// Waiting on itself. The timer only changes between
+				// frames, so every round that fits the budget ends the same
+				done += (left / 3) * 3 - 1;
+				break;
+
+			case OP_COUNT_LOOP:
+			{
+				if (left < 3)
+				{
+					ADD(x, kk);
+					break;
+				}
+
+				unsigned ran = 0;
+				do
+				{
+					V[x] += kk;
+					ran += 3;
+				} while (V[x] != 0 && left - ran >= 3);
+
+				if (V[x] == 0)
+				{
+					// 3X00 skipped the jump on the last round
+					// One round ran from pc, later ones from the jump target
+					opcode = Fetch(addr + 2);
+					pc = ((ran == 3) ? pc : addr) + 6;
+					ran--;
+				}
+				else
+				{
+					opcode = Fetch(addr + 4);
+					pc = addr;
+				}
+
+				done += ran - 1;
+				break;
+			}
+			}
+
+			done++;
+		}
+
+		return done;
+	}
+
+private:
+	WORD opcode;
+
+	std::shared_ptr<Page> pages[PAGES];		// Memory
+	std::shared_ptr<HighMemory> high;		// XO-CHIP memory above RAM, null for CHIP-8
+	BYTE V[16];
+
+	WORD I;
+	WORD pc;
+
+	std::shared_ptr<Display> display;
+	BYTE unpacked[WIDTH * HEIGHT];	// display as getDisplay returns it
+	uint32_t stale;					// Bit y is set if row y of unpacked is out of date
+	BYTE planes;			// Bit n is set if DRW and CLS work on plane n
+
+	WORD stack[16];
+	WORD sp;
+
+	BYTE key[16];
+
+	std::shared_ptr<std::bitset<RAM>> breakpoints;		// Null until the first one is set
+	WORD skipTrap;			// Breakpoint to run through once after Resume
+	WORD watchedPages;		// Bit n is set if a watch covers 0xn00 - 0xnFF
+	Watch watches[MAX_WATCHES];
+	BYTE watchCount;
+	Condition conditions[MAX_CONDITIONS];
+	BYTE conditionCount;
+
+	inline static thread_local ProfileSlot* t_profileSlot = nullptr;	// Set by PublishTo
+
+	uint64_t rngKey;		// Seed of the random number generator
+	uint64_t rngCounter;	// Number of random values drawn so far
+
+private:
+	//////////////////////////////////////////////
+	/// \brief Returns the next random value
+	///
+	/// Counter based (SplitMix64): the value only
+	/// depends on the seed and the number of values
+	/// drawn before, so the generator state is two
+	/// integers and can be saved with the machine
+	//////////////////////////////////////////////
+	uint64_t NextRandom()
+	{
+		uint64_t z = rngKey + (++rngCounter) * 0x9E3779B97F4A7C15ull;
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		return z ^ (z >> 31);
+	}
+
+	BYTE Read(WORD addr) const
+	{
+		// Only XO-CHIP has memory above RAM, CHIP-8 wraps
+		if (addr >= RAM && high)
+			return high->bytes[addr - RAM];
+
+		addr &= ADDR_MASK;
+		return pages[addr >> 8]->bytes[addr & (PAGE_SIZE - 1)];
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Reads an opcode. Code always runs
+	///        from below RAM, like Execute decodes it
+	///
+	//////////////////////////////////////////////
+	WORD Fetch(WORD addr) const
+	{
+		WORD next = (addr + 1) & ADDR_MASK;
+		addr &= ADDR_MASK;
+		return (pages[addr >> 8]->bytes[addr & (PAGE_SIZE - 1)] << 8) | pages[next >> 8]->bytes[next & (PAGE_SIZE - 1)];
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Writes a byte to memory and drops
+	///        the decoded entries it makes stale
+	///
+	//////////////////////////////////////////////
+	void Write(WORD addr, BYTE value)
+	{
+		if (addr >= RAM && high)
+		{
+			OwnHigh().bytes[addr - RAM] = value;
+			return;
+		}
+
+		addr &= ADDR_MASK;
+		Own(addr >> 8).bytes[addr & (PAGE_SIZE - 1)] = value;
+		Invalidate(addr);
+	}
+
+	unsigned MemorySize() const
+	{
+		return high ? XO_RAM : RAM;
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Whether this machine holds the only
+	///        reference, so it may write through it
+	///
+	/// Only other holders can make the count go up,
+	/// so a count of one cannot change under us. But
+	/// use_count is a relaxed load: the fence orders
+	/// it after the release another thread did when
+	/// it dropped its reference, so the writes that
+	/// follow cannot race that thread's last reads
+	//////////////////////////////////////////////
+	template <typename T>
+	static bool Unshared(const std::shared_ptr<T>& shared)
+	{
+		if (shared.use_count() > 1)
+			return false;
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return true;
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Returns a page this machine can
+	///        write to, copying it if it is shared
+	///
+	//////////////////////////////////////////////
+	Page& Own(WORD index)
+	{
+		std::shared_ptr<Page>& page = pages[index & (PAGES - 1)];
+		if (!Unshared(page))
+			page = std::make_shared<Page>(*page);
+
+		return *page;
+	}
+
+	HighMemory& OwnHigh()
+	{
+		if (!Unshared(high))
+			high = std::make_shared<HighMemory>(*high);
+
+		return *high;
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Pages and display every machine
+	///        starts with
+	///
+	//////////////////////////////////////////////
+	static const std::shared_ptr<Page>& ZeroPage()
+	{
+		static const std::shared_ptr<Page> page = std::make_shared<Page>();
+		return page;
+	}
+
+	static const std::shared_ptr<Page>& FontPage()
+	{
+		static const std::shared_ptr<Page> page = []()
+		{
+			auto font = std::make_shared<Page>();
+			std::copy(fontset, fontset + FONTSET_SIZE, font->bytes);
+			return font;
+		}();
+		return page;
+	}
+
+	static const std::shared_ptr<Display>& BlankDisplay()
+	{
+		static const std::shared_ptr<Display> display = std::make_shared<Display>();
+		return display;
+	}
+
+	static const std::shared_ptr<HighMemory>& ZeroHigh()
+	{
+		static const std::shared_ptr<HighMemory> high = std::make_shared<HighMemory>();
+		return high;
+	}
+
+	bool IsBreakpoint(WORD addr) const
+	{
+		return breakpoints && (*breakpoints)[addr & ADDR_MASK];
+	}
+
+	std::bitset<RAM>& OwnBreakpoints()
+	{
+		if (!breakpoints)
+			breakpoints = std::make_shared<std::bitset<RAM>>();
+		else if (!Unshared(breakpoints))
+			breakpoints = std::make_shared<std::bitset<RAM>>(*breakpoints);
+
+		return *breakpoints;
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Returns the display for writing,
+	///        copying it if it is shared
+	///
+	//////////////////////////////////////////////
+	Display& OwnDisplay()
+	{
+		if (!Unshared(display))
+			display = std::make_shared<Display>(*display);
+
+		return *display;
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Unpacks a row of the display to one
+	///        byte per pixel, as getDisplay has it
+	///
+	//////////////////////////////////////////////
+	void UnpackRow(unsigned y, BYTE* pixels) const
+	{
+		uint64_t plane0 = display->rows[0][y];
+		uint64_t plane1 = display->rows[1][y];
+		for (unsigned x = 0; x < WIDTH; x++)
+			pixels[x] = (BYTE)(((plane0 >> (63 - x)) & 1) | (((plane1 >> (63 - x)) & 1) << 1));
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Replaces the display with one byte
+	///        per pixel, as getDisplay returns it
+	///
+	//////////////////////////////////////////////
+	void SetPixels(const BYTE* pixels)
+	{
+		Display& d = OwnDisplay();
+		for (unsigned y = 0; y < HEIGHT; y++)
+		{
+			for (unsigned p = 0; p < PLANES; p++)
+			{
+				uint64_t row = 0;
+				for (unsigned x = 0; x < WIDTH; x++)
+					row |= (uint64_t)((pixels[y * WIDTH + x] >> p) & 1) << (63 - x);
+				d.rows[p][y] = row;
+			}
+		}
+		stale = ~0u;
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Fills the decoded entry of an
+	///        address, fusing it with the following
+	///        instructions where possible
+	///
+	//////////////////////////////////////////////
+	void Decode(WORD addr)
+	{
+		WORD first = Fetch(addr);
+		OP op = DecodeOp(first, XoChip());
+
+		Decoded& entry = Own(addr >> 8).code[addr & (PAGE_SIZE - 1)];
+
+		if (IsBreakpoint(addr))
+		{
+			entry = Decoded{ first, OP_TRAP };
+			return;
+		}
+
+#ifdef SUPPRESS_PROC_INFO	// Fused instructions would log differently
+		// Never fuse over a breakpoint
+		if (IsBreakpoint(addr + 2) || IsBreakpoint(addr + 4))
+		{
+			entry = Decoded{ first, (BYTE)op };
+			return;
+		}
+
+		WORD second = Fetch(addr + 2);
+		OP next = DecodeOp(second, XoChip());
+		BYTE x = (first & 0x0F00) >> 8;
+		BYTE secondX = (second & 0x0F00) >> 8;
+
+		WORD third = Fetch(addr + 4);
+		bool loops = (second == (0x3000 | (x << 8))) && (third & 0xF000) == 0x1000;
+
+		if (op == OP_LD_X && loops)
+			op = OP_WAIT_DT;
+		else if (op == OP_ADD && loops && (third & 0x0FFF) == addr)
+			op = OP_COUNT_LOOP;
+		else if (op == OP_LD && next == OP_SKP && secondX == x)
+			op = OP_LD_SKP;
+		else if (op == OP_LD && next == OP_SKNP && secondX == x)
+			op = OP_LD_SKNP;
+		else if (op == OP_LD_I && next == OP_DRW)
+			op = OP_LD_I_DRW;
+		else if (IsSkip(op) && (next == OP_JP || next == OP_CALL))
+			op = OP_SKIP_JP;
+		else if (IsAlu(op) && IsAlu(next))
+			op = (StoresFlag(first) && OverwritesFlag(second)) ? OP_ALU_PAIR_DEAD_VF : OP_ALU_PAIR;
+#endif
+
+		entry = Decoded{ first, (BYTE)op };
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Drops the decoded entries a write to
+	///        an address makes stale
+	///
+	//////////////////////////////////////////////
+	void Invalidate(WORD addr)
+	{
+		// Superinstructions span up to 6 bytes
+		for (WORD i = 0; i < 6; i++)
+		{
+			WORD at = (addr - i) & ADDR_MASK;
+			if (pages[at >> 8]->code[at & (PAGE_SIZE - 1)].op != OP_UNDECODED)
+				Own(at >> 8).code[at & (PAGE_SIZE - 1)].op = OP_UNDECODED;
+		}
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Copies pc and the call stack into the
+	///        slot of a profiler
+	///
+	/// \param at Published as pc
+	//////////////////////////////////////////////
+	void Publish(ProfileSlot& slot, WORD at) const
+	{
+		// Cleared first, so a request that comes in while writing stays
+		slot.wanted.store(false, std::memory_order_relaxed);
+
+		uint32_t sequence = slot.sequence.load(std::memory_order_relaxed);
+		slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+
+		slot.pc.store(at, std::memory_order_relaxed);
+		slot.depth.store(sp, std::memory_order_relaxed);
+		for (WORD i = 0; i < sp; i++)
+			slot.calls[i].store(stack[i], std::memory_order_relaxed);
+
+		slot.sequence.store(sequence + 2, std::memory_order_release);
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Execute, one instruction at a time,
+	///        while register conditions are set
+	///
+	/// Execute(1) serves profiler requests, so
+	/// machines with conditions are sampled too
+	///
+	//////////////////////////////////////////////
+	unsigned ExecuteChecked(unsigned cycles)
+	{
+		BYTE count = conditionCount;
+		conditionCount = 0;		// Let Execute take the fast path
+
+		unsigned done = 0;
+		while (done < cycles && !interrupt)
+		{
+			WORD addr = pc & ADDR_MASK;
+			done += Execute(1);
+
+			for (BYTE i = 0; i < count; i++)
+			{
+				Condition& condition = conditions[i];
+				WORD value = Register(condition.reg);
+
+				bool hit = (condition.value < 0) ? value != condition.last :
+					(value == condition.value && condition.last != condition.value);
+				condition.last = value;
+
+				if (hit && !interrupt)
+				{
+					interrupt = true;
+					stopReason = STOP_REGISTER;
+					stopAddress = addr;
+				}
+			}
+		}
+
+		conditionCount = count;
+		return done;
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Stops the machine if a store hit a
+	///        watched range
+	///
+	/// \param from  First address written
+	/// \param count Number of bytes written
+	//////////////////////////////////////////////
+	void CheckWrites(WORD from, WORD count)
+	{
+		for (WORD i = 0; i < count; i++)
+		{
+			WORD addr = (from + i) & ADDR_MASK;
+			for (BYTE w = 0; w < watchCount; w++)
+			{
+				if (addr >= watches[w].from && addr < watches[w].to)
+				{
+					interrupt = true;
+					stopReason = STOP_WRITE;
+					stopAddress = addr;
+					return;
+				}
+			}
+		}
+	}
+
+	bool PagesWatched(WORD from, WORD count) const
+	{
+		// Watches only cover RAM, XO-CHIP memory above it is never watched
+		if (from >= RAM && high)
+			return false;
+
+		return watchedPages & ((1 << ((from & ADDR_MASK) >> 8)) | (1 << (((from + count - 1) & ADDR_MASK) >> 8)));
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Bytes a skip that is taken moves pc
+	///        by. XO-CHIP skips F000 NNNN whole
+	///
+	//////////////////////////////////////////////
+	WORD SkipLength() const
+	{
+		return (high && Fetch(pc + 2) == 0xF000) ? 0x06 : 0x04;
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Runs a conditional skip opcode
+	///
+	//////////////////////////////////////////////
+	void Skip(WORD op)
+	{
+		BYTE x = (op & 0x0F00) >> 8;
+		BYTE y = (op & 0x00F0) >> 4;
+
+		switch (op & 0xF000)
+		{
+		case 0x3000: SE(x, op & 0x00FF); break;
+		case 0x4000: SNE(x, op & 0x00FF); break;
+		case 0x5000: SE_XY(x, y); break;
+		case 0x9000: SNE_XY(x, y); break;
+		case 0xE000: ((op & 0x00FF) == 0x9E) ? SKP(x) : SKNP(x); break;
+		}
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Runs a 7XKK or 8XYN opcode in place,
+	///        exactly like the handler Alu calls
+	///
+	/// VF is written before VX, as the handlers do,
+	/// so opcodes that name VF come out the same.
+	/// Without bFlag the VF store is left out, for
+	/// when the decoder proved it dead
+	//////////////////////////////////////////////
+	template <bool bFlag = true>
+	FORCE_INLINE void InlineAlu(WORD op)
+	{
+#ifdef SUPPRESS_PROC_INFO	// The handlers do the logging
+		BYTE x = (op & 0x0F00) >> 8;
+		BYTE y = (op & 0x00F0) >> 4;
+
+		if ((op & 0xF000) == 0x7000)
+		{
+			V[x] += op & 0x00FF;
+			pc += 0x02;
+			return;
+		}
+
+		switch (op & 0x000F)
+		{
+		case 0x0: V[x] = V[y]; break;
+		case 0x1: V[x] |= V[y]; break;
+		case 0x2: V[x] &= V[y]; break;
+		case 0x3: V[x] ^= V[y]; break;
+		case 0x4: if (bFlag) V[0xF] = (V[y] > 0xFF - V[x]) ? 1 : 0; V[x] += V[y]; break;
+		case 0x5: if (bFlag) V[0xF] = (V[x] > V[y]) ? 1 : 0; V[x] -= V[y]; break;
+		case 0x6: if (bFlag) V[0xF] = V[x] & 0x1; V[x] >>= 1; break;
+		case 0x7: if (bFlag) V[0xF] = (V[y] > V[x]) ? 1 : 0; V[x] = V[y] - V[x]; break;
+		case 0xE: if (bFlag) V[0xF] = V[x] & 0x80; V[x] <<= 1; break;
+		}
+
+		pc += 0x02;
+#else
+		Alu(op);
+#endif
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Runs a 7XKK or 8XYN opcode
+	///
+	//////////////////////////////////////////////
+	void Alu(WORD op)
+	{
+		BYTE x = (op & 0x0F00) >> 8;
+		BYTE y = (op & 0x00F0) >> 4;
+
+		if ((op & 0xF000) == 0x7000)
+		{
+			ADD(x, op & 0x00FF);
+			return;
+		}
+
+		switch (op & 0x000F)
+		{
+		case 0x0: LD_XY(x, y); break;
+		case 0x1: OR(x, y); break;
+		case 0x2: AND(x, y); break;
+		case 0x3: XOR(x, y); break;
+		case 0x4: ADD_XY(x, y); break;
+		case 0x5: SUB(x, y); break;
+		case 0x6: SHR(x, y); break;
+		case 0x7: SUBN(x, y); break;
+		case 0xE: SHL(x, y); break;
+		}
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Stops the machine on an opcode it
+	///        cannot decode
+	///
+	//////////////////////////////////////////////
+	void UnknownOpcode()
+	{
+#ifndef CHIP8_FUZZER
+		std::cerr << "Unknown OpCode" << std::endl;
+#endif
+		interrupt = true;
+	}
+
+private:	// Opcodes
+
+	///////////////////0x00E0///////////////////
+	/// \brief Clears display
+	///
+	////////////////////////////////////////////
+	void CLS()
+	{
+		Display& d = OwnDisplay();
+		for (unsigned p = 0; p < PLANES; p++)
+		{
+			if (planes & (1 << p))
+				std::fill(std::begin(d.rows[p]), std::end(d.rows[p]), 0);
+		}
+		stale = ~0u;
+
+		pc += 0x02;
+		drawFlag = true;
+		dirtyRows = ~0u;
+
+#ifndef SUPPRESS_PROC_INFO
+		std::cout << "Screen cleared" << std::endl;
+#endif
+	}
+
+
+	///////////////////0x00EE///////////////////
+	/// \brief Returns from subroutine
+	///
+	////////////////////////////////////////////
+	void RET()
+	{
+		sp = (sp - 1) & 0xF;
+		pc = stack[sp] + 0x02;
+
+#ifndef SUPPRESS_PROC_INFO
+		std::cout << "Returned from subroutine" << std::endl;
+#endif
+	}
+
+	///////////////////0x1NNN///////////////////
+	/// \brief Jumps to NNN
+	///
+	/// \param address NNN
+	///
+	////////////////////////////////////////////
+	void JP(WORD address)
+	{
+		pc = address;
+
+#ifndef SUPPRESS_PROC_INFO
+		std::cout << "Jumped to 0x" << address << std::endl;
+#endif
+	}
+
+	///////////////////0x2NNN///////////////////
+	/// \brief Calls subroutine at NNN
+	///
+	/// \param address NNN
+	////////////////////////////////////////////
+	void CALL(WORD address)
+	{
+		stack[sp] = pc;
+		sp = (sp + 1) & 0xF;
+		pc = address;
+
+#ifndef SUPPRESS_PROC_INFO
+		std::cout << "Called subroutine at 0x" << address << std::endl;
+#endif
+	}
+
+
+	///////////////////0x3XKK///////////////////
+	/// \brief Skip next instr if VX = KK
+	///
+	/// \param regX X
+	/// \param byte KK
+	///
+	////////////////////////////////////////////
+	void SE(BYTE regX, BYTE kk)
+	{
+		if (V[regX] == kk) 
+		{
+			pc += SkipLength();
+
+#ifndef SUPPRESS_PROC_INFO
+			std::cout << "Skipped instruction because V" << (WORD)regX << " == " << (WORD)kk << std::endl;
+#endif
+		}
+		else 
+		{
+			pc += 0x02;
+
+#ifndef SUPPRESS_PROC_INFO
+			std::cout << "Didn't skip instruction because V" << (WORD)regX << " != " << (WORD)kk << std::endl;
+#endif
+		}
+
+	}
+
+
+	///////////////////0x4XKK///////////////////
+	/// \brief Skip next instr if VX != KK
+	///
+	/// \param regX X
+	/// \param byte KK
+	///
+	////////////////////////////////////////////
+	void SNE(BYTE regX, BYTE kk)
+	{
+		if (V[regX] != kk)
+		{
+			pc += SkipLength();
+
+#ifndef SUPPRESS_PROC_INFO
+			std::cout << "Skipped instruction because V" << (WORD)regX << " != " << (WORD)kk << std::endl;
+#endif
+		}
+		else
+		{
+			pc += 0x02;
+
+#ifndef SUPPRESS_PROC_INFO
+			std::cout << "Didn't skip instruction because V" << (WORD)regX << " == " << (WORD)kk << std::endl;
+#endif
+		}
+
+	}
+
+
+	///////////////////0x5XY0///////////////////
+	/// \brief Skip next instr if VX == VY
+	///
+	/// \param regX X
+	/// \param regY Y
+	///
+	////////////////////////////////////////////
+	void SE_XY(BYTE regX, BYTE regY)
+	{
+		if (V[regX] == V[regY])
+		{
+			pc += SkipLength();
+
+#ifndef SUPPRESS_PROC_INFO
+			std::cout << "Skipped instruction because V" << (WORD)regX << " != V" << (WORD)regY << std::endl;
+#endif
+		}
+		else
+		{
+			pc += 0x02;
+
+#ifndef SUPPRESS_PROC_INFO
+			std::cout << "Didn't skip instruction because V" << (WORD)regX << " == V" << (WORD)regY << std::endl;
+#endif
+		}
+
+	}
+
+
+	///////////////////0x6XKK///////////////////
+	/// \brief Sets VX to KK
+	///
+	/// \param regX X
+	/// \param byte KK
+	////////////////////////////////////////////
+	void LD(BYTE regX, BYTE byte)
+	{
+		V[regX] = byte;
+		pc += 0x02;
+
+#ifndef SUPPRESS_PROC_INFO
+		std::cout << "Set V" << (WORD)regX << " to 0x" << (WORD)byte << std::endl;
+#endif
+	}
+
+
+	//////////////////0x7XKK///////////////////
+	/// \brief Adds KK to VX
+	///
+	/// \param regX X
+	/// \param byte KK
+	////////////////////////////////////////////
+	void ADD(BYTE regX, BYTE byte)
+	{
+		V[regX] += byte;
+		pc += 0x02;
+
+#ifndef SUPPRESS_PROC_INFO
+		std::cout << "Added 0x" << (WORD)byte << " to V" << (WORD)regX << std::endl;
+#endif
+	}
+
+
+	//////////////////0x8XY0///////////////////
+	/// \brief Stores value of VY in VX
+	///
+	/// \param regX X
+	/// \param regY Y
+	////////////////////////////////////////////
+	void LD_XY(BYTE regX, BYTE regY)
+	{
+		V[regX] = V[regY];
+
+		pc += 0x02;
+
+#ifndef SUPPRESS_PROC_INFO
+		std::cout << "V" << (WORD)regY << "(0x" << (WORD) V[regY] << ") => V" << (WORD)regX << std::endl;
+#endif
+	}
+
+
+	//////////////////0x8XY1///////////////////
+	/// \brief VX = VX | VY
+	///
+	/// \param regX X
+	/// \param regY Y
+	////////////////////////////////////////////
+	void OR(BYTE regX, BYTE regY)
+	{
+		V[regX] |= V[regY];
+
+		pc += 0x02;
+
+#ifndef SUPPRESS_PROC_INFO
+		std::cout << "V" << (WORD)regX << " |= V" << (WORD)regY << "(0x" << (WORD)V[regY] << ") => " << (WORD)V[regX] << std::endl;
+#endif
+	}
+
+
+	//////////////////0x8XY2///////////////////
+	/// \brief VX = VX & VY
+	///
+	/// \param regX X
+	/// \param regY Y
+	////////////////////////////////////////////
+	void AND(BYTE regX, BYTE regY)
+	{
+		V[regX] &= V[regY];
+
+		pc += 0x02;
+
+#ifndef SUPPRESS_PROC_INFO
+		std::cout << "V" << (WORD)regX << " &= V" << (WORD)regY << "(0x" << (WORD)V[regY] << ") => " << (WORD)V[regX] << std::endl;
+#endif
+	}
+
+
+	//////////////////0x8XY3///////////////////
+	/// \brief VX = VX ^ VY
+	///
+	/// \param regX X
+	/// \param regY Y
+	////////////////////////////////////////////
+	void XOR(BYTE regX, BYTE regY)
+	{
+		V[regX] ^= V[regY];
+
+		pc += 0x02;
+
+#ifndef SUPPRESS_PROC_INFO
+		std::cout << "V" << (WORD)regX << " ^= V" << (WORD)regY << "(0x" << (WORD)V[regY] << ") => " << (WORD)V[regX] << std::endl;
+#endif
+	}
+
+
+	//////////////////0x8XY4///////////////////
+	/// \brief VX = VX + VY, VF = carry
+	///
+	/// \param regX X
+	/// \param regY Y
+	////////////////////////////////////////////
+	void ADD_XY(BYTE regX, BYTE regY)
+	{
+		if (V[regY] > 0xFF - V[regX])
+			V[0xF] = 1;
+		else
+			V[0xF] = 0;
+
+		V[regX] = (V[regX] + V[regY]) & 0xFF;
+		pc += 0x02;
+
+#ifndef SUPPRESS_PROC_INFO
+		std::cout << "V" << (WORD)regX << " += V" << (WORD)regY << "(0x" << (WORD)V[regY] << ") => " << (WORD)V[regX] << ", Carry = " << (WORD)V[0xF] << std::endl;
+#endif
+	}
+
+
+	//////////////////0x8XY5///////////////////
+	/// \brief VX = VX - VY, VF = NOT borrow
+	///
+	/// \param regX X
+	/// \param regY Y
+	////////////////////////////////////////////
+	void SUB(BYTE regX, BYTE regY)
+	{
+		if (V[regX] > V[regY])
+			V[0xF] = 1;
+		else
+			V[0xF] = 0;
+
+		V[regX] = (V[regX] - V[regY]) & 0xFF;
+		pc += 0x02;
+
+#ifndef SUPPRESS_PROC_INFO
+		std::cout << "V" << (WORD)regX << " -= V" << (WORD)regY << "(0x" << (WORD)V[regY] << ") => " << (WORD)V[regX] << ", Carry = " << (WORD)V[0xF] << std::endl;
+#endif
+	}
+
+
+	//////////////////0x8XY6///////////////////
+	/// \brief VX = VX >> 1, VF = LSB of VX
+	///
+	/// \param regX X
+	/// \param regY Y
+	////////////////////////////////////////////
+	void SHR(BYTE regX, BYTE regY)
+	{
+		V[0xF] = V[regX] & 0x1;
+		V[regX] >>= 1;
+
+		pc += 0x02;
+
+#ifndef SUPPRESS_PROC_INFO
+		std::cout << "Shifted V" << (WORD)regX << " right once. VF = " << (WORD)V[0xF] << std::endl;
+#endif
+	}
+
+
+	//////////////////0x8XY7///////////////////
+	/// \brief VX = VY - VX, VF = NOT borrow
+	///
+	/// \param regX X
+	/// \param regY Y
+	////////////////////////////////////////////
+	void SUBN(BYTE regX, BYTE regY)
+	{
+		if (V[regY] > V[regX])
+			V[0xF] = 1;
+		else
+			V[0xF] = 0;
+
+		V[regX] = (V[regY] - V[regX]) & 0xFF;
+		pc += 0x02;
+
+#ifndef SUPPRESS_PROC_INFO
+		std::cout << "V" << (WORD)regX << " = V" << (WORD)regY << "(0x" << (WORD)V[regY] << ") - V" << (WORD)regX << " => " << (WORD)V[regX] << ", Carry = " << (WORD)V[0xF] << std::endl;
+#endif
+	}
+
+
+	//////////////////0x8XYE///////////////////
+	/// \brief VX = VX >> 1, VF = LSB of VX
+	///
+	/// \param regX X
+	/// \param regY Y
+	////////////////////////////////////////////
+	void SHL(BYTE regX, BYTE regY)
+	{
+		V[0xF] = V[regX] & 0x80;
+		V[regX] <<= 1;
+
+		pc += 0x02;
+
+#ifndef SUPPRESS_PROC_INFO
+		std::cout << "Shifted V" << (WORD)regX << " left once. VF = " << (WORD)V[0xF] << std::endl;
+#endif
+	}
+
+
+	///////////////////0x9XY0///////////////////
+	/// \brief Skip next instr if VX != VY
+	///
+	/// \param regX X
+	/// \param regY Y
+	///
+	////////////////////////////////////////////
+	void SNE_XY(BYTE regX, BYTE regY)
+	{
+		if (V[regX] != V[regY])
+		{
+			pc += SkipLength();
+
+#ifndef SUPPRESS_PROC_INFO
+			std::cout << "Skipped instruction because V" << (WORD)regX << " != V" << (WORD)regY << std::endl;
+#endif
+		}
+		else
+		{
+			pc += 0x02;
+
+#ifndef SUPPRESS_PROC_INFO
+			std::cout << "Didn't skip instruction because V" << (WORD)regX << " == V" << (WORD)regY << std::endl;
+#endif
+		}
+
+	}
+
+
+	///////////////////0xANNN///////////////////
+	/// \brief Sets I to NNN
+	///
+	/// \param address NNN
+	////////////////////////////////////////////
+	void LD(WORD address)
+	{
+		I = address;
+		pc += 0x02;
+
+#ifndef SUPPRESS_PROC_INFO
+		std::cout << "Set I to 0x" << address << std::endl;
+#endif
+	}
+
+
+	///////////////////0xBNNN///////////////////
+	/// \brief Jump to location NNN + V0
+	///
+	/// \param address NNN
+	////////////////////////////////////////////
+	void JP_V(WORD address)
+	{
+		pc = address + V[0x0];
+
+#ifndef SUPPRESS_PROC_INFO
+		std::cout << "Jumped to adress " << (WORD)pc << std::endl;
+#endif
+	}
+
+	
+	///////////////////0xCXKK///////////////////
+	/// \brief Sets VX to a random byte ANDed with KK
+	///
+	/// \param regX X
+	/// \param byte KK
+	////////////////////////////////////////////
+	void RND(BYTE regX, BYTE byte)
+	{
+		BYTE rnd = (NextRandom() >> 56) & byte;
+
+		V[regX] = rnd;
+
+		pc += 0x02;
+
+#ifndef SUPPRESS_PROC_INFO
+		std::cout << "(Random) Set V" << (WORD)regX << " to 0x" << (WORD)rnd << std::endl;
+#endif
+	}
+
+
+	///////////////////0xDXYN///////////////////
+	/// \brief Draws sprite that is N bytes long and
+	///        stored at I at position (VX, VY). Set
+	///        VF = 1 if collision
+	///
+	/// \param regX		x
+	/// \param regY		y
+	/// \param bytes	N
+	////////////////////////////////////////////
+	void DRW(BYTE regX, BYTE regY, BYTE bytes)
+	{
+		Display& d = OwnDisplay();
+		V[0xF] = 0x00;
+
+		// Every plane drawn to takes the next N bytes at I
+		WORD addr = I;
+		for (unsigned p = 0; p < PLANES; p++)
+		{
+			if (!(planes & (1 << p)))
+				continue;
+
+			for (BYTE y = 0; y < bytes; y++)
+			{
+				BYTE line = Read(addr + y);
+
+				if (regX != 0xF && regY != 0xF)
+				{
+					// The whole sprite row at once, rotated so it wraps around the edge
+					BYTE totalY = (V[regY] + y) & (HEIGHT - 1);
+					BYTE shift = V[regX] & (WIDTH - 1);
+					uint64_t bits = (uint64_t)line << 56;
+					bits = (bits >> shift) | (bits << ((WIDTH - shift) & (WIDTH - 1)));
+
+					uint64_t& row = d.rows[p][totalY];
+					if (row & bits)
+						V[0xF] = 1;
+					row ^= bits;
+
+					stale |= 1u << totalY;
+					dirtyRows |= 1u << totalY;
+					continue;
+				}
+
+				// A position in VF moves with the first collision, so
+				// the rest of the sprite lands somewhere else
+				for (BYTE x = 0; x < 8; x++)
+				{
+					if ((line & (0x80 >> x)) == 0)
+						continue;
+
+					BYTE totalX = (V[regX] + x) & (WIDTH - 1);
+					BYTE totalY = (V[regY] + y) & (HEIGHT - 1);
+					uint64_t bit = 1ull << (63 - totalX);
+
+					if (d.rows[p][totalY] & bit)
+						V[0xF] = 1;
+					d.rows[p][totalY] ^= bit;
+
+					stale |= 1u << totalY;
+					dirtyRows |= 1u << totalY;
+				}
+			}
+
+			addr += bytes;
+		}
+
+		pc += 0x02;
+		drawFlag = true;
+
+#ifndef SUPPRESS_PROC_INFO
+		std::cout << "Drew Sprite at position (V" << (WORD)regX << ", V" << (WORD)regY << ")[" << std::dec << (WORD)V[regX] << ", " << (WORD)V[regY] << "]" << std::endl;
+#endif
+	}
+
+
+	///////////////////0xEX9E///////////////////
+	/// \brief Skip instruction if key of value VX is pressed
+	///
+	/// \param regX X 
+	///
+	////////////////////////////////////////////
+	void SKP(BYTE regX)
+	{
+		if (key[V[regX] & 0xF])
+		{
+			pc += SkipLength();
+
+#ifndef SUPPRESS_PROC_INFO
+			std::cout << "Skipped instruction because key " << (WORD)V[regX] << " was pressed" << std::endl;
+#endif	
+		}
+		else
+		{
+			pc += 0x02;
+
+#ifndef SUPPRESS_PROC_INFO
+			std::cout << "Didn't skip instruction because key " << (WORD)V[regX] << " was not pressed" << std::endl;
+#endif
+		}
+	}
+
+
+	///////////////////0xEXA1///////////////////
+	/// \brief Skip instruction if key of value VX is not pressed
+	///
+	/// \param regX X 
+	///
+	////////////////////////////////////////////
+	void SKNP(BYTE regX)
+	{
+		if (key[V[regX] & 0xF])
+		{
+			pc += 0x02;
+
+#ifndef SUPPRESS_PROC_INFO
+			std::cout << "Didn't skip instruction because key " << (WORD)V[regX] << " was pressed" << std::endl;
+#endif
+		} 
+		else
+		{
+			pc += SkipLength();
+
+#ifndef SUPPRESS_PROC_INFO
+			std::cout << "Skipped instruction because key " << (WORD)V[regX] << " was not pressed" << std::endl;
+#endif
+		}
+	}
+
+
+	///////////////////0xFX07///////////////////
+	/// \brief Store BCD representation of X at I
+	///
+	/// \param regX X 
+	///
+	////////////////////////////////////////////
+	void LD_X(BYTE regX)
+	{
+		V[regX] = delay_timer;
+
+		pc += 0x02;
+
+#ifndef SUPPRESS_PROC_INFO
+		std::cout << "Set V" << (WORD)regX << " to delay_timer(" << (WORD)delay_timer << ")" << std::endl;
+#endif
+	}
+
+
+	///////////////////0xFX0A///////////////////
+	/// \brief Halt program until key press. Save key to VX
+	///
+	/// \param regX X 
+	///
+	////////////////////////////////////////////
+	void LD_K(BYTE regX)
+	{
+#ifndef SUPPRESS_PROC_INFO
+		std::cout << "Waiting for Key press..." << std::endl;
+#endif
+		for (BYTE k = 0x0; k < 0xF; k++)
+		{
+			if (key[k])
+			{
+				V[regX] = k;
+				pc += 0x02;
+
+#ifndef SUPPRESS_PROC_INFO
+				std::cout << "Key pressed: 0x" << (WORD)k << ". Saved to V" << (WORD)regX << std::endl;
+#endif
+
+				break;
+			}
+		}
+	}
+
+
+	///////////////////0xFX15///////////////////
+	/// \brief Set delay timer to VX
+	///
+	/// \param regX X 
+	///
+	////////////////////////////////////////////
+	void LD_DT(BYTE regX)
+	{
+		delay_timer = V[regX];
+
+		pc += 0x02;
+
+#ifndef SUPPRESS_PROC_INFO
+		std::cout << "Set delay timer to " << (WORD)V[regX] << std::endl;
+#endif
+	}
+
+
+	///////////////////0xFX18///////////////////
+	/// \brief Set sound timer to VX
+	///
+	/// \param regX X 
+	///
+	////////////////////////////////////////////
+	void LD_ST(BYTE regX)
+	{
+		sound_timer = V[regX];
+
+		pc += 0x02;
+
+#ifndef SUPPRESS_PROC_INFO
+		std::cout << "Set sound timer to " << (WORD)V[regX] << std::endl;
+#endif
+	}
+
+
+	///////////////////0xFX1E///////////////////
+	/// \brief Set I = I + VX
+	///
+	/// \param regX X 
+	///
+	////////////////////////////////////////////
+	void ADD_I(BYTE regX)
+	{
+		I += V[regX];
+		pc += 0x02;
+
+#ifndef SUPPRESS_PROC_INFO
+		std::cout << "Added V" << (WORD)regX << "(" << (WORD)V[regX] << ") to I. I = " << (WORD)I << std::endl;
+#endif
+	}
+
+	///////////////////0xFX29///////////////////
+	/// \brief Set I to location of font for digit VX
+	///
+	/// \param regX X 
+	///
+	////////////////////////////////////////////
+	void LD_F(BYTE regX)
+	{
+		I = 0x0000 + (V[regX] * 5);
+		pc += 0x02;
+
+#ifndef SUPPRESS_PROC_INFO
+		std::cout << "Stored font \"" << (WORD)V[regX] << "\" at I" << std::endl;
+#endif
+	}
+
+
+	///////////////////0xFX33///////////////////
+	/// \brief Store BCD representation of X at I
+	///
+	/// \param regX X 
+	///
+	////////////////////////////////////////////
+	void LD_B(BYTE regX)
+	{
+		BYTE value = V[regX];
+
+		BYTE hundreds = (value - (value % 100)) / 100;
+		value -= hundreds * 100;
+
+		BYTE tens = (value - (value % 10)) / 10;
+		value -= tens * 10;
+
+		Write(I, hundreds);
+		Write(I + 1, tens);
+		Write(I + 2, value);
+
+		if (PagesWatched(I, 3))
+			CheckWrites(I, 3);
+
+		pc += 0x02;
+
+#ifndef SUPPRESS_PROC_INFO
+		std::cout << "Storing Binary Coded Decimal V" << (WORD)regX << " as {" << std::dec << (WORD)hundreds << ", " << (WORD)tens << ", " << (WORD)value << "}" << std::endl;
+#endif
+	}
+
+
+	///////////////////0xFX55///////////////////
+	/// \brief Fill memory at I with values from V0 - VX
+	///
+	/// \param regX X 
+	///
+	////////////////////////////////////////////
+	void LD_55(BYTE regX)
+	{
+		for (int offset = 0; offset <= regX; offset++)
+		{
+			Write(I + offset, V[offset]);
+		}
+
+		if (PagesWatched(I, regX + 1))
+			CheckWrites(I, regX + 1);
+
+		pc += 0x02;
+
+#ifndef SUPPRESS_PROC_INFO
+		std::cout << "Filled memory starting at 0x" << (WORD)I << " with the values of V0 to V" << (WORD)regX << std::endl;
+#endif
+	}
+
+
+	///////////////////0xFX65///////////////////
+	/// \brief Fill V0 - VX with memory data starting at I
+	///
+	/// \param regX X 
+	///
+	////////////////////////////////////////////
+	void LD_65(BYTE regX)
+	{
+		for (int offset = 0; offset <= regX; offset++)
+		{
+			V[offset] = Read(I + offset);
+		}
+
+		pc += 0x02;
+
+#ifndef SUPPRESS_PROC_INFO
+		std::cout << "Filled V0 through V" << (WORD)regX << " with memory values starting at 0x" << I << std::endl;
+#endif
+	}
+
+
+	///////////////0xF000 NNNN//////////////////
+	/// \brief Set I to NNNN, the word after the
+	///        opcode (XO-CHIP)
+	///
+	////////////////////////////////////////////
+	void LD_I_LONG()
+	{
+		I = Fetch(pc + 2);
+		pc += 0x04;
+
+#ifndef SUPPRESS_PROC_INFO
+		std::cout << "Set I to 0x" << I << std::endl;
+#endif
+	}
+
+
+	///////////////////0x5XY2///////////////////
+	/// \brief Store VX - VY at I, counting down if
+	///        X > Y. I is left alone (XO-CHIP)
+	///
+	/// \param regX X
+	/// \param regY Y
+	////////////////////////////////////////////
+	void SAVE_XY(BYTE regX, BYTE regY)
+	{
+		int count = ((regX <= regY) ? regY - regX : regX - regY) + 1;
+		int step = (regX <= regY) ? 1 : -1;
+		for (int offset = 0; offset < count; offset++)
+		{
+			Write(I + offset, V[regX + offset * step]);
+		}
+
+		if (PagesWatched(I, count))
+			CheckWrites(I, count);
+
+		pc += 0x02;
+
+#ifndef SUPPRESS_PROC_INFO
+		std::cout << "Stored V" << (WORD)regX << " to V" << (WORD)regY << " at 0x" << I << std::endl;
+#endif
+	}
+
+
+	///////////////////0x5XY3///////////////////
+	/// \brief Load VX - VY from I, counting down if
+	///        X > Y. I is left alone (XO-CHIP)
+	///
+	/// \param regX X
+	/// \param regY Y
+	////////////////////////////////////////////
+	void LOAD_XY(BYTE regX, BYTE regY)
+	{
+		int count = ((regX <= regY) ? regY - regX : regX - regY) + 1;
+		int step = (regX <= regY) ? 1 : -1;
+		for (int offset = 0; offset < count; offset++)
+		{
+			V[regX + offset * step] = Read(I + offset);
+		}
+
+		pc += 0x02;
+
+#ifndef SUPPRESS_PROC_INFO
+		std::cout << "Loaded V" << (WORD)regX << " to V" << (WORD)regY << " from 0x" << I << std::endl;
+#endif
+	}
+
+
+	///////////////////0xFN01///////////////////
+	/// \brief Select the planes DRW and CLS work
+	///        on (XO-CHIP)
+	///
+	/// \param mask N, bit n selects plane n
+	////////////////////////////////////////////
+	void PLANE(BYTE mask)
+	{
+		planes = mask & ((1 << PLANES) - 1);
+		pc += 0x02;
+
+#ifndef SUPPRESS_PROC_INFO
+		std::cout << "Drawing to planes " << (WORD)planes << std::endl;
+#endif
+	}
+} chip8;
+
+
+
+////////////////////////////////////////////////////////////////
+// LOOKAHEAD SEARCH
+//
+/////////////////////////////////////////////////////////////////
+
+//////////////////////////////////////////////
+/// \brief Forks a machine once per input
+///        script, runs every fork and scores it
+///
+/// \param root    The state to branch from
+/// \param scripts A key mask per frame for every
+///                branch, the last mask is held
+/// \param frames  Frames to run every branch
+/// \param score   Called with every finished
+///                branch, returns its score
+/// \return The score of every branch
+//////////////////////////////////////////////
+template<typename TScore>
+std::vector<int> EvaluateBranches(const Chip8& root, const std::vector<std::vector<WORD>>& scripts, unsigned frames, TScore score)
+{
+	std::vector<int> scores;
+	scores.reserve(scripts.size());
+
+	for (const auto& script : scripts)
+	{
+		Chip8 branch = root.Fork();
+
+		for (unsigned frame = 0; frame < frames && !branch.interrupt; frame++)
+		{
+			if (frame < script.size())
+				branch.SetKeys(script[frame]);
+
+			branch.Execute(CYCLES_PER_FRAME);
+			branch.UpdateTimers();
+		}
+
+		scores.push_back(score(branch));
+	}
+
+	return scores;
+}
+
+
+
+////////////////////////////////////////////////////////////////
+// TRAINING ENVIRONMENT
+//
+// A batch of headless machines stepped together. Observations are
+// the packed display of every machine, back to back in one
+// buffer. Rewards and episode ends come from watched memory, e.g.
+// the score a game writes with LD_B:
+//
+//   Environment env("tetris.c8", 64, 4, { { 0x804, 3, true, 1.0f, -1 } });
+//
+// chip8 --env-bench steps a batch with random keys and checks
+// every observation and reward against the machines.
+//
+/////////////////////////////////////////////////////////////////
+
+struct MemoryWatch
+{
+	WORD addr;
+	BYTE bytes;			// Length of the value, the first byte is the most significant
+	bool bcd;			// One decimal digit per byte, as LD_B writes them
+	float weight;		// Reward for every unit the value goes up
+	int doneAt;			// Episode ends when the value gets here, -1 never
+};
+
+
+class Environment
+{
+public:
+	//////////////////////////////////////////////
+	/// \param rom       Path to the ROM
+	/// \param batch     Number of machines
+	/// \param frameSkip Frames every step runs with
+	///                  the same keys held
+	/// \param watches   Where reward and episode
+	///                  ends come from
+	//////////////////////////////////////////////
+	Environment(const std::string& rom, unsigned batch, unsigned frameSkip, std::vector<MemoryWatch> watches)
+		: m_rom(Chip8::Image(rom)), m_machines(batch), m_frameSkip(frameSkip), m_watches(std::move(watches)),
+		  m_observations(batch * PACKED_SIZE), m_rewards(batch), m_dones(batch), m_values(batch * m_watches.size())
+	{
+	}
+
+
+	//////////////////////////////////////////////
+	/// \brief Starts a new episode on every machine
+	///
+	/// \param seed Machine i is seeded with seed + i
+	/// \return The first observations
+	//////////////////////////////////////////////
+	const BYTE* Reset(uint64_t seed)
+	{
+		m_nextSeed = seed;
+		for (unsigned i = 0; i < Size(); i++)
+			Restart(i);
+
+		return m_observations.data();
+	}
+
+
+	//////////////////////////////////////////////
+	/// \brief Runs every machine for frameSkip
+	///        frames
+	///
+	/// Machines whose episode ended on the last
+	/// step start a new one first
+	///
+	/// \param actions Key mask for every machine
+	/// \return The observations, PACKED_SIZE bytes
+	///         per machine
+	//////////////////////////////////////////////
+	const BYTE* Step(const WORD* actions)
+	{
+		for (unsigned i = 0; i < Size(); i++)
+		{
+			if (m_dones[i])
+				Restart(i);
+
+			Chip8& machine = m_machines[i];
+			machine.SetKeys(actions[i]);
+
+			for (unsigned frame = 0; frame < m_frameSkip && !machine.interrupt; frame++)
+			{
+				machine.Execute(CYCLES_PER_FRAME);
+				machine.UpdateTimers();
+			}
+
+			Observe(i);
+			m_rewards[i] = Score(i);
+			m_dones[i] = machine.interrupt || Ended(i);
+		}
+
+		return m_observations.data();
+	}
+
+	unsigned Size() const { return (unsigned)m_machines.size(); }
+	const BYTE* Observations() const { return m_observations.data(); }
+	const float* Rewards() const { return m_rewards.data(); }
+	const bool* Dones() const { return (const bool*)m_dones.data(); }
+	const Chip8& Machine(unsigned i) const { return m_machines[i]; }
+
+private:
+	void Restart(unsigned i)
+	{
+		// The ROM is only read and decoded once, for all episodes
+		m_machines[i].Initialize();
+		m_machines[i].LoadGame(m_rom);
+		m_machines[i].Seed(m_nextSeed++);
+
+		Observe(i);
+		Score(i);	// Baseline for the first reward
+		m_rewards[i] = 0;
+		m_dones[i] = false;
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Packs the display of a machine into
+	///        its observation if it changed
+	///
+	//////////////////////////////////////////////
+	void Observe(unsigned i)
+	{
+		Chip8& machine = m_machines[i];
+		if (machine.dirtyRows == 0)
+			return;
+
+		machine.GetPackedDisplay(m_observations.data() + i * PACKED_SIZE);
+		machine.dirtyRows = 0;
+		machine.drawFlag = false;
+	}
+
+	int Value(unsigned i, const MemoryWatch& watch) const
+	{
+		int value = 0;
+		for (BYTE b = 0; b < watch.bytes; b++)
+			value = value * (watch.bcd ? 10 : 256) + m_machines[i].Peek(watch.addr + b);
+
+		return value;
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Reward since the last call, the
+	///        weighted change of every watch
+	///
+	//////////////////////////////////////////////
+	float Score(unsigned i)
+	{
+		float reward = 0;
+		for (size_t w = 0; w < m_watches.size(); w++)
+		{
+			int value = Value(i, m_watches[w]);
+			int& last = m_values[i * m_watches.size() + w];
+
+			reward += m_watches[w].weight * (value - last);
+			last = value;
+		}
+
+		return reward;
+	}
+
+	bool Ended(unsigned i) const
+	{
+		for (size_t w = 0; w < m_watches.size(); w++)
+		{
+			if (m_watches[w].doneAt >= 0 && m_values[i * m_watches.size() + w] == m_watches[w].doneAt)
+				return true;
+		}
+
+		return false;
+	}
+
+	RomImage m_rom;
+	std::vector<Chip8> m_machines;
+	unsigned m_frameSkip;
+	std::vector<MemoryWatch> m_watches;
+	uint64_t m_nextSeed = 0;
+
+	std::vector<BYTE> m_observations;
+	std::vector<float> m_rewards;
+	std::vector<BYTE> m_dones;		// Not vector<bool>, Dones() hands out a pointer
+	std::vector<int> m_values;		// Last value of every watch on every machine
+};
+
+
+
+////////////////////////////////////////////////////////////////
+// DIFFERENTIAL EXECUTION
+//
+// Runs a reference engine and a candidate engine side by side on
+// the same ROM, seed and keys, and compares their state hashes
+// every few frames. On a mismatch both are replayed from the last
+// checkpoint that matched, bisecting to the frame and then to the
+// instruction where they part. An engine is anything callable as
+//
+//   unsigned engine(Chip8& machine, unsigned cycles)
+//
+// that runs at most cycles instructions and returns how many ran
+//
+/////////////////////////////////////////////////////////////////
+
+struct Divergence
+{
+	bool found;
+	uint64_t frames;		// Frames both engines agreed on
+	uint64_t digest;		// Hash of every matching checkpoint
+	uint64_t frame;			// Frame the diverging instruction is in
+	unsigned instruction;	// Instructions into that frame before it
+	Chip8 before;			// State both engines ran it from
+	Chip8 reference;		// States right after it
+	Chip8 candidate;
+};
+
+
+//////////////////////////////////////////////
+/// \brief The switch interpreter every other
+///        engine is checked against
+///
+//////////////////////////////////////////////
+inline unsigned ReferenceEngine(Chip8& machine, unsigned cycles)
+{
+	unsigned done = 0;
+	for (; done < cycles && !machine.interrupt; done++)
+		machine.EmulateCycle();
+
+	return done;
+}
+
+
+//////////////////////////////////////////////
+/// \brief The predecoded interpreter
+///
+//////////////////////////////////////////////
+inline unsigned DecodedEngine(Chip8& machine, unsigned cycles)
+{
+	return machine.Execute(cycles);
+}
+
+
+//////////////////////////////////////////////
+/// \brief Runs whole frames, keys change at
+///        the start of a frame
+///
+/// \param keys A key mask per frame, the last
+///             mask is held
+/// \param from First frame to run
+/// \param to   One past the last frame to run
+//////////////////////////////////////////////
+template<typename TEngine>
+void RunFrames(Chip8& machine, TEngine engine, const std::vector<WORD>& keys, uint64_t from, uint64_t to)
+{
+	for (uint64_t frame = from; frame < to; frame++)
+	{
+		if (frame < keys.size())
+			machine.SetKeys(keys[frame]);
+
+		engine(machine, CYCLES_PER_FRAME);
+		machine.UpdateTimers();
+	}
+}
+
+
+//////////////////////////////////////////////
+/// \brief Runs two engines in lockstep and
+///        finds where they first disagree
+///
+/// \param rom        The ROM
+/// \param seed       Seed of both machines
+/// \param keys       A key mask per frame
+/// \param frames     Frames to run
+/// \param checkpoint Frames between two hash
+///                   comparisons
+/// \return found is false if both engines got
+///         through every frame the same
+//////////////////////////////////////////////
+template<typename TReference, typename TCandidate>
+Divergence Lockstep(const RomImage& rom, uint64_t seed, const std::vector<WORD>& keys, uint64_t frames, unsigned checkpoint,
+	TReference reference, TCandidate candidate)
+{
+	Divergence result = {};
+
+	Chip8 ref;
+	ref.Initialize();
+	ref.Seed(seed);
+	ref.LoadGame(rom);
+	Chip8 cand = ref.Fork();
+	Chip8 good = ref.Fork();
+
+	for (uint64_t frame = 0; frame < frames; )
+	{
+		uint64_t next = std::min<uint64_t>(frame + std::max(checkpoint, 1u), frames);
+		RunFrames(ref, reference, keys, frame, next);
+		RunFrames(cand, candidate, keys, frame, next);
+
+		uint64_t hash = ref.Hash();
+		if (cand.Hash() == hash)
+		{
+			result.digest = Chip8::HashBytes(result.digest, &hash, sizeof(hash));
+			result.frames = frame = next;
+			good = ref.Fork();
+			continue;
+		}
+
+		// The same after lo frames, different after hi
+		uint64_t lo = result.frames;
+		uint64_t hi = next;
+		while (hi - lo > 1)
+		{
+			uint64_t mid = lo + (hi - lo) / 2;
+			Chip8 a = good.Fork();
+			Chip8 b = good.Fork();
+			RunFrames(a, reference, keys, result.frames, mid);
+			RunFrames(b, candidate, keys, result.frames, mid);
+
+			if (a.Hash() == b.Hash())
+				lo = mid;
+			else
+				hi = mid;
+		}
+
+		Chip8 start = good.Fork();
+		RunFrames(start, reference, keys, result.frames, lo);
+		if (lo < keys.size())
+			start.SetKeys(keys[lo]);
+
+		// Same again, within the frame
+		unsigned first = 0;
+		unsigned last = CYCLES_PER_FRAME;
+		while (last - first > 1)
+		{
+			unsigned mid = first + (last - first) / 2;
+			Chip8 a = start.Fork();
+			Chip8 b = start.Fork();
+			reference(a, mid);
+			candidate(b, mid);
+
+			if (a.Hash() == b.Hash())
+				first = mid;
+			else
+				last = mid;
+		}
+
+		result.found = true;
+		result.frames = lo;
+		result.frame = lo;
+		result.instruction = first;
+		result.before = start.Fork();
+		reference(result.before, first);
+		result.reference = result.before.Fork();
+		reference(result.reference, 1);
+		result.candidate = start.Fork();
+		candidate(result.candidate, first + 1);
+		return result;
+	}
+
+	return result;
+}
+
+
+
+////////////////////////////////////////////////////////////////
+// ROM CORPUS ANALYSIS
+//
+// Static statistics over many ROMs. Code is what can be reached
+// from 0x200 by following every path DecodeOp allows: both sides
+// of a skip, CALL and its return, the targets of JP. BNNN only
+// reaches NNN, where the jump table usually starts. Everything in
+// the ROM that is not reached is data.
+//
+// I is followed through straight line code from ANNN, so a FX33 or
+// FX55 with a known I that hits code is a self-modifying write.
+//
+/////////////////////////////////////////////////////////////////
+
+const constexpr unsigned ANALYSIS_TOP = 10;		// Idioms listed per length
+
+
+inline const char* OpName(OP op)
+{
+	static const char* const names[] = {
+		"UNDECODED", "UNKNOWN", "TRAP",
+		"CLS", "RET", "JP", "CALL", "SE", "SNE", "SE_XY", "LD", "ADD",
+		"LD_XY", "OR", "AND", "XOR", "ADD_XY", "SUB", "SHR", "SUBN", "SHL",
+		"SNE_XY", "LD_I", "JP_V", "RND", "DRW", "SKP", "SKNP",
+		"LD_X", "LD_K", "LD_DT", "LD_ST", "ADD_I", "LD_F", "LD_B", "LD_55", "LD_65",
+		"LD_I_LONG", "SAVE_XY", "LOAD_XY", "PLANE",
+	};
+
+	return (op < sizeof(names) / sizeof(names[0])) ? names[op] : "FUSED";
+}
+
+
+struct RomAnalysis
+{
+	uint64_t roms = 0;
+	uint64_t codeBytes = 0;
+	uint64_t dataBytes = 0;
+	uint64_t ops[OP_PLANE + 1] = {};		// Reachable instructions of every class
+	std::unordered_map<uint32_t, uint64_t> grams[2];	// Pairs and triples of classes in straight line code
+	uint64_t selfModifying = 0;		// FX33 / FX55 sites that write into code
+	uint64_t unknownWrites = 0;		// FX33 / FX55 sites with I not known statically
+	uint64_t indirectJumps = 0;		// BNNN sites
+	uint64_t romsSelfModifying = 0;
+	uint64_t romsIndirect = 0;
+
+	//////////////////////////////////////////////
+	/// \brief Adds one ROM
+	///
+	/// \param rom    The ROM, as loaded at 0x200
+	/// \param size   Number of bytes
+	/// \param xoChip Whether it is an XO-CHIP ROM
+	//////////////////////////////////////////////
+	void Add(const BYTE* rom, size_t size, bool xoChip = false)
+	{
+		size = std::min<size_t>(size, RAM - 0x200);
+		WORD end = (WORD)(0x200 + size);
+
+		auto Fetch = [&](WORD addr) { return (WORD)((rom[addr - 0x200] << 8) | rom[addr - 0x200 + 1]); };
+
+		// F000 NNNN is the only 4 byte instruction
+		auto Length = [&](WORD addr) { return (WORD)((xoChip && Fetch(addr) == 0xF000) ? 4 : 2); };
+
+		std::vector<BYTE> reached(RAM);		// 1 at the first byte of every reachable instruction
+		std::vector<BYTE> target(RAM);		// 1 where control arrives other than by falling through
+		std::vector<BYTE> code(RAM);
+		std::vector<WORD> pending = { 0x200 };
+
+		while (!pending.empty())
+		{
+			WORD addr = pending.back();
+			pending.pop_back();
+
+			if (addr < 0x200 || addr + 1 >= end || reached[addr])
+				continue;
+
+			WORD opcode = Fetch(addr);
+			OP op = DecodeOp(opcode, xoChip);
+			WORD length = Length(addr);
+			if (op == OP_UNKNOWN || addr + length - 1 >= end)
+				continue;
+
+			reached[addr] = 1;
+			for (WORD i = 0; i < length; i++)
+				code[addr + i] = 1;
+
+			WORD nnn = opcode & 0x0FFF;
+			switch (op)
+			{
+			case OP_RET:
+				break;
+
+			case OP_JP:
+			case OP_JP_V:
+				target[nnn] = 1;
+				pending.push_back(nnn);
+				break;
+
+			case OP_CALL:
+				target[nnn] = 1;
+				pending.push_back(nnn);
+				pending.push_back(addr + 2);
+				break;
+
+			default:
+				// A skip passes F000 NNNN whole, like Chip8::SkipLength
+				if (IsSkip(op) && addr + 3 < end)
+				{
+					WORD skipped = (WORD)(addr + 2 + Length(addr + 2));
+					target[skipped & ADDR_MASK] = 1;
+					pending.push_back(skipped);
+				}
+				pending.push_back(addr + length);
+				break;
+			}
+		}
+
+		bool bSelfModifying = false, bIndirect = false;
+		int knownI = -1;
+
+		for (WORD addr = 0x200; addr + 1 < end; addr++)
+		{
+			if (!reached[addr])
+				continue;
+
+			OP op = DecodeOp(Fetch(addr), xoChip);
+			ops[op]++;
+
+			// Straight line code only, a jump can arrive with any I
+			WORD prev = (xoChip && addr >= 0x204 && reached[addr - 4] && Fetch(addr - 4) == 0xF000) ? addr - 4 : addr - 2;
+			if (target[addr] || addr < 0x202 || !reached[prev] || Ends(DecodeOp(Fetch(prev), xoChip)))
+				knownI = -1;
+
+			WORD second = addr + Length(addr);
+			if (!Ends(op) && second + 1 < end && reached[second])
+			{
+				OP secondOp = DecodeOp(Fetch(second), xoChip);
+				grams[0][(op << 8) | secondOp]++;
+
+				WORD third = second + Length(second);
+				if (!Ends(secondOp) && third + 1 < end && reached[third])
+					grams[1][(op << 16) | (secondOp << 8) | DecodeOp(Fetch(third), xoChip)]++;
+			}
+
+			WORD opcode = Fetch(addr);
+			switch (op)
+			{
+			case OP_LD_I:
+				knownI = opcode & 0x0FFF;
+				break;
+
+			case OP_LD_I_LONG:
+				knownI = Fetch(addr + 2);
+				break;
+
+			case OP_ADD_I:
+			case OP_LD_F:
+				knownI = -1;
+				break;
+
+			case OP_LD_B:
+			case OP_LD_55:
+			{
+				if (knownI < 0)
+				{
+					unknownWrites++;
+					break;
+				}
+
+				unsigned length = (op == OP_LD_B) ? 3 : ((opcode & 0x0F00) >> 8) + 1;
+				for (unsigned i = 0; i < length; i++)
+				{
+					// XO-CHIP has no code above RAM
+					unsigned at = xoChip ? (knownI + i) & 0xFFFF : (knownI + i) & ADDR_MASK;
+					if (at < RAM && code[at])
+					{
+						selfModifying++;
+						bSelfModifying = true;
+						break;
+					}
+				}
+				break;
+			}
+
+			case OP_JP_V:
+				indirectJumps++;
+				bIndirect = true;
+				break;
+
+			default:
+				break;
+			}
+		}
+
+		size_t inCode = std::count(code.begin() + 0x200, code.begin() + end, 1);
+		codeBytes += inCode;
+		dataBytes += size - inCode;
+		romsSelfModifying += bSelfModifying;
+		romsIndirect += bIndirect;
+		roms++;
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Adds the counts of another analysis
+	///
+	//////////////////////////////////////////////
+	void Merge(const RomAnalysis& other)
+	{
+		roms += other.roms;
+		codeBytes += other.codeBytes;
+		dataBytes += other.dataBytes;
+		for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+			ops[i] += other.ops[i];
+		for (int n = 0; n < 2; n++)
+			for (auto& gram : other.grams[n])
+				grams[n][gram.first] += gram.second;
+		selfModifying += other.selfModifying;
+		unknownWrites += other.unknownWrites;
+		indirectJumps += other.indirectJumps;
+		romsSelfModifying += other.romsSelfModifying;
+		romsIndirect += other.romsIndirect;
+	}
+
+	void Report(std::ostream& stream) const
+	{
+		uint64_t instructions = 0;
+		for (uint64_t count : ops)
+			instructions += count;
+
+		stream << roms << " ROMs, " << codeBytes << " bytes of code, " << dataBytes << " bytes of data, "
+			<< instructions << " reachable instructions" << std::endl;
+
+		std::vector<std::pair<uint64_t, int>> classes;
+		for (int op = OP_CLS; op <= OP_PLANE; op++)
+			classes.push_back({ ops[op], op });
+		std::sort(classes.rbegin(), classes.rend());
+
+		stream << std::fixed;
+		stream.precision(2);
+		stream << "Opcode classes:" << std::endl;
+		for (auto& c : classes)
+		{
+			if (c.first != 0)
+				stream << "  " << OpName((OP)c.second) << " " << c.first << " (" << 100.0 * c.first / std::max<uint64_t>(instructions, 1) << "%)" << std::endl;
+		}
+		stream.unsetf(std::ios::floatfield);
+
+		for (int n = 0; n < 2; n++)
+		{
+			std::vector<std::pair<uint64_t, uint32_t>> top;
+			for (auto& gram : grams[n])
+				top.push_back({ gram.second, gram.first });
+
+			size_t count = std::min<size_t>(ANALYSIS_TOP, top.size());
+			std::partial_sort(top.begin(), top.begin() + count, top.end(), std::greater<std::pair<uint64_t, uint32_t>>());
+
+			stream << "Top sequences of " << n + 2 << ":" << std::endl;
+			for (size_t i = 0; i < count; i++)
+			{
+				stream << "  ";
+				for (int shift = 8 * (n + 1); shift >= 0; shift -= 8)
+					stream << OpName((OP)((top[i].second >> shift) & 0xFF)) << (shift ? " " : "");
+				stream << "  " << top[i].first << std::endl;
+			}
+		}
+
+		stream << "Self-modifying writes: " << selfModifying << " in " << romsSelfModifying << " ROMs, "
+			<< unknownWrites << " more writes through an unknown I" << std::endl;
+		stream << "Indirect jumps: " << indirectJumps << " in " << romsIndirect << " ROMs" << std::endl;
+	}
+
+private:
+	//////////////////////////////////////////////
+	/// \brief Whether the next instruction only
+	///        runs if something jumps to it
+	///
+	//////////////////////////////////////////////
+	static bool Ends(OP op)
+	{
+		return op == OP_JP || op == OP_RET || op == OP_JP_V;
+	}
+};
+
+
+#ifndef _WIN32
+//////////////////////////////////////////////
+/// \brief Finds every .c8, .ch8 and .xo8 file
+///        under a directory
+///
+/// Symlinked directories are not followed, so a
+/// link back up the tree can't count ROMs twice
+//////////////////////////////////////////////
+inline void FindRoms(const std::string& directory, std::vector<std::string>& paths)
+{
+	DIR* dir = opendir(directory.c_str());
+	if (!dir)
+		return;
+
+	while (dirent* entry = readdir(dir))
+	{
+		std::string name = entry->d_name;
+		if (name == "." || name == "..")
+			continue;
+
+		std::string path = directory + "/" + name;
+		struct stat info;
+		if (lstat(path.c_str(), &info) != 0)
+			continue;
+
+		if (S_ISDIR(info.st_mode))
+			FindRoms(path, paths);
+		else if ((name.size() > 3 && name.compare(name.size() - 3, 3, ".c8") == 0) ||
+			(name.size() > 4 && name.compare(name.size() - 4, 4, ".ch8") == 0) || Chip8::IsXoChipRom(name))
+			paths.push_back(path);
+	}
+
+	closedir(dir);
+}
+
+
+//////////////////////////////////////////////
+/// \brief Analyzes every ROM under a directory,
+///        mapping them into memory, on a thread
+///        per core
+///
+/// \param directory Searched recursively
+/// \param threads   0 for one per core
+//////////////////////////////////////////////
+inline RomAnalysis AnalyzeCorpus(const std::string& directory, unsigned threads = 0)
+{
+	std::vector<std::string> paths;
+	FindRoms(directory, paths);
+
+	if (threads == 0)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+
+	RomAnalysis total;
+	std::mutex mux;
+	std::atomic<size_t> next{ 0 };
+
+	std::vector<std::thread> workers;
+	for (unsigned t = 0; t < threads; t++)
+	{
+		workers.emplace_back([&]()
+		{
+			RomAnalysis local;
+
+			for (size_t i; (i = next.fetch_add(1)) < paths.size(); )
+			{
+				int fd = open(paths[i].c_str(), O_RDONLY);
+				if (fd < 0)
+					continue;
+
+				struct stat info;
+				if (fstat(fd, &info) == 0 && info.st_size > 0)
+				{
+					void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+					if (data != MAP_FAILED)
+					{
+						local.Add((const BYTE*)data, info.st_size, Chip8::IsXoChipRom(paths[i]));
+						munmap(data, info.st_size);
+					}
+				}
+
+				close(fd);
+			}
+
+			std::lock_guard<std::mutex> ul(mux);
+			total.Merge(local);
+		});
+	}
+
+	for (auto& worker : workers)
+		worker.join();
+
+	return total;
+}
+#endif
+
+
+
+////////////////////////////////////////////////////////////////
+// REGRESSION SUITE
+//
+// Every case is a ROM, a seed and a key script, with the display
+// and state hashes Execute must produce at given frames. The ROM
+// is either one of the bundled games or a small program that
+// hammers one group of opcodes. Key scripts are random presses
+// from the seed, each held for REGRESSION_HOLD frames. The
+// bundled games are also booted with Boot and have to match a
+// machine that ran the same frames.
+//
+// Every checkpoint also holds the golden frame, packed like
+// Chip8::GetPackedDisplay, so a display that differs is printed
+// next to the frame it should have been. The state that differs
+// is printed next to what the reference interpreter reaches, to
+// tell a broken optimization from broken behaviour.
+//
+//   chip8 --regress-update
+//
+// prints the expected hashes and frames of every case in source
+// form, for changes that are meant to alter what a case does.
+//
+/////////////////////////////////////////////////////////////////
+
+const constexpr unsigned REGRESSION_HOLD = 8;
+const constexpr unsigned REGRESSION_CHECKPOINTS = 4;
+
+
+// Arithmetic and flags: every 8XYN with its VF read back, 7XKK into VF, FX33 and FX55 / FX65
+const BYTE REGRESSION_ALU[] = {
+	0xA3, 0x00,		// 200 LD I, 300
+	0x80, 0x14,		// 202 ADD V0, V1
+	0x8B, 0xF4,		// 204 ADD VB, VF
+	0x81, 0x05,		// 206 SUB V1, V0
+	0x8B, 0xF4,		// 208 ADD VB, VF
+	0x82, 0x26,		// 20A SHR V2
+	0x8B, 0xF4,		// 20C ADD VB, VF
+	0x83, 0x27,		// 20E SUBN V3, V2
+	0x8B, 0xF4,		// 210 ADD VB, VF
+	0x84, 0x3E,		// 212 SHL V4
+	0x8B, 0xF4,		// 214 ADD VB, VF
+	0x85, 0x01,		// 216 OR V5, V0
+	0x86, 0x12,		// 218 AND V6, V1
+	0x87, 0x23,		// 21A XOR V7, V2
+	0x88, 0xF4,		// 21C ADD V8, VF
+	0x71, 0x07,		// 21E ADD V1, 07
+	0x72, 0x0D,		// 220 ADD V2, 0D
+	0x73, 0x0B,		// 222 ADD V3, 0B
+	0x74, 0x03,		// 224 ADD V4, 03
+	0x8F, 0x04,		// 226 ADD VF, V0
+	0xF8, 0x33,		// 228 LD B, V8
+	0xA3, 0x10,		// 22A LD I, 310
+	0xFF, 0x55,		// 22C LD [I], VF
+	0xA3, 0x10,		// 22E LD I, 310
+	0xF5, 0x65,		// 230 LD V5, [I]
+	0x7A, 0x01,		// 232 ADD VA, 01
+	0x80, 0xA3,		// 234 XOR V0, VA
+	0x12, 0x02,		// 236 JP 202
+};
+
+
+// Control flow: CALL / RET, every skip, BNNN through a jump table
+const BYTE REGRESSION_FLOW[] = {
+	0x60, 0x00,		// 200 LD V0, 00
+	0x61, 0x00,		// 202 LD V1, 00
+	0x22, 0x40,		// 204 CALL 240
+	0x71, 0x01,		// 206 ADD V1, 01
+	0x31, 0x08,		// 208 SE V1, 08
+	0x12, 0x04,		// 20A JP 204
+	0x80, 0x04,		// 20C ADD V0, V0
+	0xB2, 0x60,		// 20E JP V0, 260
+	0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,		// 212 - 23F
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x70, 0x01,		// 240 ADD V0, 01
+	0x40, 0x03,		// 242 SNE V0, 03
+	0x60, 0x00,		// 244 LD V0, 00
+	0x00, 0xEE,		// 246 RET
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,		// 248 - 25F
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x12, 0x70,		// 260 JP 270
+	0x12, 0x76,		// 262 JP 276
+	0x12, 0x7C,		// 264 JP 27C
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,		// 266 - 26F
+	0x00, 0x00,
+	0x72, 0x01,		// 270 ADD V2, 01
+	0x12, 0x80,		// 272 JP 280
+	0x00, 0x00,
+	0x73, 0x01,		// 276 ADD V3, 01
+	0x12, 0x80,		// 278 JP 280
+	0x00, 0x00,
+	0x74, 0x01,		// 27C ADD V4, 01
+	0x12, 0x80,		// 27E JP 280
+	0x80, 0x06,		// 280 SHR V0
+	0x92, 0x30,		// 282 SNE V2, V3
+	0x75, 0x01,		// 284 ADD V5, 01
+	0x53, 0x40,		// 286 SE V3, V4
+	0x76, 0x01,		// 288 ADD V6, 01
+	0x12, 0x02,		// 28A JP 202
+};
+
+
+// Drawing: font sprites wrapping around both edges, collisions, CLS and a delay timer wait
+const BYTE REGRESSION_DRAW[] = {
+	0x00, 0xE0,		// 200 CLS
+	0x64, 0x0F,		// 202 LD V4, 0F
+	0xF2, 0x29,		// 204 LD F, V2
+	0xD0, 0x15,		// 206 DRW V0, V1, 5
+	0x83, 0xF0,		// 208 LD V3, VF
+	0x85, 0x34,		// 20A ADD V5, V3
+	0x70, 0x3B,		// 20C ADD V0, 3B
+	0x71, 0x05,		// 20E ADD V1, 05
+	0x72, 0x01,		// 210 ADD V2, 01
+	0x82, 0x42,		// 212 AND V2, V4
+	0x66, 0x03,		// 214 LD V6, 03
+	0xF6, 0x15,		// 216 LD DT, V6
+	0xF7, 0x07,		// 218 LD V7, DT
+	0x37, 0x00,		// 21A SE V7, 00
+	0x12, 0x18,		// 21C JP 218
+	0x35, 0x40,		// 21E SE V5, 40
+	0x12, 0x04,		// 220 JP 204
+	0x12, 0x00,		// 222 JP 200
+};
+
+
+// Input and randomness: RND, SKP / SKNP on random keys, FX0A and the sound timer
+const BYTE REGRESSION_INPUT[] = {
+	0xC0, 0xFF,		// 200 RND V0, FF
+	0xC1, 0x0F,		// 202 RND V1, 0F
+	0xE1, 0x9E,		// 204 SKP V1
+	0x72, 0x01,		// 206 ADD V2, 01
+	0xE1, 0xA1,		// 208 SKNP V1
+	0x73, 0x01,		// 20A ADD V3, 01
+	0x64, 0x80,		// 20C LD V4, 80
+	0x84, 0x02,		// 20E AND V4, V0
+	0x44, 0x00,		// 210 SNE V4, 00
+	0x12, 0x00,		// 212 JP 200
+	0xF5, 0x0A,		// 214 LD V5, K
+	0xF5, 0x18,		// 216 LD ST, V5
+	0x12, 0x00,		// 218 JP 200
+};
+
+// XO-CHIP: F000 NNNN above RAM and a skip over it, 5XY2 / 5XY3 both ways, FN01 with two plane DRW and one plane CLS
+const BYTE REGRESSION_XO[] = {
+	0xC0, 0xFF,		// 200 RND V0, FF
+	0xC1, 0x3F,		// 202 RND V1, 3F
+	0xF0, 0x00,		// 204 LD I, 1000
+	0x10, 0x00,
+	0x50, 0x32,		// 208 SAVE V0 - V3
+	0x5A, 0x73,		// 20A LOAD VA - V7
+	0xF3, 0x01,		// 20C PLANE 3
+	0xDA, 0x92,		// 20E DRW VA, V9, 2
+	0xF1, 0x01,		// 210 PLANE 1
+	0x64, 0x01,		// 212 LD V4, 01
+	0x84, 0x02,		// 214 AND V4, V0
+	0x34, 0x00,		// 216 SE V4, 00
+	0xF0, 0x00,		// 218 LD I, 23C
+	0x02, 0x3C,
+	0xD8, 0x73,		// 21C DRW V8, V7, 3
+	0x72, 0x05,		// 21E ADD V2, 05
+	0x73, 0x03,		// 220 ADD V3, 03
+	0x75, 0x01,		// 222 ADD V5, 01
+	0x66, 0x1F,		// 224 LD V6, 1F
+	0x86, 0x52,		// 226 AND V6, V5
+	0xF2, 0x01,		// 228 PLANE 2
+	0x36, 0x00,		// 22A SE V6, 00
+	0x12, 0x30,		// 22C JP 230
+	0x00, 0xE0,		// 22E CLS
+	0x66, 0x01,		// 230 LD V6, 01
+	0xF6, 0x15,		// 232 LD DT, V6
+	0xF6, 0x07,		// 234 LD V6, DT
+	0x36, 0x00,		// 236 SE V6, 00
+	0x12, 0x34,		// 238 JP 234
+	0x12, 0x00,		// 23A JP 200
+	0x3C, 0x7E, 0xFF,	// 23C Sprite
+};
+
+
+struct RegressionCheckpoint
+{
+	uint64_t frame;
+	uint64_t display;	// HashBytes of the display
+	uint64_t state;		// Chip8::Hash
+	const char* packed;	// Golden frame in hex, PACKED_SIZE bytes, nullptr if blank. Planes are ORed, display tells them apart
+};
+
+
+struct RegressionCase
+{
+	const char* name;
+	const char* path;		// A bundled ROM, or nullptr to run rom
+	const BYTE* rom;
+	size_t size;
+	bool xoChip;			// Runs with EnableXoChip
+	uint64_t seed;
+	RegressionCheckpoint expected[REGRESSION_CHECKPOINTS];
+};
+
+
+const RegressionCase REGRESSION_CASES[] = {
+	{ "invaders", "invaders.c8", nullptr, 0, false, 1, {
+		{ 1, 0xc8c4cfdcdf2219cd, 0xf0fbf13bfcd52370,
+			"000000000000000000000000000000007f000000000000000000000000000000"
+			"3f0000000000000000000000000000007f000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000" },
+		{ 60, 0x9660fc1d228bdab5, 0xeb64837d32e07682,
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"000f00f00f00f000001f81f81f81f800003fc3fc3fc3fc00003fc3fc3fc3fc00"
+			"0026426426426400002642642642640000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000100000000000000038000000000000007c00000000000000fe0000000" },
+		{ 600, 0x34e9ecd5e955ed29, 0xb9cf4e5b840587b2,
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000f00f00f00f000001f81f81f81f800003fc3fc3fc3fc00003fc3fc3fc3fc0"
+			"0002642642642640000264264264264000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000100000000000000038000000000000007c00000000000000fe0000000" },
+		{ 3600, 0xba88943e7992d621, 0xa498279973920f7c,
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"000000000000000000000000000000000000f00f00000f000001f81f80001f80"
+			"0003fc3fc0003fc00003fc3fc0003fc000026426400026400002642640002640"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000020000000000000007000000000000000f800000000000001fc000000" } } },
+	{ "tetris", "tetris.c8", nullptr, 0, false, 2, {
+		{ 1, 0x0, 0xda288b689c1a58f7, nullptr },
+		{ 60, 0x2734e34edb7231b4, 0x934dd463bd6493c,
+			"0000002004000000000000200400000000000020040000000000002004000000"
+			"0000002004000000000000238400000000000022040000000000002004000000"
+			"0000002004000000000000200400000000000020040000000000002004000000"
+			"0000002004000000000000200400000000000020040000000000002004000000"
+			"0000002004000000000000200400000000000020040000000000002004000000"
+			"0000002004000000000000200400000000000020040000000000002004000000"
+			"0000002004000000000000200400000000000020040000000000002004000000"
+			"0000002004000000000000200400000000000020040000000000003ffc000000" },
+		{ 600, 0xc6cd7c43627f2795, 0x7b6f4b33810d365a,
+			"0000002004000000000000200400000000000020040000000000002004000000"
+			"0000002004000000000000200400000000000020040000000000002004000000"
+			"0000002004000000000000200400000000000020040000000000002004000000"
+			"0000002004000000000000200400000000000020040000000000002084000000"
+			"000000208400000000000020c400000000000020040000000000002004000000"
+			"0000002004000000000000200400000000000020040000000000002004000000"
+			"0000002004000000000000200400000000000020040000000000002004000000"
+			"000000200400000000000021c400000000000021040000000000003ffc000000" },
+		{ 3600, 0x899be0e5524abd58, 0xef65d40e1567b7cf,
+			"0000002004000000000000200400000000000020040000000000002004000000"
+			"0000002004000000000000200400000000000020040000000000002004000000"
+			"0000002044000000000000204400000000000020440000000000002144000000"
+			"0000002184000000000000210400000000000021040000000000002104000000"
+			"00000021040000000000002704000000000000230400000000000023c4000000"
+			"000000208400000000000020c400000000000021840000000000002184000000"
+			"00000021840000000000002304000000000000234400000000000021c4000000"
+			"00000020e40000000000002dc40000000000002d040000000000003ffc000000" } } },
+	{ "pong2", "pong2.c8", nullptr, 0, false, 3, {
+		{ 1, 0x12393cc726b6150f, 0x7d6038e44ded3571,
+			"00000000c000000000000000c000000000000000c00000000000000000000000"
+			"00000000c000000000000000c000000000000000c00000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000" },
+		{ 60, 0x6dda52251668674b, 0xcc493161fa8ec85d,
+			"ffffffffffffffff00000000c000000000000f00c07800000000090000480000"
+			"00000900c048000000000900c048000000000f00c07800000000000000000000"
+			"00000000c000000000000000c000000000000000c00000000000000000000000"
+			"80000000c000000180000000c000000180000000c00000018000000000000001"
+			"80000000c000000180000000c000000100000000c00000000000000000000000"
+			"00000000c000000000000000c000000000000000c00000000000000000000000"
+			"00000000c000000000000000c000000000000000c00000000000000000000000"
+			"00000000c000000000000000c000000000000000c0000000ffffffffffffffff" },
+		{ 600, 0xb0d75bf3ab1afb30, 0x82e7dcd9523a42b3,
+			"ffffffffffffffff00000000c000000000000f00c07800000000010000480000"
+			"00000f00c048000000000100c048000000000f00c07800010000000000000001"
+			"80000000c000000180000000c000000180000000c00000018000000000000001"
+			"80000000c000000080000000c000000000000000c00000000000000000000000"
+			"00000000c000000000000000c000000000000000c00000000000000000000000"
+			"00000000c000000000000000c000000000000000c00000000000000000000000"
+			"00000000c000000000000000c000000000000000c00000000000000000000000"
+			"00000000c000000000000000c000000000000000c0000000ffffffffffffffff" },
+		{ 3600, 0xe3ee1cbb5808485, 0xa40b7d8ec79402c0,
+			"ffffffffffffffff00000000c000000080000f00c07800008000080000080000"
+			"80000f00c078000080000100c040000090000f00c07800008000000000000000"
+			"00000000c000000000000000c000000000000000c00000000000000000000000"
+			"00000000c000000000000000c000000000000000c00000010000000000000001"
+			"00000000c000000100000000c000000100000000c00000010000000000000001"
+			"00000000c000000000000000c000000000000000c00000000000000000000000"
+			"00000000c000000000000000c000000000000000c00000000000000000000000"
+			"00000000c000000000000000c000000000000000c0000000ffffffffffffffff" } } },
+	{ "alu", nullptr, REGRESSION_ALU, sizeof(REGRESSION_ALU), false, 4, {
+		{ 1, 0x0, 0x6c15f6b7409e5a72, nullptr },
+		{ 60, 0x0, 0x545542acd7636f2f, nullptr },
+		{ 600, 0x0, 0x1912bbfaf7c49b74, nullptr },
+		{ 3600, 0x0, 0x3713c2fdeb874f2b, nullptr } } },
+	{ "flow", nullptr, REGRESSION_FLOW, sizeof(REGRESSION_FLOW), false, 5, {
+		{ 1, 0x0, 0x6464b61cb82a98fa, nullptr },
+		{ 60, 0x0, 0x8d64ce3e4bbbe6d3, nullptr },
+		{ 600, 0x0, 0x5dc41cfbea3f2852, nullptr },
+		{ 3600, 0x0, 0x7afe5dba3e87927, nullptr } } },
+	{ "draw", nullptr, REGRESSION_DRAW, sizeof(REGRESSION_DRAW), false, 6, {
+		{ 1, 0x936962d55e4dfafd, 0x680307f737fa1ebf,
+			"f000000000000000900000000000000090000000000000009000000000000000"
+			"f000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000" },
+		{ 60, 0x1789e6b083e4e2dc, 0x596c94081d7ddd43,
+			"ff0000003c0000005000000024000001b00000003c000001b000000780000001"
+			"d000000080000001c00000010000000500000002000000300000000200000024"
+			"000000f000000038000000900000002e000000f0000003fc0000009000000040"
+			"000000f0000003c000001e000000020000001200000003c000001e0000007800"
+			"000002000000080000001e00000078000003c000000008000002400000007800"
+			"0003c00000090000000240000009000000024000000f00000070000000010000"
+			"00480000000100000070000001e0000000480000010000000070000001e00000"
+			"0f000000002000000800000001e00000080000003c0000000800000020000000" },
+		{ 600, 0xfca03bb5848db8f0, 0x18981441850b5ae8,
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000001e0000000000000010000000000000001e000000000"
+			"0000002000000000000001e00000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000" },
+		{ 3600, 0xe24857eb7e146761, 0xe22d7c735b4271a1,
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000007800"
+			"0000000000000800000000000000780000000000000008000000000000007800"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000" } } },
+	{ "input", nullptr, REGRESSION_INPUT, sizeof(REGRESSION_INPUT), false, 7, {
+		{ 1, 0x0, 0xef6e16a68f46b75f, nullptr },
+		{ 60, 0x0, 0xfad7c4ca58615bc1, nullptr },
+		{ 600, 0x0, 0xac43246f4acd5740, nullptr },
+		{ 3600, 0x0, 0x2dd4ba2e97e6a1d6, nullptr } } },
+	{ "xo", nullptr, REGRESSION_XO, sizeof(REGRESSION_XO), true, 8, {
+		{ 1, 0xb0faef0947166c20, 0x34e2138842c2e093,
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000278000000000000007000000000000000000000000000000000000000" },
+		{ 60, 0x8ba6eba8b7bb181e, 0x5ccc1562922f96e2,
+			"9e001f0000000c801c00000000000078f80000fa000000ff9d80003e3bc001fe"
+			"e04800000ec0000f2028000000000000c004003f80000003ff07c01380000000"
+			"5b828000000000002081e8000000b5000330360000000b0000b41e0000000000"
+			"0118014000000000000f62f000000000280fb1407a0000001e1fe1503e000000"
+			"0006feee800000000001fe0c80007e000000ff01c0003300000001e0c4000000"
+			"000003f078000000000007f807815e00000000080fc02a000000000b9fe00000"
+			"000000168000000000000000340e0000000000003c28000000013c00a0071ff0"
+			"0000fc026e0119b000000000d901680000000017ff00360000001a0fc0000880" },
+		{ 600, 0x82faa8be968bbfb4, 0x47d01c8fb0e91d0,
+			"5677b5d80579217f06b1819c2931e9aa390258a6a5c1481f0e0800541a2ab6d6"
+			"c347109bc8094a9f88016d355fb1faf8c43fd88c9a359f8e8167aa756913a360"
+			"08f1383c2611c03e8480316a5f68c01f21a0aa00bd7939b8f4f0e0494a10de00"
+			"08fc0da6e3b21a69581941dff9df5e87cf0e58800773fc33f1357445f307e417"
+			"b517a19b1c8e079a7907be9301761e9ffa029027727e5e03d0e6071c657b63f9"
+			"7ebec238e5ccc08d6fafd9cdcf56efb22e6d937c0a086a0ff0456bc33c80725c"
+			"e9d1970fc7abbd7c44572881409e44baa33f0375fffdd8700a4131f9b0079648"
+			"c59da4676df6d8ce63bc7621ff7a4e4f0f588349253305341dffee286a28d50f" },
+		{ 3600, 0x8ebb895a137911f1, 0x2440d5c394095533,
+			"0d57b37c88ebc5b270151da1001e5f3320a7a7de97c5bfd289b6f4a26dc036fd"
+			"0d5ebd7bfae87fee825e170a695c8a6e81371b6a4e46e3af2df9deeed6eee6a8"
+			"f5ce552f027bf9910b8f6e3f2319ce69932a586d8edf7ee8d5bec71fedd5f881"
+			"ab27dc436fa245ecb77b9491777e4ddb4df9d2f7357bdd63f2ce610eb5ce3abe"
+			"2b7394c3d93ec562352e1cebc76407e0639f6718065d170ef086373c2bde8c66"
+			"cf2cd8df53fee3abeddfb61ce977936a963b9982dea0e679bef4a829bfaf71e7"
+			"c144f2ef4492853ebc9c71fb19c4dfc94a33036bf3af0630967fbea93bdf605e"
+			"f2cc8b768b03f3b6fbe5bc493ec0b33f224b151f2b18832472d2a947b0703274" } } },
+};
+
+const constexpr uint64_t REGRESSION_FRAMES[REGRESSION_CHECKPOINTS] = { 1, 60, 600, 3600 };
+
+
+//////////////////////////////////////////////
+/// \brief Reads the ROM of a case
+///
+/// \return Empty if a bundled ROM is missing
+//////////////////////////////////////////////
+inline std::vector<BYTE> RegressionRom(const RegressionCase& test)
+{
+	if (!test.path)
+		return std::vector<BYTE>(test.rom, test.rom + test.size);
+
+	std::ifstream file(test.path, std::ios::binary);
+	return std::vector<BYTE>((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+}
+
+
+//////////////////////////////////////////////
+/// \brief Runs a case up to a frame
+///
+/// \param engine As for Lockstep
+//////////////////////////////////////////////
+template<typename TEngine>
+Chip8 RunRegression(const RegressionCase& test, const std::vector<BYTE>& rom, uint64_t frames, TEngine engine)
+{
+	Chip8 machine;
+	machine.Initialize();
+	machine.Seed(test.seed);
+	if (test.xoChip)
+		machine.EnableXoChip();
+	machine.LoadGame(rom.data(), rom.size());
+
+	// Half the time one key is held
+	std::mt19937 random((uint32_t)test.seed);
+	std::vector<WORD> keys;
+	for (uint64_t frame = 0; frame < frames; frame++)
+	{
+		if (frame % REGRESSION_HOLD != 0)
+			keys.push_back(keys.back());
+		else
+			keys.push_back((random() % 2) ? (WORD)(1 << (random() % 16)) : 0);
+	}
+
+	RunFrames(machine, engine, keys, 0, frames);
+	return machine;
+}
+
+
+//////////////////////////////////////////////
+/// \brief Unpacks a display packed like
+///        Chip8::GetPackedDisplay to a byte per
+///        pixel, as getDisplay has it
+///
+//////////////////////////////////////////////
+inline void UnpackDisplay(const BYTE* packed, BYTE* pixels)
+{
+	for (unsigned i = 0; i < WIDTH * HEIGHT; i++)
+		pixels[i] = (packed[i / 8] >> (7 - i % 8)) & 1;
+}
+
+
+//////////////////////////////////////////////
+/// \brief Prints two displays on top of each
+///        other, one character per pixel
+///
+/// '#' lit in both, '+' only lit in actual,
+/// '-' only lit in expected
+//////////////////////////////////////////////
+inline void PrintDisplayDiff(std::ostream& stream, const BYTE* actual, const BYTE* expected)
+{
+	for (unsigned y = 0; y < HEIGHT; y++)
+	{
+		stream << "  ";
+		for (unsigned x = 0; x < WIDTH; x++)
+		{
+			bool a = actual[y * WIDTH + x] != 0;
+			bool e = expected[y * WIDTH + x] != 0;
+			stream << ((a && e) ? '#' : a ? '+' : e ? '-' : '.');
+		}
+		stream << std::endl;
+	}
+}
+
+
+//////////////////////////////////////////////
+/// \brief Packs the display of a machine as
+///        RegressionCheckpoint::packed
+///
+/// \return Empty if the display is blank
+//////////////////////////////////////////////
+inline std::string PackedRegressionFrame(const Chip8& machine)
+{
+	BYTE packed[PACKED_SIZE];
+	machine.GetPackedDisplay(packed);
+	if (std::all_of(packed, packed + PACKED_SIZE, [](BYTE b) { return b == 0; }))
+		return std::string();
+
+	static const char* digits = "0123456789abcdef";
+	std::string hex;
+	for (BYTE b : packed)
+	{
+		hex += digits[b >> 4];
+		hex += digits[b & 0xF];
+	}
+	return hex;
+}
+
+
+//////////////////////////////////////////////
+/// \brief Unpacks a golden frame to a byte
+///        per pixel, as getDisplay has it
+///
+/// \param packed Empty for a blank display
+//////////////////////////////////////////////
+inline void UnpackRegressionFrame(const std::string& packed, BYTE* pixels)
+{
+	BYTE bytes[PACKED_SIZE] = {};
+	for (size_t i = 0; i < PACKED_SIZE && i * 2 + 1 < packed.size(); i++)
+		bytes[i] = (BYTE)std::stoul(packed.substr(i * 2, 2), nullptr, 16);
+
+	UnpackDisplay(bytes, pixels);
+}
+
+
+//////////////////////////////////////////////
+/// \brief Checks that a machine continued from
+///        Boot matches one that ran the boot
+///        frames, and keeps matching a second
+///        later
+///
+/// BootStep is its own copy of the opcodes, no
+/// engine runs it
+///
+/// \return An empty string if they match
+//////////////////////////////////////////////
+inline std::string CheckBoot(const RegressionCase& test, const std::vector<BYTE>& rom)
+{
+	std::ostringstream out;
+	BootState state = Boot(rom.data(), rom.size());
+
+	Chip8 booted;
+	booted.Initialize();
+	booted.Seed(test.seed);
+	booted.LoadBoot(state);
+
+	Chip8 ran;
+	ran.Initialize();
+	ran.Seed(test.seed);
+	ran.LoadGame(rom.data(), rom.size());
+
+	const std::vector<WORD> keys = { 0 };
+	RunFrames(ran, DecodedEngine, keys, 0, state.frames);
+
+	for (uint64_t frames : { (uint64_t)state.frames, (uint64_t)state.frames + FRAME_RATE })
+	{
+		if (frames != state.frames)
+		{
+			RunFrames(booted, DecodedEngine, keys, state.frames, frames);
+			RunFrames(ran, DecodedEngine, keys, state.frames, frames);
+		}
+
+		if (booted.Hash() == ran.Hash())
+			continue;
+
+		out << test.name << ": booted " << state.frames << " frames, differs from running them at frame " << frames << std::endl;
+		PrintDisplayDiff(out, booted.getDisplay(), ran.getDisplay());
+		out << " booted:" << std::endl;
+		booted.DumpRegisters(out);
+		out << " ran:" << std::endl;
+		ran.DumpRegisters(out);
+		break;
+	}
+
+	return out.str();
+}
+
+
+//////////////////////////////////////////////
+/// \brief Runs one case and describes every
+///        way it fails
+///
+/// \return An empty string if the case passed
+//////////////////////////////////////////////
+inline std::string CheckRegression(const RegressionCase& test)
+{
+	std::ostringstream out;
+
+	std::vector<BYTE> rom = RegressionRom(test);
+	if (rom.empty())
+	{
+		out << test.name << ": cannot read " << test.path << std::endl;
+		return out.str();
+	}
+
+	for (const RegressionCheckpoint& expected : test.expected)
+	{
+		Chip8 actual = RunRegression(test, rom, expected.frame, DecodedEngine);
+		uint64_t display = Chip8::HashBytes(0, actual.getDisplay(), WIDTH * HEIGHT);
+		uint64_t state = actual.Hash();
+		std::string packed = PackedRegressionFrame(actual);
+		std::string golden = expected.packed ? expected.packed : "";
+		bool bDisplay = display != expected.display || packed != golden;
+		if (!bDisplay && state == expected.state)
+			continue;
+
+		out << test.name << ": frame " << expected.frame << ", "
+			<< (bDisplay ? "display" : "state") << " differs" << std::endl;
+
+		if (bDisplay)
+		{
+			BYTE pixels[WIDTH * HEIGHT];
+			UnpackRegressionFrame(golden, pixels);
+			PrintDisplayDiff(out, actual.getDisplay(), pixels);
+		}
+
+		if (state != expected.state)
+		{
+			Chip8 reference = RunRegression(test, rom, expected.frame, ReferenceEngine);
+			out << " actual:" << std::endl;
+			actual.DumpRegisters(out);
+			out << " reference interpreter" << ((reference.Hash() == state) ? ", the same:" : ":") << std::endl;
+			reference.DumpRegisters(out);
+		}
+		break;
+	}
+
+	// The bundled games are what a kiosk build boots
+	if (test.path)
+		out << CheckBoot(test, rom);
+
+	return out.str();
+}
+
+
+//////////////////////////////////////////////
+/// \brief Runs every case, a thread per core
+///
+/// \param stream Failures go here
+/// \return Number of cases that failed
+//////////////////////////////////////////////
+inline unsigned RunRegressionSuite(std::ostream& stream)
+{
+	const size_t count = sizeof(REGRESSION_CASES) / sizeof(REGRESSION_CASES[0]);
+	std::vector<std::string> failures(count);
+	std::atomic<size_t> next{ 0 };
+
+	std::vector<std::thread> workers;
+	for (unsigned t = 0; t < std::max(1u, std::thread::hardware_concurrency()); t++)
+	{
+		workers.emplace_back([&]()
+		{
+			for (size_t i; (i = next.fetch_add(1)) < count; )
+				failures[i] = CheckRegression(REGRESSION_CASES[i]);
+		});
+	}
+
+	for (auto& worker : workers)
+		worker.join();
+
+	unsigned failed = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		stream << REGRESSION_CASES[i].name << (failures[i].empty() ? ": ok" : ": FAILED") << std::endl;
+		stream << failures[i];
+		failed += !failures[i].empty();
+	}
+
+	return failed;
+}
+
+
+//////////////////////////////////////////////
+/// \brief Prints the hashes and frames every
+///        case produces now, as REGRESSION_CASES
+///        initializers
+///
+//////////////////////////////////////////////
+inline void PrintRegressionHashes(std::ostream& stream)
+{
+	for (const RegressionCase& test : REGRESSION_CASES)
+	{
+		std::vector<BYTE> rom = RegressionRom(test);
+
+		stream << "\t// " << test.name << std::endl;
+		for (uint64_t frame : REGRESSION_FRAMES)
+		{
+			Chip8 machine = RunRegression(test, rom, frame, DecodedEngine);
+			stream << "\t\t{ " << frame << std::hex << ", 0x" << Chip8::HashBytes(0, machine.getDisplay(), WIDTH * HEIGHT)
+				<< ", 0x" << machine.Hash() << std::dec << ",";
+
+			// Four display rows a line
+			std::string packed = PackedRegressionFrame(machine);
+			if (packed.empty())
+				stream << " nullptr";
+			for (size_t i = 0; i < packed.size(); i += 64)
+				stream << std::endl << "\t\t\t\"" << packed.substr(i, 64) << '"';
+			stream << " }," << std::endl;
+		}
+	}
+}
+
+
+
+////////////////////////////////////////////////////////////////
+// MOVIES
+//
+// A recorded session, written while it is played. A movie is a
+// header followed by records, every one appended as it happens:
+//
+//   "C8MV" <u8 version> <u32 interval>
+//   'K' <u64 frame> <u32 size> <size bytes>   Keyframe, the state
+//                                              before the frame as
+//                                              Chip8::SaveState writes it
+//   'I' <u16 mask>                             Keys held from this
+//                                              frame on
+//   'F' <u16 size> <size bytes of runs>        End of a frame
+//
+// A keyframe starts every interval frames. Every run is
+// <u8 offset> <u8 count> <count bytes>, XORed into the display of
+// the frame before, packed like Chip8::GetPackedDisplay, so a frame
+// that draws nothing costs 3 bytes. Closing the movie appends the
+// keyframe index and a trailer:
+//
+//   'X' <u32 count> <count * (<u64 frame> <u64 offset>)>
+//   <u64 frames> <u64 index offset> "C8IX"
+//
+// Keyframe n is at frame n * interval, so a seek reads one index
+// entry and re-simulates less than interval frames from it. The
+// runs check that the re-simulation draws what was recorded. A
+// movie cut short before its trailer is indexed by scanning it.
+//
+// All integers are little endian
+//
+/////////////////////////////////////////////////////////////////
+
+const constexpr unsigned MOVIE_VERSION = 2;
+const constexpr unsigned MOVIE_KEYFRAME_INTERVAL = FRAME_RATE * 5;	// Frames between keyframes
+const constexpr unsigned MOVIE_HEADER_SIZE = 9;
+const constexpr unsigned MOVIE_TRAILER_SIZE = 20;
+
+
+struct MovieKeyframe
+{
+	uint64_t frame;
+	uint64_t offset;	// Of the 'K' record
+};
+
+
+//////////////////////////////////////////////
+/// \brief Writes a movie frame by frame
+///
+/// Nothing is ever seeked or rewritten, so the
+/// stream can be a pipe
+//////////////////////////////////////////////
+class MovieRecorder
+{
+public:
+	MovieRecorder(std::ostream& stream, unsigned interval = MOVIE_KEYFRAME_INTERVAL)
+		: m_stream(stream), m_nInterval(interval ? interval : 1)
+	{
+		Write("C8MV", 4);
+		Put(MOVIE_VERSION, 1);
+		Put(m_nInterval, 4);
+	}
+
+	~MovieRecorder()
+	{
+		Close();
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Records the keys of a frame, and
+	///        the whole state if a keyframe is due
+	///
+	/// \param machine The machine, with the keys of
+	///                the frame set but not run yet
+	//////////////////////////////////////////////
+	void BeginFrame(const Chip8& machine)
+	{
+		WORD keys = machine.GetKeys();
+
+		if (m_nFrames % m_nInterval == 0)
+		{
+			std::ostringstream state;
+			machine.SaveState(state);
+			std::string bytes = state.str();
+
+			m_index.push_back({ m_nFrames, m_nOffset });
+			Put('K', 1);
+			Put(m_nFrames, 8);
+			Put(bytes.size(), 4);
+			Write(bytes.data(), bytes.size());
+
+			machine.GetPackedDisplay(m_packed);
+		}
+
+		// Also after a keyframe, which playing on from an earlier one skips
+		if (keys != m_keys)
+		{
+			Put('I', 1);
+			Put(keys, 2);
+			m_keys = keys;
+		}
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Records what a frame drew
+	///
+	/// \param machine The machine, after the frame
+	///                and its timer tick
+	//////////////////////////////////////////////
+	void EndFrame(const Chip8& machine)
+	{
+		BYTE packed[PACKED_SIZE];
+		machine.GetPackedDisplay(packed);
+
+		BYTE runs[PACKED_SIZE * 2];
+		unsigned size = 0;
+		for (unsigned i = 0; i < PACKED_SIZE; )
+		{
+			if (packed[i] == m_packed[i])
+			{
+				i++;
+				continue;
+			}
+
+			unsigned start = i;
+			runs[size++] = (BYTE)start;
+			unsigned count = size++;
+			while (i < PACKED_SIZE && i - start < 0xFF && packed[i] != m_packed[i])
+			{
+				runs[size++] = packed[i] ^ m_packed[i];
+				i++;
+			}
+			runs[count] = (BYTE)(i - start);
+		}
+
+		Put('F', 1);
+		Put(size, 2);
+		Write(runs, size);
+
+		std::copy(packed, packed + PACKED_SIZE, m_packed);
+		m_nFrames++;
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Appends the index and the trailer.
+	///        Nothing can be recorded after this
+	///
+	//////////////////////////////////////////////
+	void Close()
+	{
+		if (m_bClosed)
+			return;
+
+		uint64_t indexOffset = m_nOffset;
+		Put('X', 1);
+		Put(m_index.size(), 4);
+		for (const MovieKeyframe& keyframe : m_index)
+		{
+			Put(keyframe.frame, 8);
+			Put(keyframe.offset, 8);
+		}
+
+		Put(m_nFrames, 8);
+		Put(indexOffset, 8);
+		Write("C8IX", 4);
+		m_stream.flush();
+
+		m_bClosed = true;
+	}
+
+	uint64_t Frames() const { return m_nFrames; }
+	uint64_t Bytes() const { return m_nOffset; }
+
+private:
+	void Write(const void* data, size_t size)
+	{
+		m_stream.write((const char*)data, size);
+		m_nOffset += size;
+	}
+
+	void Put(uint64_t value, int bytes)
+	{
+		for (int i = 0; i < bytes; i++)
+			m_stream.put((char)(value >> (i * 8)));
+		m_nOffset += bytes;
+	}
+
+	std::ostream& m_stream;
+	unsigned m_nInterval;
+	uint64_t m_nOffset = 0;
+	uint64_t m_nFrames = 0;
+	bool m_bClosed = false;
+
+	std::vector<MovieKeyframe> m_index;
+	BYTE m_packed[PACKED_SIZE] = {};	// Display after the last frame
+	WORD m_keys = 0;
+};
+
+
+//////////////////////////////////////////////
+/// \brief Seeks in a movie and plays it back
+///        by re-simulating it
+///
+//////////////////////////////////////////////
+class MoviePlayer
+{
+public:
+	MoviePlayer(std::istream& stream) : m_stream(stream)
+	{
+		char magic[4] = {};
+		m_stream.read(magic, 4);
+		unsigned version = (unsigned)Get(1);
+		m_nInterval = (unsigned)Get(4);
+
+		m_bValid = m_stream.good() && std::equal(magic, magic + 4, "C8MV") && version == MOVIE_VERSION && m_nInterval != 0;
+		if (m_bValid && !ReadIndex())
+			ScanIndex();
+		m_bValid = m_bValid && !m_index.empty();
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Puts a machine in the state it was
+	///        in before a frame
+	///
+	/// \param frame   The frame, up to Frames()
+	/// \param machine Gets the state
+	/// \return Whether the frame is in the movie
+	//////////////////////////////////////////////
+	bool Seek(uint64_t frame, Chip8& machine)
+	{
+		if (!m_bValid || frame > m_nFrames)
+			return false;
+
+		// Keyframes are evenly spaced, the index is only searched if they are not
+		size_t k = (size_t)std::min<uint64_t>(frame / m_nInterval, m_index.size() - 1);
+		while (k > 0 && m_index[k].frame > frame)
+			k--;
+
+		m_stream.clear();
+		m_stream.seekg(m_index[k].offset);
+		if (Get(1) != 'K')
+			return false;
+
+		m_nFrame = Get(8);
+		std::string state((size_t)Get(4), '\0');
+		m_stream.read(&state[0], state.size());
+
+		std::istringstream stateStream(state);
+		if (!m_stream.good() || !machine.LoadState(stateStream))
+			return false;
+
+		machine.GetPackedDisplay(m_packed);
+		m_bDesynced = false;
+
+		while (m_nFrame < frame)
+		{
+			if (!Step(machine))
+				return false;
+		}
+		return true;
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Runs the next frame of the movie
+	///
+	/// \return False at the end of the movie
+	//////////////////////////////////////////////
+	bool Step(Chip8& machine)
+	{
+		while (m_nFrame < m_nFrames)
+		{
+			int tag = m_stream.get();
+			if (tag == 'I')
+			{
+				machine.SetKeys((WORD)Get(2));
+			}
+			else if (tag == 'K')
+			{
+				Get(8);
+				m_stream.ignore(Get(4));
+			}
+			else if (tag == 'F')
+			{
+				BYTE runs[PACKED_SIZE * 2];
+				unsigned size = (unsigned)Get(2);
+				m_stream.read((char*)runs, std::min<unsigned>(size, sizeof(runs)));
+				if (!m_stream.good() || size > sizeof(runs))
+					return false;
+
+				machine.Execute(CYCLES_PER_FRAME);
+				machine.UpdateTimers();
+
+				for (unsigned i = 0; i + 2 <= size; i += 2 + runs[i + 1])
+				{
+					for (unsigned j = 0; j < runs[i + 1] && i + 2 + j < size; j++)
+						m_packed[(runs[i] + j) % PACKED_SIZE] ^= runs[i + 2 + j];
+				}
+
+				BYTE packed[PACKED_SIZE];
+				machine.GetPackedDisplay(packed);
+				if (!std::equal(packed, packed + PACKED_SIZE, m_packed))
+					m_bDesynced = true;
+
+				m_nFrame++;
+				return true;
+			}
+			else
+				return false;
+		}
+		return false;
+	}
+
+	bool Valid() const { return m_bValid; }
+	uint64_t Frames() const { return m_nFrames; }
+	uint64_t Frame() const { return m_nFrame; }
+	unsigned Interval() const { return m_nInterval; }
+	size_t Keyframes() const { return m_index.size(); }
+
+	//////////////////////////////////////////////
+	/// \brief Whether a frame played since the
+	///        last Seek drew something else than
+	///        what was recorded
+	///
+	//////////////////////////////////////////////
+	bool Desynced() const { return m_bDesynced; }
+
+	//////////////////////////////////////////////
+	/// \brief The recorded display after the last
+	///        frame played, packed
+	///
+	//////////////////////////////////////////////
+	const BYTE* Recorded() const { return m_packed; }
+
+private:
+	//////////////////////////////////////////////
+	/// \brief Reads the index the trailer points to
+	///
+	/// \return False if there is no trailer
+	//////////////////////////////////////////////
+	bool ReadIndex()
+	{
+		m_stream.seekg(0, std::ios::end);
+		uint64_t end = (uint64_t)m_stream.tellg();
+		if (!m_stream.good() || end < MOVIE_HEADER_SIZE + MOVIE_TRAILER_SIZE)
+			return false;
+
+		m_stream.seekg(end - MOVIE_TRAILER_SIZE);
+		uint64_t frames = Get(8);
+		uint64_t indexOffset = Get(8);
+		char magic[4] = {};
+		m_stream.read(magic, 4);
+		if (!m_stream.good() || !std::equal(magic, magic + 4, "C8IX") || indexOffset >= end)
+			return false;
+
+		m_stream.seekg(indexOffset);
+		if (Get(1) != 'X')
+			return false;
+
+		uint64_t count = Get(4);
+		if (count > (end - indexOffset) / 16)
+			return false;
+
+		for (uint64_t i = 0; i < count; i++)
+		{
+			MovieKeyframe keyframe;
+			keyframe.frame = Get(8);
+			keyframe.offset = Get(8);
+			m_index.push_back(keyframe);
+		}
+
+		m_nFrames = frames;
+		return m_stream.good();
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Indexes a movie without a trailer,
+	///        up to its last whole frame
+	///
+	//////////////////////////////////////////////
+	void ScanIndex()
+	{
+		m_index.clear();
+		m_nFrames = 0;
+
+		m_stream.clear();
+		m_stream.seekg(MOVIE_HEADER_SIZE);
+		for (;;)
+		{
+			uint64_t offset = (uint64_t)m_stream.tellg();
+			int tag = m_stream.get();
+			if (tag == 'K')
+			{
+				uint64_t frame = Get(8);
+				m_stream.ignore(Get(4));
+				if (!m_stream.good())
+					break;
+				m_index.push_back({ frame, offset });
+			}
+			else if (tag == 'I')
+				Get(2);
+			else if (tag == 'F')
+			{
+				m_stream.ignore(Get(2));
+				if (!m_stream.good())
+					break;
+				m_nFrames++;
+			}
+			else
+				break;
+		}
+
+		m_stream.clear();
+	}
+
+	uint64_t Get(int bytes)
+	{
+		uint64_t value = 0;
+		for (int i = 0; i < bytes; i++)
+			value |= (uint64_t)(BYTE)m_stream.get() << (i * 8);
+		return value;
+	}
+
+	std::istream& m_stream;
+	unsigned m_nInterval = 0;
+	bool m_bValid = false;
+	bool m_bDesynced = false;
+
+	std::vector<MovieKeyframe> m_index;
+	uint64_t m_nFrames = 0;				// In the movie
+	uint64_t m_nFrame = 0;				// Frames the machine has run
+	BYTE m_packed[PACKED_SIZE] = {};	// Recorded display after frame m_nFrame
+};
+
+
+
+////////////////////////////////////////////////////////////////
+// AUDIO
+//
+// The emulator thread renders the beeper into a lock-free ring
+// once per timer tick and never waits on anything. An audio
+// thread drains the ring in AUDIO_BLOCK sized pieces and hands
+// them to a sink. Every frame is rendered whole, so the wave
+// stays continuous. The audio thread starts playing once
+// AUDIO_PRIME samples are queued, a frame and a block of slack
+// for the jitter of the emulator thread, and goes back to waiting
+// if the ring runs dry. When the emulator gets ahead by more than
+// AUDIO_LATENCY it skips back to AUDIO_PRIME, oldest first, so
+// the sound stays under two frames behind.
+//
+/////////////////////////////////////////////////////////////////
+
+//////////////////////////////////////////////
+/// \brief Single producer / single consumer
+///        ring buffer without locks
+///
+/// \tparam T Element type
+/// \tparam N Capacity, must be a power of two
+//////////////////////////////////////////////
+template <typename T, size_t N>
+class SpscRing
+{
+	static_assert((N & (N - 1)) == 0, "Capacity must be a power of two");
+
+public:
+	//////////////////////////////////////////////
+	/// \brief Appends as many elements as fit.
+	///        Producer thread only
+	///
+	/// \return Number of elements appended
+	//////////////////////////////////////////////
+	size_t Push(const T* data, size_t count)
+	{
+		size_t tail = m_tail.load(std::memory_order_relaxed);
+		size_t head = m_head.load(std::memory_order_acquire);
+
+		count = std::min(count, N - (tail - head));
+		for (size_t i = 0; i < count; i++)
+			m_buffer[(tail + i) & (N - 1)] = data[i];
+
+		m_tail.store(tail + count, std::memory_order_release);
+		return count;
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Removes up to count elements.
+	///        Consumer thread only
+	///
+	/// \return Number of elements removed
+	//////////////////////////////////////////////
+	size_t Pop(T* data, size_t count)
+	{
+		size_t head = m_head.load(std::memory_order_relaxed);
+		size_t tail = m_tail.load(std::memory_order_acquire);
+
+		count = std::min(count, tail - head);
+		for (size_t i = 0; i < count; i++)
+			data[i] = m_buffer[(head + i) & (N - 1)];
+
+		m_head.store(head + count, std::memory_order_release);
+		return count;
+	}
+
+	size_t Size() const
+	{
+		return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire);
+	}
+
+private:
+	alignas(64) std::atomic<size_t> m_head{ 0 };	// Written by the consumer
+	alignas(64) std::atomic<size_t> m_tail{ 0 };	// Written by the producer
+	T m_buffer[N];
+};
+
+
+//////////////////////////////////////////////
+/// \brief Receives blocks of 16 bit mono
+///        samples on the audio thread
+///
+//////////////////////////////////////////////
+class AudioSink
+{
+public:
+	virtual ~AudioSink() {}
+	virtual void Write(const short* samples, size_t count) = 0;
+};
+
+
+//////////////////////////////////////////////
+/// \brief Throws samples away, for headless runs
+///
+//////////////////////////////////////////////
+class NullSink : public AudioSink
+{
+public:
+	virtual void Write(const short*, size_t count)
+	{
+		m_nSamples += count;
+	}
+
+	uint64_t SamplesWritten() const { return m_nSamples; }
+
+private:
+	std::atomic<uint64_t> m_nSamples{ 0 };
+};
+
+
+//////////////////////////////////////////////
+/// \brief Writes samples to a .wav file
+///
+//////////////////////////////////////////////
+class WavSink : public AudioSink
+{
+public:
+	WavSink(const std::string& filepath) : m_file(filepath, std::ios::binary)
+	{
+		WriteHeader();
+	}
+
+	~WavSink()
+	{
+		// Sizes are only known now
+		m_file.seekp(0);
+		WriteHeader();
+	}
+
+	virtual void Write(const short* samples, size_t count)
+	{
+		for (size_t i = 0; i < count; i++)
+			Put(samples[i], 2);
+
+		m_nBytes += (uint32_t)count * 2;
+	}
+
+private:
+	void WriteHeader()
+	{
+		m_file.write("RIFF", 4);
+		Put(36 + m_nBytes, 4);
+		m_file.write("WAVEfmt ", 8);
+		Put(16, 4);					// Format chunk size
+		Put(1, 2);					// PCM
+		Put(1, 2);					// Mono
+		Put(SAMPLE_RATE, 4);
+		Put(SAMPLE_RATE * 2, 4);	// Bytes per second
+		Put(2, 2);					// Bytes per sample
+		Put(16, 2);					// Bits per sample
+		m_file.write("data", 4);
+		Put(m_nBytes, 4);
+	}
+
+	void Put(uint32_t value, int bytes)
+	{
+		for (int i = 0; i < bytes; i++)
+			m_file.put((char)(value >> (i * 8)));
+	}
+
+	std::ofstream m_file;
+	uint32_t m_nBytes = 0;
+};
+
+
+#ifdef _WIN32
+//////////////////////////////////////////////
+/// \brief Plays samples on the default device
+///
+//////////////////////////////////////////////
+class WaveOutSink : public AudioSink
+{
+public:
+	WaveOutSink()
+	{
+		WAVEFORMATEX format = {};
+		format.wFormatTag = WAVE_FORMAT_PCM;
+		format.nChannels = 1;
+		format.nSamplesPerSec = SAMPLE_RATE;
+		format.nAvgBytesPerSec = SAMPLE_RATE * 2;
+		format.nBlockAlign = 2;
+		format.wBitsPerSample = 16;
+
+		if (waveOutOpen(&m_hDevice, WAVE_MAPPER, &format, 0, 0, CALLBACK_NULL) != MMSYSERR_NOERROR)
+			m_hDevice = nullptr;
+	}
+
+	~WaveOutSink()
+	{
+		if (!m_hDevice)
+			return;
+
+		waveOutReset(m_hDevice);
+		for (WAVEHDR& header : m_headers)
+			if (header.dwFlags & WHDR_PREPARED)
+				waveOutUnprepareHeader(m_hDevice, &header, sizeof(WAVEHDR));
+		waveOutClose(m_hDevice);
+	}
+
+	virtual void Write(const short* samples, size_t count)
+	{
+		WAVEHDR& header = m_headers[m_nNext];
+		if (!m_hDevice || (header.dwFlags & WHDR_INQUEUE))
+			return;		// Device is behind, drop the block
+
+		if (header.dwFlags & WHDR_PREPARED)
+			waveOutUnprepareHeader(m_hDevice, &header, sizeof(WAVEHDR));
+
+		count = std::min<size_t>(count, AUDIO_BLOCK);
+		std::copy(samples, samples + count, m_blocks[m_nNext]);
+
+		header = {};
+		header.lpData = (char*)m_blocks[m_nNext];
+		header.dwBufferLength = (DWORD)count * 2;
+		waveOutPrepareHeader(m_hDevice, &header, sizeof(WAVEHDR));
+		waveOutWrite(m_hDevice, &header, sizeof(WAVEHDR));
+
+		m_nNext = (m_nNext + 1) % 4;
+	}
+
+private:
+	HWAVEOUT m_hDevice;
+	WAVEHDR m_headers[4] = {};
+	short m_blocks[4][AUDIO_BLOCK];
+	int m_nNext = 0;
+};
+#endif
+
+
+//////////////////////////////////////////////
+/// \brief Turns the sound timer into a square
+///        wave and feeds it to a sink
+///
+//////////////////////////////////////////////
+class Beeper
+{
+public:
+	Beeper(AudioSink& sink) : m_sink(sink)
+	{
+		m_bAtomActive = true;
+		m_thread = std::thread(&Beeper::AudioThread, this);
+	}
+
+	~Beeper()
+	{
+		m_bAtomActive = false;
+		m_thread.join();
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Renders one frame of sound. Call once
+	///        per timer tick from the emulator
+	///        thread, never blocks
+	///
+	/// \param sound_timer The machine's sound timer
+	//////////////////////////////////////////////
+	void Update(BYTE sound_timer)
+	{
+		short samples[SAMPLES_PER_FRAME];
+		for (unsigned i = 0; i < SAMPLES_PER_FRAME; i++)
+		{
+			samples[i] = (sound_timer == 0) ? 0 : (m_nPhase < SAMPLE_RATE / 2) ? 8000 : -8000;
+			m_nPhase = (m_nPhase + BEEP_FREQUENCY) % SAMPLE_RATE;
+		}
+
+		// Only drops samples while the audio thread is stuck
+		m_ring.Push(samples, SAMPLES_PER_FRAME);
+	}
+
+private:
+	//////////////////////////////////////////////
+	/// \brief Drains the ring once per block,
+	///        filling underruns with silence
+	///
+	//////////////////////////////////////////////
+	void AudioThread()
+	{
+		const auto period = std::chrono::microseconds(1000000ull * AUDIO_BLOCK / SAMPLE_RATE);
+		auto deadline = std::chrono::steady_clock::now();
+
+		short block[AUDIO_BLOCK];
+		bool bPlaying = false;
+		while (m_bAtomActive)
+		{
+			size_t queued = m_ring.Size();
+			bPlaying = bPlaying || queued >= AUDIO_PRIME;
+
+			size_t count = 0;
+			if (bPlaying)
+			{
+				// Only this thread pops, so queued samples stay there
+				if (queued > AUDIO_LATENCY)
+				{
+					for (size_t skip = queued - AUDIO_PRIME; skip > 0; )
+						skip -= m_ring.Pop(block, std::min<size_t>(skip, AUDIO_BLOCK));
+				}
+
+				count = m_ring.Pop(block, AUDIO_BLOCK);
+				bPlaying = count == AUDIO_BLOCK;
+			}
+
+			std::fill(block + count, block + AUDIO_BLOCK, 0);
+			m_sink.Write(block, AUDIO_BLOCK);
+
+			deadline += period;
+			std::this_thread::sleep_until(deadline);
+		}
+	}
+
+	AudioSink& m_sink;
+	SpscRing<short, 2048> m_ring;		// Two frames
+	unsigned m_nPhase = 0;
+
+	std::thread m_thread;
+	std::atomic<bool> m_bAtomActive;
+};
+
+
+
+#ifdef CHIP8_KIOSK
+////////////////////////////////////////////////////////////////
+// KIOSK BUILD
+//
+// -DCHIP8_KIOSK builds a binary that plays the ROM below without
+// reading a file, starting after its boot frames. For another
+// game, replace the bytes with the output of xxd -i
+//
+/////////////////////////////////////////////////////////////////
+
+const constexpr BYTE KIOSK_ROM[] =
+{
+	0x12, 0x25, 0x53, 0x50, 0x41, 0x43, 0x45, 0x20, 0x49, 0x4E, 0x56, 0x41, 0x44, 0x45, 0x52, 0x53,
+	0x20, 0x30, 0x2E, 0x39, 0x31, 0x20, 0x42, 0x79, 0x20, 0x44, 0x61, 0x76, 0x69, 0x64, 0x20, 0x57,
+	0x49, 0x4E, 0x54, 0x45, 0x52, 0x60, 0x00, 0x61, 0x00, 0x62, 0x08, 0xA3, 0xDD, 0xD0, 0x18, 0x71,
+	0x08, 0xF2, 0x1E, 0x31, 0x20, 0x12, 0x2D, 0x70, 0x08, 0x61, 0x00, 0x30, 0x40, 0x12, 0x2D, 0x69,
+	0x05, 0x6C, 0x15, 0x6E, 0x00, 0x23, 0x91, 0x60, 0x0A, 0xF0, 0x15, 0xF0, 0x07, 0x30, 0x00, 0x12,
+	0x4B, 0x23, 0x91, 0x7E, 0x01, 0x12, 0x45, 0x66, 0x00, 0x68, 0x1C, 0x69, 0x00, 0x6A, 0x04, 0x6B,
+	0x0A, 0x6C, 0x04, 0x6D, 0x3C, 0x6E, 0x0F, 0x00, 0xE0, 0x23, 0x75, 0x23, 0x51, 0xFD, 0x15, 0x60,
+	0x04, 0xE0, 0x9E, 0x12, 0x7D, 0x23, 0x75, 0x38, 0x00, 0x78, 0xFF, 0x23, 0x75, 0x60, 0x06, 0xE0,
+	0x9E, 0x12, 0x8B, 0x23, 0x75, 0x38, 0x39, 0x78, 0x01, 0x23, 0x75, 0x36, 0x00, 0x12, 0x9F, 0x60,
+	0x05, 0xE0, 0x9E, 0x12, 0xE9, 0x66, 0x01, 0x65, 0x1B, 0x84, 0x80, 0xA3, 0xD9, 0xD4, 0x51, 0xA3,
+	0xD9, 0xD4, 0x51, 0x75, 0xFF, 0x35, 0xFF, 0x12, 0xAD, 0x66, 0x00, 0x12, 0xE9, 0xD4, 0x51, 0x3F,
+	0x01, 0x12, 0xE9, 0xD4, 0x51, 0x66, 0x00, 0x83, 0x40, 0x73, 0x03, 0x83, 0xB5, 0x62, 0xF8, 0x83,
+	0x22, 0x62, 0x08, 0x33, 0x00, 0x12, 0xC9, 0x23, 0x7D, 0x82, 0x06, 0x43, 0x08, 0x12, 0xD3, 0x33,
+	0x10, 0x12, 0xD5, 0x23, 0x7D, 0x82, 0x06, 0x33, 0x18, 0x12, 0xDD, 0x23, 0x7D, 0x82, 0x06, 0x43,
+	0x20, 0x12, 0xE7, 0x33, 0x28, 0x12, 0xE9, 0x23, 0x7D, 0x3E, 0x00, 0x13, 0x07, 0x79, 0x06, 0x49,
+	0x18, 0x69, 0x00, 0x6A, 0x04, 0x6B, 0x0A, 0x6C, 0x04, 0x7D, 0xF4, 0x6E, 0x0F, 0x00, 0xE0, 0x23,
+	0x51, 0x23, 0x75, 0xFD, 0x15, 0x12, 0x6F, 0xF7, 0x07, 0x37, 0x00, 0x12, 0x6F, 0xFD, 0x15, 0x23,
+	0x51, 0x8B, 0xA4, 0x3B, 0x12, 0x13, 0x1B, 0x7C, 0x02, 0x6A, 0xFC, 0x3B, 0x02, 0x13, 0x23, 0x7C,
+	0x02, 0x6A, 0x04, 0x23, 0x51, 0x3C, 0x18, 0x12, 0x6F, 0x00, 0xE0, 0xA4, 0xDD, 0x60, 0x14, 0x61,
+	0x08, 0x62, 0x0F, 0xD0, 0x1F, 0x70, 0x08, 0xF2, 0x1E, 0x30, 0x2C, 0x13, 0x33, 0x60, 0xFF, 0xF0,
+	0x15, 0xF0, 0x07, 0x30, 0x00, 0x13, 0x41, 0xF0, 0x0A, 0x00, 0xE0, 0xA7, 0x06, 0xFE, 0x65, 0x12,
+	0x25, 0xA3, 0xC1, 0xF9, 0x1E, 0x61, 0x08, 0x23, 0x69, 0x81, 0x06, 0x23, 0x69, 0x81, 0x06, 0x23,
+	0x69, 0x81, 0x06, 0x23, 0x69, 0x7B, 0xD0, 0x00, 0xEE, 0x80, 0xE0, 0x80, 0x12, 0x30, 0x00, 0xDB,
+	0xC6, 0x7B, 0x0C, 0x00, 0xEE, 0xA3, 0xD9, 0x60, 0x1C, 0xD8, 0x04, 0x00, 0xEE, 0x23, 0x51, 0x8E,
+	0x23, 0x23, 0x51, 0x60, 0x05, 0xF0, 0x18, 0xF0, 0x15, 0xF0, 0x07, 0x30, 0x00, 0x13, 0x89, 0x00,
+	0xEE, 0x6A, 0x00, 0x8D, 0xE0, 0x6B, 0x04, 0xE9, 0xA1, 0x12, 0x57, 0xA6, 0x0C, 0xFD, 0x1E, 0xF0,
+	0x65, 0x30, 0xFF, 0x13, 0xAF, 0x6A, 0x00, 0x6B, 0x04, 0x6D, 0x01, 0x6E, 0x01, 0x13, 0x97, 0xA5,
+	0x0A, 0xF0, 0x1E, 0xDB, 0xC6, 0x7B, 0x08, 0x7D, 0x01, 0x7A, 0x01, 0x3A, 0x07, 0x13, 0x97, 0x00,
+	0xEE, 0x3C, 0x7E, 0xFF, 0xFF, 0x99, 0x99, 0x7E, 0xFF, 0xFF, 0x24, 0x24, 0xE7, 0x7E, 0xFF, 0x3C,
+	0x3C, 0x7E, 0xDB, 0x81, 0x42, 0x3C, 0x7E, 0xFF, 0xDB, 0x10, 0x38, 0x7C, 0xFE, 0x00, 0x00, 0x7F,
+	0x00, 0x3F, 0x00, 0x7F, 0x00, 0x00, 0x00, 0x01, 0x01, 0x01, 0x03, 0x03, 0x03, 0x03, 0x00, 0x00,
+	0x3F, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x3F, 0x08, 0x08, 0xFF, 0x00, 0x00, 0xFE,
+	0x00, 0xFC, 0x00, 0xFE, 0x00, 0x00, 0x00, 0x7E, 0x42, 0x42, 0x62, 0x62, 0x62, 0x62, 0x00, 0x00,
+	0xFF, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF, 0x00, 0x00, 0xFF, 0x00, 0x7D, 0x00,
+	0x41, 0x7D, 0x05, 0x7D, 0x7D, 0x00, 0x00, 0xC2, 0xC2, 0xC6, 0x44, 0x6C, 0x28, 0x38, 0x00, 0x00,
+	0xFF, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF, 0x00, 0x00, 0xFF, 0x00, 0xF7, 0x10,
+	0x14, 0xF7, 0xF7, 0x04, 0x04, 0x00, 0x00, 0x7C, 0x44, 0xFE, 0xC2, 0xC2, 0xC2, 0xC2, 0x00, 0x00,
+	0xFF, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF, 0x00, 0x00, 0xFF, 0x00, 0xEF, 0x20,
+	0x28, 0xE8, 0xE8, 0x2F, 0x2F, 0x00, 0x00, 0xF9, 0x85, 0xC5, 0xC5, 0xC5, 0xC5, 0xF9, 0x00, 0x00,
+	0xFF, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF, 0x00, 0x00, 0xFF, 0x00, 0xBE, 0x00,
+	0x20, 0x30, 0x20, 0xBE, 0xBE, 0x00, 0x00, 0xF7, 0x04, 0xE7, 0x85, 0x85, 0x84, 0xF4, 0x00, 0x00,
+	0xFF, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF, 0x00, 0x00, 0xFF, 0x00, 0x00, 0x7F,
+	0x00, 0x3F, 0x00, 0x7F, 0x00, 0x00, 0x00, 0xEF, 0x28, 0xEF, 0x00, 0xE0, 0x60, 0x6F, 0x00, 0x00,
+	0xFF, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF, 0x00, 0x00, 0xFF, 0x00, 0x00, 0xFE,
+	0x00, 0xFC, 0x00, 0xFE, 0x00, 0x00, 0x00, 0xC0, 0x00, 0xC0, 0xC0, 0xC0, 0xC0, 0xC0, 0x00, 0x00,
+	0xFC, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0xFC, 0x10, 0x10, 0xFF, 0xF9, 0x81, 0xB9,
+	0x8B, 0x9A, 0x9A, 0xFA, 0x00, 0xFA, 0x8A, 0x9A, 0x9A, 0x9B, 0x99, 0xF8, 0xE6, 0x25, 0x25, 0xF4,
+	0x34, 0x34, 0x34, 0x00, 0x17, 0x14, 0x34, 0x37, 0x36, 0x26, 0xC7, 0xDF, 0x50, 0x50, 0x5C, 0xD8,
+	0xD8, 0xDF, 0x00, 0xDF, 0x11, 0x1F, 0x12, 0x1B, 0x19, 0xD9, 0x7C, 0x44, 0xFE, 0x86, 0x86, 0x86,
+	0xFC, 0x84, 0xFE, 0x82, 0x82, 0xFE, 0xFE, 0x80, 0xC0, 0xC0, 0xC0, 0xFE, 0xFC, 0x82, 0xC2, 0xC2,
+	0xC2, 0xFC, 0xFE, 0x80, 0xF8, 0xC0, 0xC0, 0xFE, 0xFE, 0x80, 0xF0, 0xC0, 0xC0, 0xC0, 0xFE, 0x80,
+	0xBE, 0x86, 0x86, 0xFE, 0x86, 0x86, 0xFE, 0x86, 0x86, 0x86, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x18, 0x18, 0x18, 0x48, 0x48, 0x78, 0x9C, 0x90, 0xB0, 0xC0, 0xB0, 0x9C, 0x80, 0x80, 0xC0, 0xC0,
+	0xC0, 0xFE, 0xEE, 0x92, 0x92, 0x86, 0x86, 0x86, 0xFE, 0x82, 0x86, 0x86, 0x86, 0x86, 0x7C, 0x82,
+	0x86, 0x86, 0x86, 0x7C, 0xFE, 0x82, 0xFE, 0xC0, 0xC0, 0xC0, 0x7C, 0x82, 0xC2, 0xCA, 0xC4, 0x7A,
+	0xFE, 0x86, 0xFE, 0x90, 0x9C, 0x84, 0xFE, 0xC0, 0xFE, 0x02, 0x02, 0xFE, 0xFE, 0x10, 0x30, 0x30,
+	0x30, 0x30, 0x82, 0x82, 0xC2, 0xC2, 0xC2, 0xFE, 0x82, 0x82, 0x82, 0xEE, 0x38, 0x10, 0x86, 0x86,
+	0x96, 0x92, 0x92, 0xEE, 0x82, 0x44, 0x38, 0x38, 0x44, 0x82, 0x82, 0x82, 0xFE, 0x30, 0x30, 0x30,
+	0xFE, 0x02, 0x1E, 0xF0, 0x80, 0xFE, 0x00, 0x00, 0x00, 0x00, 0x06, 0x06, 0x00, 0x00, 0x00, 0x60,
+	0x60, 0xC0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x18, 0x18, 0x18, 0x18, 0x00, 0x18, 0x7C, 0xC6,
+	0x0C, 0x18, 0x00, 0x18, 0x00, 0x00, 0xFE, 0xFE, 0x00, 0x00, 0xFE, 0x82, 0x86, 0x86, 0x86, 0xFE,
+	0x08, 0x08, 0x08, 0x18, 0x18, 0x18, 0xFE, 0x02, 0xFE, 0xC0, 0xC0, 0xFE, 0xFE, 0x02, 0x1E, 0x06,
+	0x06, 0xFE, 0x84, 0xC4, 0xC4, 0xFE, 0x04, 0x04, 0xFE, 0x80, 0xFE, 0x06, 0x06, 0xFE, 0xC0, 0xC0,
+	0xC0, 0xFE, 0x82, 0xFE, 0xFE, 0x02, 0x02, 0x06, 0x06, 0x06, 0x7C, 0x44, 0xFE, 0x86, 0x86, 0xFE,
+	0xFE, 0x82, 0xFE, 0x06, 0x06, 0x06, 0x44, 0xFE, 0x44, 0x44, 0xFE, 0x44, 0xA8, 0xA8, 0xA8, 0xA8,
+	0xA8, 0xA8, 0xA8, 0x6C, 0x5A, 0x00, 0x0C, 0x18, 0xA8, 0x30, 0x4E, 0x7E, 0x00, 0x12, 0x18, 0x66,
+	0x6C, 0xA8, 0x5A, 0x66, 0x54, 0x24, 0x66, 0x00, 0x48, 0x48, 0x18, 0x12, 0xA8, 0x06, 0x90, 0xA8,
+	0x12, 0x00, 0x7E, 0x30, 0x12, 0xA8, 0x84, 0x30, 0x4E, 0x72, 0x18, 0x66, 0xA8, 0xA8, 0xA8, 0xA8,
+	0xA8, 0xA8, 0x90, 0x54, 0x78, 0xA8, 0x48, 0x78, 0x6C, 0x72, 0xA8, 0x12, 0x18, 0x6C, 0x72, 0x66,
+	0x54, 0x90, 0xA8, 0x72, 0x2A, 0x18, 0xA8, 0x30, 0x4E, 0x7E, 0x00, 0x12, 0x18, 0x66, 0x6C, 0xA8,
+	0x72, 0x54, 0xA8, 0x5A, 0x66, 0x18, 0x7E, 0x18, 0x4E, 0x72, 0xA8, 0x72, 0x2A, 0x18, 0x30, 0x66,
+	0xA8, 0x30, 0x4E, 0x7E, 0x00, 0x6C, 0x30, 0x54, 0x4E, 0x9C, 0xA8, 0xA8, 0xA8, 0xA8, 0xA8, 0xA8,
+	0xA8, 0x48, 0x54, 0x7E, 0x18, 0xA8, 0x90, 0x54, 0x78, 0x66, 0xA8, 0x6C, 0x2A, 0x30, 0x5A, 0xA8,
+	0x84, 0x30, 0x72, 0x2A, 0xA8, 0xD8, 0xA8, 0x00, 0x4E, 0x12, 0xA8, 0xE4, 0xA2, 0xA8, 0x00, 0x4E,
+	0x12, 0xA8, 0x6C, 0x2A, 0x54, 0x54, 0x72, 0xA8, 0x84, 0x30, 0x72, 0x2A, 0xA8, 0xDE, 0x9C, 0xA8,
+	0x72, 0x2A, 0x18, 0xA8, 0x0C, 0x54, 0x48, 0x5A, 0x78, 0x72, 0x18, 0x66, 0xA8, 0x66, 0x18, 0x5A,
+	0x54, 0x66, 0x72, 0x6C, 0xA8, 0x72, 0x2A, 0x00, 0x72, 0xA8, 0x72, 0x2A, 0x18, 0xA8, 0x30, 0x4E,
+	0x7E, 0x00, 0x12, 0x18, 0x66, 0x6C, 0xA8, 0x00, 0x66, 0x18, 0xA8, 0x30, 0x4E, 0x0C, 0x66, 0x18,
+	0x00, 0x6C, 0x30, 0x4E, 0x24, 0xA8, 0x72, 0x2A, 0x18, 0x30, 0x66, 0xA8, 0x1E, 0x54, 0x66, 0x0C,
+	0x18, 0x9C, 0xA8, 0x24, 0x54, 0x54, 0x12, 0xA8, 0x42, 0x78, 0x0C, 0x3C, 0xA8, 0xAE, 0xA8, 0xA8,
+	0xA8, 0xA8, 0xA8, 0xA8, 0xA8, 0xFF, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+const constexpr BootState KIOSK_BOOT = Boot(KIOSK_ROM, sizeof(KIOSK_ROM));
+#endif
+
+
+
+////////////////////////////////////////////////////////////////
+// METRICS
+//
+// Counters and histograms are updated without locks from any
+// thread, so the emulator never waits on whoever reads them.
+// Metrics::Snapshot is the pull API, StatsDumper prints one
+// periodically.
+//
+/////////////////////////////////////////////////////////////////
+
+const constexpr unsigned TITLE_RATE = 4;	// Window title updates per second
+
+
+class Counter
+{
+public:
+	void Add(uint64_t n = 1) { m_value.fetch_add(n, std::memory_order_relaxed); }
+	uint64_t Get() const { return m_value.load(std::memory_order_relaxed); }
+
+private:
+	std::atomic<uint64_t> m_value{ 0 };
+};
+
+
+//////////////////////////////////////////////
+/// \brief Histogram with equally wide buckets.
+///        Values past the last bucket count
+///        into the last bucket
+///
+//////////////////////////////////////////////
+class Histogram
+{
+public:
+	Histogram(double bucketWidth, size_t buckets) :
+		m_fBucketWidth(bucketWidth), m_nBuckets(buckets), m_buckets(new std::atomic<uint64_t>[buckets])
+	{
+		for (size_t i = 0; i < m_nBuckets; i++)
+			m_buckets[i] = 0;
+	}
+
+	void Add(double value)
+	{
+		size_t bucket = (value <= 0) ? 0 : (size_t)(value / m_fBucketWidth);
+		m_buckets[std::min(bucket, m_nBuckets - 1)].fetch_add(1, std::memory_order_relaxed);
+		m_nCount.fetch_add(1, std::memory_order_relaxed);
+
+		double max = m_fMax.load(std::memory_order_relaxed);
+		while (value > max && !m_fMax.compare_exchange_weak(max, value, std::memory_order_relaxed));
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Returns the upper edge of the bucket
+	///        holding the given percentile
+	///
+	/// \param percentile 0 - 100
+	//////////////////////////////////////////////
+	double Percentile(double percentile) const
+	{
+		uint64_t total = 0;
+		for (size_t i = 0; i < m_nBuckets; i++)
+			total += m_buckets[i].load(std::memory_order_relaxed);
+
+		uint64_t rank = (uint64_t)std::ceil(total * percentile / 100.0);
+		uint64_t seen = 0;
+
+		for (size_t i = 0; i < m_nBuckets; i++)
+		{
+			seen += m_buckets[i].load(std::memory_order_relaxed);
+			if (seen >= rank && seen > 0)
+				return (i + 1) * m_fBucketWidth;
+		}
+		return 0;
+	}
+
+	uint64_t Count() const { return m_nCount.load(std::memory_order_relaxed); }
+	double Max() const { return m_fMax.load(std::memory_order_relaxed); }
+
+private:
+	double m_fBucketWidth;
+	size_t m_nBuckets;
+	std::unique_ptr<std::atomic<uint64_t>[]> m_buckets;
+	std::atomic<uint64_t> m_nCount{ 0 };
+	std::atomic<double> m_fMax{ 0 };
+};
+
+
+//////////////////////////////////////////////
+/// \brief Adds the time until it goes out of
+///        scope to a histogram, in milliseconds
+///
+//////////////////////////////////////////////
+class ScopedTimer
+{
+public:
+	ScopedTimer(Histogram& histogram) :
+		m_histogram(histogram), m_start(std::chrono::steady_clock::now())
+	{
+	}
+
+	~ScopedTimer()
+	{
+		m_histogram.Add(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - m_start).count());
+	}
+
+private:
+	Histogram& m_histogram;
+	std::chrono::steady_clock::time_point m_start;
+};
+
+
+//////////////////////////////////////////////
+/// \brief Where a reader's previous snapshot
+///        was taken. Every reader keeps its own,
+///        so they don't shorten each other's rates
+///
+//////////////////////////////////////////////
+struct SnapshotCursor
+{
+	std::chrono::steady_clock::time_point time = std::chrono::steady_clock::now();
+	uint64_t instructions = 0;
+	uint64_t frames = 0;
+	uint64_t waits = 0;
+	double waitSum = 0;
+};
+
+
+struct MetricsSnapshot
+{
+	double seconds;				// Since the previous snapshot
+
+	uint64_t instructions;		// Totals since start
+	uint64_t frames;
+	uint64_t framesUnchanged;
+	uint64_t ticksMissed;
+
+	double instructionsPerSecond;	// Since the previous snapshot
+	double framesPerSecond;
+	double waitPerFrame;		// ms
+
+	double renderP50, renderP99;	// ms
+	double presentP50, presentP99;	// ms
+};
+
+
+class Metrics
+{
+public:
+	Counter instructions;		// Instructions executed
+	Counter frames;				// Frames presented
+	Counter framesUnchanged;	// Frames not presented, they looked like the last one shown
+	Counter ticksMissed;		// Timer ticks skipped because a frame overran
+
+	Histogram renderTime{ 0.01, 1000 };		// Emulating + drawing a frame, ms
+	Histogram presentTime{ 0.01, 1000 };	// Handing a frame to the output, ms
+	Histogram waitTime{ 0.1, 500 };			// Waiting for the next frame, ms
+
+	//////////////////////////////////////////////
+	/// \brief Reads all metrics. Rates cover the
+	///        time since the previous snapshot
+	///        taken with the same cursor
+	///
+	/// \param since Moved to now
+	//////////////////////////////////////////////
+	MetricsSnapshot Snapshot(SnapshotCursor& since) const
+	{
+		auto now = std::chrono::steady_clock::now();
+		MetricsSnapshot snapshot;
+
+		snapshot.seconds = std::chrono::duration<double>(now - since.time).count();
+		snapshot.instructions = instructions.Get();
+		snapshot.frames = frames.Get();
+		snapshot.framesUnchanged = framesUnchanged.Get();
+		snapshot.ticksMissed = ticksMissed.Get();
+
+		double seconds = std::max(snapshot.seconds, 1e-9);
+		uint64_t frameDelta = snapshot.frames - since.frames;
+		uint64_t waitCount = waitTime.Count();
+		double waitSum = m_waitMicros.Get() / 1000.0;
+
+		snapshot.instructionsPerSecond = (snapshot.instructions - since.instructions) / seconds;
+		snapshot.framesPerSecond = frameDelta / seconds;
+		snapshot.waitPerFrame = (waitCount > since.waits) ? (waitSum - since.waitSum) / (waitCount - since.waits) : 0;
+
+		snapshot.renderP50 = renderTime.Percentile(50);
+		snapshot.renderP99 = renderTime.Percentile(99);
+		snapshot.presentP50 = presentTime.Percentile(50);
+		snapshot.presentP99 = presentTime.Percentile(99);
+
+		since.time = now;
+		since.instructions = snapshot.instructions;
+		since.frames = snapshot.frames;
+		since.waits = waitCount;
+		since.waitSum = waitSum;
+
+		return snapshot;
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Records time spent waiting for a frame
+	///
+	/// \param ms Milliseconds waited
+	//////////////////////////////////////////////
+	void AddWait(double ms)
+	{
+		waitTime.Add(ms);
+		m_waitMicros.Add((uint64_t)(ms * 1000));
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Prints a snapshot as one line, rates
+	///        cover the whole run
+	///
+	//////////////////////////////////////////////
+	void Dump(std::ostream& stream) const
+	{
+		SnapshotCursor start = m_start;
+		Dump(stream, start);
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Prints a snapshot as one line, rates
+	///        cover the time since the cursor
+	///
+	//////////////////////////////////////////////
+	void Dump(std::ostream& stream, SnapshotCursor& since) const
+	{
+		MetricsSnapshot s = Snapshot(since);
+
+		stream << std::fixed;
+		stream.precision(2);
+		stream << "ips " << s.instructionsPerSecond << " (" << s.instructions << ")"
+			<< ", fps " << s.framesPerSecond << " (" << s.frames << ", " << s.framesUnchanged << " unchanged)"
+			<< ", render p50/p99 " << s.renderP50 << "/" << s.renderP99 << "ms"
+			<< ", present p50/p99 " << s.presentP50 << "/" << s.presentP99 << "ms"
+			<< ", wait " << s.waitPerFrame << "ms/frame"
+			<< ", ticks missed " << s.ticksMissed << std::endl;
+		stream.unsetf(std::ios::floatfield);
+	}
+
+private:
+	Counter m_waitMicros;
+	SnapshotCursor m_start;		// Taken at startup
+} metrics;
+
+
+//////////////////////////////////////////////
+/// \brief Dumps the metrics to a stream at a
+///        fixed interval from its own thread
+///
+//////////////////////////////////////////////
+class StatsDumper
+{
+public:
+	StatsDumper(std::ostream& stream, std::chrono::milliseconds interval) :
+		m_stream(stream), m_interval(interval)
+	{
+		m_thread = std::thread(&StatsDumper::DumpThread, this);
+	}
+
+	~StatsDumper()
+	{
+		{
+			std::lock_guard<std::mutex> ul(m_mux);
+			m_bStop = true;
+		}
+		m_cv.notify_one();
+		m_thread.join();
+	}
+
+private:
+	void DumpThread()
+	{
+		std::unique_lock<std::mutex> ul(m_mux);
+		while (!m_cv.wait_for(ul, m_interval, [this] { return m_bStop; }))
+			metrics.Dump(m_stream, m_since);
+	}
+
+	std::ostream& m_stream;
+	std::chrono::milliseconds m_interval;
+	SnapshotCursor m_since;
+
+	std::thread m_thread;
+	std::mutex m_mux;
+	std::condition_variable m_cv;
+	bool m_bStop = false;
+};
+
+
+
+////////////////////////////////////////////////////////////////
+// PROFILING
+//
+// Samples where guest code spends its time without counting
+// instructions. Every thread that runs machines has a
+// ProfileSlot. A timer thread looks at the slots PROFILE_RATE
+// times a second. A slot that was written since the last look
+// counts as one sample and gets a request for the next one.
+// Execute checks for a request before every instruction and
+// publishes pc and the call stack of the machine. A request that
+// came while the machine was idle is served at a random
+// instruction of the next Execute instead of its first one.
+// Nothing is interrupted or stopped, and without a profiler the
+// check is one test of a local pointer.
+//
+// Output is in collapsed stack format for flamegraph tools:
+//
+//   main;update;draw_ship;draw_ship+0x6 42
+//
+// The first frame is 0x200, every frame after it the subroutine
+// a CALL on the stack went to, and the last one pc. Addresses get
+// the name of the closest label at or below them from a label
+// file, lines of
+//
+//   <hex address> <name>
+//
+// with # starting a comment. Without one they are printed in hex.
+// A machine is only sampled while it runs instructions, so the
+// counts are guest time. A machine paced at 60Hz gives at most
+// one sample a frame, at a random instruction of it, however
+// fast the timer ticks.
+//
+/////////////////////////////////////////////////////////////////
+
+const constexpr unsigned PROFILE_RATE = 1000;	// Ticks per second, at most one sample a tick and thread
+const constexpr unsigned PROFILE_RETRIES = 4;	// Reads of a slot that is being written before a tick leaves it
+
+
+struct ProfileSample
+{
+	WORD pc;
+	WORD depth;
+	WORD calls[16];		// Address of every CALL on the stack
+};
+
+
+struct ProfiledThread
+{
+	ProfileSlot slot;
+	std::atomic<bool> attached{ false };
+	uint32_t counted = 0;		// Sequence of the last sample counted, timer thread only
+};
+
+
+//////////////////////////////////////////////
+/// \brief Samples machines on the threads
+///        that run them
+///
+//////////////////////////////////////////////
+class GuestProfiler
+{
+public:
+	GuestProfiler(unsigned rate = PROFILE_RATE)
+		: m_interval(std::chrono::microseconds(1000000 / (rate ? rate : 1)))
+	{
+		m_thread = std::thread(&GuestProfiler::TimerThread, this);
+	}
+
+	~GuestProfiler()
+	{
+		{
+			std::lock_guard<std::mutex> lg(m_mux);
+			m_bStop = true;
+		}
+		m_cv.notify_one();
+		m_thread.join();
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Samples the machines the calling
+	///        thread runs from now on
+	///
+	//////////////////////////////////////////////
+	void Attach()
+	{
+		if (t_owner != this)
+		{
+			std::unique_ptr<ProfiledThread> thread(new ProfiledThread());
+			t_thread = thread.get();
+			t_owner = this;
+
+			std::lock_guard<std::mutex> lg(m_mux);
+			m_threads.push_back(std::move(thread));
+		}
+
+		t_thread->attached.store(true, std::memory_order_relaxed);
+		Chip8::PublishTo(&t_thread->slot);
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Stops sampling the calling thread.
+	///        Has to be called before the profiler
+	///        is destroyed
+	///
+	//////////////////////////////////////////////
+	void Detach()
+	{
+		if (t_owner != this)
+			return;
+
+		Chip8::PublishTo(nullptr);
+		t_thread->attached.store(false, std::memory_order_relaxed);
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Reads names for addresses
+	///
+	/// \return False if the file cannot be read
+	//////////////////////////////////////////////
+	bool LoadLabels(const std::string& filepath)
+	{
+		std::ifstream file(filepath);
+		if (!file)
+			return false;
+
+		for (std::string line; std::getline(file, line); )
+		{
+			line = line.substr(0, line.find('#'));
+
+			std::istringstream fields(line);
+			unsigned addr;
+			std::string name;
+			if (fields >> std::hex >> addr >> name)
+				m_labels[(WORD)addr] = name;
+		}
+		return true;
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Writes every stack sampled so far in
+	///        collapsed stack format
+	///
+	/// \param code A machine with the code in its
+	///             memory, to find where CALLs went
+	//////////////////////////////////////////////
+	void WriteFolded(std::ostream& stream, const Chip8& code)
+	{
+		std::lock_guard<std::mutex> lg(m_mux);
+
+		// Different call sites of one subroutine fold into one line
+		std::map<std::string, uint64_t> lines;
+		for (auto& stack : m_stacks)
+		{
+			ProfileSample sample = {};
+			memcpy(&sample, stack.first.data(), stack.first.size());
+
+			std::string line = Name(0x200);
+			for (WORD i = 0; i < sample.depth; i++)
+			{
+				WORD site = sample.calls[i];
+				WORD op = (code.Peek(site) << 8) | code.Peek(site + 1);
+				line += ';' + Name(((op & 0xF000) == 0x2000) ? (op & 0x0FFF) : site);
+			}
+			line += ';' + Name(sample.pc);
+
+			lines[line] += stack.second;
+		}
+
+		for (auto& line : lines)
+			stream << line.first << ' ' << line.second << '\n';
+		stream.flush();
+	}
+
+	uint64_t Samples()
+	{
+		std::lock_guard<std::mutex> lg(m_mux);
+		return m_nSamples;
+	}
+
+private:
+	//////////////////////////////////////////////
+	/// \brief Copies what was published last into
+	///        a sample
+	///
+	/// \param sequence Gets the sequence of the
+	///                 sample
+	/// \return False if the slot was being written
+	///         on every retry
+	//////////////////////////////////////////////
+	static bool Read(const ProfileSlot& slot, ProfileSample& sample, uint32_t& sequence)
+	{
+		for (unsigned retry = 0; retry < PROFILE_RETRIES; retry++)
+		{
+			sequence = slot.sequence.load(std::memory_order_acquire);
+			if (sequence & 1)
+				continue;
+
+			sample.pc = slot.pc.load(std::memory_order_relaxed);
+			sample.depth = std::min<WORD>(slot.depth.load(std::memory_order_relaxed), 16);
+			for (WORD i = 0; i < sample.depth; i++)
+				sample.calls[i] = slot.calls[i].load(std::memory_order_relaxed);
+
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (slot.sequence.load(std::memory_order_relaxed) == sequence)
+				return true;
+		}
+		return false;
+	}
+
+	void TimerThread()
+	{
+		std::unique_lock<std::mutex> ul(m_mux);
+		auto next = std::chrono::steady_clock::now();
+		std::string key;
+
+		for (;;)
+		{
+			// Late ticks are skipped, not made up for
+			next = std::max(next + m_interval, std::chrono::steady_clock::now());
+			if (m_cv.wait_until(ul, next, [this] { return m_bStop; }))
+				break;
+
+			for (auto& thread : m_threads)
+			{
+				// Nothing new until the request of the last count is served.
+				// A slot being written is read on a later tick
+				ProfileSlot& slot = thread->slot;
+				if (!thread->attached.load(std::memory_order_relaxed) || slot.sequence.load(std::memory_order_relaxed) == thread->counted)
+					continue;
+
+				ProfileSample sample;
+				uint32_t sequence;
+				if (!Read(slot, sample, sequence))
+					continue;
+
+				key.assign((const char*)&sample, offsetof(ProfileSample, calls) + sample.depth * sizeof(WORD));
+				m_stacks[key]++;
+				m_nSamples++;
+
+				thread->counted = sequence;
+				slot.wanted.store(true, std::memory_order_relaxed);
+			}
+		}
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Names an address after the closest
+	///        label at or below it
+	///
+	//////////////////////////////////////////////
+	std::string Name(WORD addr) const
+	{
+		char s[32];
+		auto label = m_labels.upper_bound(addr);
+		if (label == m_labels.begin())
+		{
+			snprintf(s, sizeof(s), "0x%03X", addr);
+			return s;
+		}
+
+		--label;
+		if (label->first == addr)
+			return label->second;
+
+		snprintf(s, sizeof(s), "+0x%X", addr - label->first);
+		return label->second + s;
+	}
+
+	inline static thread_local ProfiledThread* t_thread = nullptr;
+	inline static thread_local GuestProfiler* t_owner = nullptr;
+
+	std::chrono::microseconds m_interval;
+	std::vector<std::unique_ptr<ProfiledThread>> m_threads;
+	std::unordered_map<std::string, uint64_t> m_stacks;		// Raw samples and how often they were taken
+	uint64_t m_nSamples = 0;
+	std::map<WORD, std::string> m_labels;
+
+	std::thread m_thread;
+	std::mutex m_mux;
+	std::condition_variable m_cv;
+	bool m_bStop = false;
+};
+
+
+
+////////////////////////////////////////////////////////////////
+// FRAME PACING
+//
+// Sleeping alone overshoots by up to the OS timer granularity
+// (1 - 15ms on Windows), spinning alone burns a core. The pacer
+// sleeps until PACING_SPIN before the deadline and yields for
+// the rest, measuring how late every frame actually was.
+//
+/////////////////////////////////////////////////////////////////
+
+const constexpr std::chrono::microseconds PACING_SPIN(2000);
+
+
+class FramePacer
+{
+public:
+	FramePacer(unsigned hz = FRAME_RATE) :
+		m_period(std::chrono::nanoseconds(1000000000 / hz)),
+		m_error(0.01, 1000)	// 10us buckets up to 10ms
+	{
+		Reset();
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Starts the next frame a period from now
+	///
+	//////////////////////////////////////////////
+	void Reset()
+	{
+		m_last = std::chrono::steady_clock::now();
+		m_deadline = m_last + m_period;
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Blocks until the current frame's
+	///        deadline
+	///
+	/// \return Seconds since the previous Wait
+	///         returned
+	//////////////////////////////////////////////
+	float Wait()
+	{
+		auto now = std::chrono::steady_clock::now();
+		auto start = now;
+
+		if (m_deadline - now > PACING_SPIN)
+			std::this_thread::sleep_until(m_deadline - PACING_SPIN);
+
+		while ((now = std::chrono::steady_clock::now()) < m_deadline)
+			std::this_thread::yield();
+
+		m_error.Add(std::chrono::duration<double, std::milli>(now - m_deadline).count());
+		metrics.AddWait(std::chrono::duration<double, std::milli>(now - start).count());
+
+		// A frame that overran its deadline by whole periods skips them
+		// instead of rushing the following frames to catch up
+		m_deadline += m_period;
+		while (m_deadline <= now)
+		{
+			m_deadline += m_period;
+			m_nMissed++;
+			metrics.ticksMissed.Add();
+		}
+
+		std::chrono::duration<float> elapsed = now - m_last;
+		m_last = now;
+		return elapsed.count();
+	}
+
+	//////////////////////////////////////////////
+	/// \brief How late frames were, in milliseconds
+	///
+	//////////////////////////////////////////////
+	const Histogram& Error() const { return m_error; }
+
+	uint64_t Missed() const { return m_nMissed; }
+
+	//////////////////////////////////////////////
+	/// \brief Prints the lateness percentiles
+	///
+	//////////////////////////////////////////////
+	void Report(std::ostream& stream) const
+	{
+		stream << "Frame pacing over " << m_error.Count() << " frames: "
+			<< "p50 " << m_error.Percentile(50) << "ms, "
+			<< "p99 " << m_error.Percentile(99) << "ms, "
+			<< "max " << m_error.Max() << "ms, "
+			<< m_nMissed << " missed" << std::endl;
+	}
+
+private:
+	std::chrono::steady_clock::duration m_period;
+	std::chrono::steady_clock::time_point m_deadline;
+	std::chrono::steady_clock::time_point m_last;
+
+	Histogram m_error;
+	uint64_t m_nMissed = 0;
+};
+
+
+
+////////////////////////////////////////////////////////////////
+// UPSCALING
+//
+// Expands the display to RGBA at an integer scale. Every display
+// row becomes one output row, the other scale - 1 rows are plain
+// copies of it. The row kernels only differ in how wide they store
+// a pixel's colour, the widest one the CPU has is picked at
+// runtime. Rows are handed to the kernels as 64 bit masks, the
+// most significant bit is the leftmost pixel
+//
+/////////////////////////////////////////////////////////////////
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define UPSCALE_SIMD
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+#endif
+
+static_assert(WIDTH == 64, "Display rows are passed around as 64 bit masks");
+
+typedef void (*ExpandRowFn)(uint64_t bits, const uint32_t* palette, unsigned scale, uint32_t* out);
+
+
+//////////////////////////////////////////////
+/// \brief Returns the RGBA value of a console
+///        colour, R in the lowest address
+///
+//////////////////////////////////////////////
+inline uint32_t ConsoleRGBA(COLOUR colour)
+{
+	static const BYTE rgb[16][3] =
+	{
+		{ 0, 0, 0 }, { 0, 0, 128 }, { 0, 128, 0 }, { 0, 128, 128 },
+		{ 128, 0, 0 }, { 128, 0, 128 }, { 128, 128, 0 }, { 192, 192, 192 },
+		{ 128, 128, 128 }, { 0, 0, 255 }, { 0, 255, 0 }, { 0, 255, 255 },
+		{ 255, 0, 0 }, { 255, 0, 255 }, { 255, 255, 0 }, { 255, 255, 255 },
+	};
+
+	// Foreground and background attributes name the same colours
+	const BYTE* c = rgb[(colour | (colour >> 4)) & 0xF];
+	BYTE bytes[4] = { c[0], c[1], c[2], 0xFF };
+
+	uint32_t rgba;
+	std::memcpy(&rgba, bytes, sizeof(rgba));
+	return rgba;
+}
+
+
+inline void ExpandRowScalar(uint64_t bits, const uint32_t* palette, unsigned scale, uint32_t* out)
+{
+	for (unsigned x = 0; x < WIDTH; x++, out += scale)
+		std::fill(out, out + scale, palette[(bits >> (WIDTH - 1 - x)) & 1]);
+}
+
+
+#ifdef UPSCALE_SIMD
+inline void ExpandRowSse2(uint64_t bits, const uint32_t* palette, unsigned scale, uint32_t* out)
+{
+	const __m128i colours[2] = { _mm_set1_epi32((int)palette[0]), _mm_set1_epi32((int)palette[1]) };
+	const unsigned row = WIDTH * scale;
+
+	for (unsigned x = 0; x < WIDTH; x++)
+	{
+		const unsigned bit = (bits >> (WIDTH - 1 - x)) & 1;
+		uint32_t* p = out + x * scale;
+
+		if (scale >= 4)
+		{
+			// The last store overlaps the one before it instead of
+			// running past the pixel
+			for (unsigned i = 0; i + 4 < scale; i += 4)
+				_mm_storeu_si128((__m128i*)(p + i), colours[bit]);
+			_mm_storeu_si128((__m128i*)(p + scale - 4), colours[bit]);
+		}
+		else if (x * scale + 4 <= row)
+			_mm_storeu_si128((__m128i*)p, colours[bit]);	// The next pixels overwrite the spill
+		else
+			std::fill(p, p + scale, palette[bit]);
+	}
+}
+
+
+TARGET_AVX2 inline void ExpandRowAvx2(uint64_t bits, const uint32_t* palette, unsigned scale, uint32_t* out)
+{
+	if (scale < 8)
+	{
+		ExpandRowSse2(bits, palette, scale, out);
+		return;
+	}
+
+	const __m256i colours[2] = { _mm256_set1_epi32((int)palette[0]), _mm256_set1_epi32((int)palette[1]) };
+
+	for (unsigned x = 0; x < WIDTH; x++)
+	{
+		const unsigned bit = (bits >> (WIDTH - 1 - x)) & 1;
+		uint32_t* p = out + x * scale;
+
+		for (unsigned i = 0; i + 8 < scale; i += 8)
+			_mm256_storeu_si256((__m256i*)(p + i), colours[bit]);
+		_mm256_storeu_si256((__m256i*)(p + scale - 8), colours[bit]);
+	}
+}
+
+
+inline bool HasAvx2()
+{
+#if defined(__GNUC__) || defined(__clang__)
+	return __builtin_cpu_supports("avx2");
+#else
+	int info[4];
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	if (!osxsave || (_xgetbv(0) & 0x6) != 0x6)	// OS saves the YMM registers
+		return false;
+
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#endif
+}
+#endif
+
+
+class Upscaler
+{
+public:
+	//////////////////////////////////////////////
+	/// \param scale Output pixels per display pixel
+	///              in each direction
+	/// \param off   Colour of unlit pixels
+	/// \param on    Colour of lit pixels
+	//////////////////////////////////////////////
+	Upscaler(unsigned scale = SCALE, COLOUR off = FG_BLACK, COLOUR on = FG_WHITE) :
+		m_nScale(scale ? scale : 1),
+		m_palette{ ConsoleRGBA(off), ConsoleRGBA(on) },
+		m_expand(Select())
+	{
+	}
+
+	unsigned Width() const { return WIDTH * m_nScale; }
+	unsigned Height() const { return HEIGHT * m_nScale; }
+
+	//////////////////////////////////////////////
+	/// \brief Name of the row kernel in use
+	///
+	//////////////////////////////////////////////
+	const char* Kernel() const
+	{
+#ifdef UPSCALE_SIMD
+		if (m_expand == ExpandRowAvx2)
+			return "avx2";
+		if (m_expand == ExpandRowSse2)
+			return "sse2";
+#endif
+		return "scalar";
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Upscales a display packed like
+	///        Chip8::GetPackedDisplay
+	///
+	/// \param packed PACKED_SIZE bytes
+	/// \param rgba   Height() rows of output
+	/// \param pitch  Pixels from one output row to
+	///               the next, 0 for Width()
+	//////////////////////////////////////////////
+	void FromPacked(const BYTE* packed, uint32_t* rgba, size_t pitch = 0) const
+	{
+		for (unsigned y = 0; y < HEIGHT; y++)
+		{
+			uint64_t bits = 0;
+			for (unsigned b = 0; b < WIDTH / 8; b++)
+				bits = (bits << 8) | packed[y * (WIDTH / 8) + b];
+
+			Row(bits, y, rgba, pitch);
+		}
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Upscales a display with a byte per
+	///        pixel, as Chip8::getDisplay returns it
+	///
+	//////////////////////////////////////////////
+	void FromDisplay(const BYTE* gfx, uint32_t* rgba, size_t pitch = 0) const
+	{
+		for (unsigned y = 0; y < HEIGHT; y++)
+		{
+			uint64_t bits = 0;
+			for (unsigned x = 0; x < WIDTH; x++)
+				bits = (bits << 1) | (gfx[y * WIDTH + x] != 0);
+
+			Row(bits, y, rgba, pitch);
+		}
+	}
+
+private:
+	void Row(uint64_t bits, unsigned y, uint32_t* rgba, size_t pitch) const
+	{
+		if (pitch == 0)
+			pitch = Width();
+
+		uint32_t* first = rgba + y * m_nScale * pitch;
+		m_expand(bits, m_palette, m_nScale, first);
+
+		for (unsigned i = 1; i < m_nScale; i++)
+			std::memcpy(first + i * pitch, first, Width() * sizeof(uint32_t));
+	}
+
+	static ExpandRowFn Select()
+	{
+#ifdef UPSCALE_SIMD
+		static const ExpandRowFn best = HasAvx2() ? ExpandRowAvx2 : ExpandRowSse2;	// SSE2 is part of x86-64
+		return best;
+#else
+		return ExpandRowScalar;
+#endif
+	}
+
+	unsigned m_nScale;
+	uint32_t m_palette[2];
+	ExpandRowFn m_expand;
+};
+
+
+const constexpr size_t SIXEL_CACHE_SIZE = 4096;	// Bands kept before the cache starts over
+
+
+//////////////////////////////////////////////
+/// \brief Encodes the upscaled display as a
+///        sixel image
+///
+/// A sixel band is 6 output rows, so it covers
+/// one or two display rows. Its encoding only
+/// depends on those rows, so it is kept per
+/// band, and in a cache keyed by the rows for
+/// every band that ever looked the same. Only
+/// bands over changed rows are looked up, and
+/// only bands never seen before are encoded.
+///
+/// Given the height of a terminal cell, only the
+/// bands from the cell row above the first change
+/// to the last change are sent, as an image of
+/// their own placed at that cell row.
+///
+//////////////////////////////////////////////
+class SixelEncoder
+{
+public:
+	SixelEncoder(unsigned scale = SCALE, COLOUR off = FG_BLACK, COLOUR on = FG_WHITE) :
+		m_nScale(scale ? scale : 1),
+		m_bands((HEIGHT * m_nScale + 5) / 6)
+	{
+		char header[128];
+		COLOUR colours[2] = { off, on };
+		for (int c = 0; c < 2; c++)
+		{
+			BYTE rgb[4];
+			uint32_t rgba = ConsoleRGBA(colours[c]);
+			std::memcpy(rgb, &rgba, sizeof(rgb));
+
+			snprintf(header, sizeof(header), "#%d;2;%d;%d;%d", c, rgb[0] * 100 / 255, rgb[1] * 100 / 255, rgb[2] * 100 / 255);
+			m_sPalette += header;
+		}
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Encodes a frame
+	///
+	/// \param gfx        The whole display, a byte
+	///                   per pixel
+	/// \param first      First display row that
+	///                   changed since the last call
+	/// \param last       Last display row that changed
+	/// \param cellHeight Pixels per terminal row, 0
+	///                   if unknown to send the whole
+	///                   image every time
+	/// \return The escape sequences that move the
+	///         cursor and draw the frame, with the
+	///         image at the top left of the screen
+	//////////////////////////////////////////////
+	const std::string& Encode(const BYTE* gfx, unsigned first, unsigned last, unsigned cellHeight = 0)
+	{
+		const unsigned bands = (unsigned)m_bands.size();
+
+		// Bands over changed rows, and bands never sent
+		unsigned firstBand = bands, lastBand = 0;
+		for (unsigned band = 0; band < bands; band++)
+		{
+			unsigned top = band * 6 / m_nScale;
+			unsigned bottom = std::min(band * 6 + 5, HEIGHT * m_nScale - 1) / m_nScale;
+
+			if (!m_bands[band] || (bottom >= first && top <= last))
+			{
+				m_bands[band] = Band(gfx, band);
+				firstBand = std::min(firstBand, band);
+				lastBand = band;
+			}
+		}
+
+		// The image can only start at a cell row, and its bands have to
+		// be the cached ones, so it starts where both line up
+		unsigned startBand = 0;
+		if (cellHeight == 0 || firstBand == bands)
+			lastBand = bands - 1;
+		else
+			startBand = firstBand - firstBand % (cellHeight / Gcd(6, cellHeight));
+
+		unsigned top = startBand * 6;
+		unsigned height = std::min((lastBand + 1) * 6, HEIGHT * m_nScale) - top;
+
+		char header[64];
+		snprintf(header, sizeof(header), "\033[%u;1H\033P0;1;0q\"1;1;%u;%u",
+			(cellHeight ? top / cellHeight : 0) + 1, WIDTH * m_nScale, height);
+
+		m_sOut = header;
+		m_sOut += m_sPalette;
+		for (unsigned band = startBand; band <= lastBand; band++)
+			m_sOut += *m_bands[band];
+
+		m_sOut += "\033\\";
+		return m_sOut;
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Number of different bands encoded
+	///        since the cache was last emptied
+	///
+	//////////////////////////////////////////////
+	size_t Cached() const { return m_cache.size(); }
+
+private:
+	//////////////////////////////////////////////
+	/// \brief Returns the encoding of a band from
+	///        the cache, encoding it if it is new
+	///
+	//////////////////////////////////////////////
+	std::shared_ptr<const std::string> Band(const BYTE* gfx, unsigned band)
+	{
+		// The display row of every output row in the band, 0 below the image
+		uint64_t rows[6] = {};
+		unsigned height = std::min(6u, HEIGHT * m_nScale - band * 6);
+
+		for (unsigned i = 0; i < height; i++)
+		{
+			const BYTE* pixels = gfx + ((band * 6 + i) / m_nScale) * WIDTH;
+			for (unsigned x = 0; x < WIDTH; x++)
+				rows[i] = (rows[i] << 1) | (pixels[x] != 0);
+		}
+
+		std::string key((const char*)rows, sizeof(rows));
+		key += (char)height;
+
+		auto found = m_cache.find(key);
+		if (found != m_cache.end())
+			return found->second;
+
+		if (m_cache.size() >= SIXEL_CACHE_SIZE)
+			m_cache.clear();
+
+		// Every column is a sixel per colour, bit i is output row i
+		std::string out;
+		for (int c = 0; c < 2; c++)
+		{
+			BYTE sixels[WIDTH];
+			BYTE any = 0;
+			for (unsigned x = 0; x < WIDTH; x++)
+			{
+				BYTE on = 0;
+				for (unsigned i = 0; i < height; i++)
+					on |= ((rows[i] >> (WIDTH - 1 - x)) & 1) << i;
+
+				sixels[x] = c ? on : (~on & ((1 << height) - 1));
+				any |= sixels[x];
+			}
+
+			if (!any)
+				continue;
+
+			if (!out.empty())
+				out += '$';
+			out += '#';
+			out += (char)('0' + c);
+
+			// Run length encoded, blank runs at the end are left out
+			unsigned end = WIDTH;
+			while (sixels[end - 1] == 0)
+				end--;
+
+			for (unsigned x = 0; x < end; )
+			{
+				unsigned run = 1;
+				while (x + run < end && sixels[x + run] == sixels[x])
+					run++;
+
+				char sixel = (char)('?' + sixels[x]);
+				unsigned pixels = run * m_nScale;
+				if (pixels > 3)
+					out += '!' + std::to_string(pixels) + sixel;
+				else
+					out.append(pixels, sixel);
+
+				x += run;
+			}
+		}
+
+		out += '-';
+
+		std::shared_ptr<const std::string> encoded = std::make_shared<const std::string>(std::move(out));
+		m_cache.emplace(std::move(key), encoded);
+		return encoded;
+	}
+
+	static unsigned Gcd(unsigned a, unsigned b)
+	{
+		return b ? Gcd(b, a % b) : a;
+	}
+
+	unsigned m_nScale;
+	std::string m_sPalette;
+	std::string m_sOut;
+
+	std::vector<std::shared_ptr<const std::string>> m_bands;	// What every band showed last frame
+	std::unordered_map<std::string, std::shared_ptr<const std::string>> m_cache;
+};
+
+
+
+////////////////////////////////////////////////////////////////
+// BACKENDS
+//
+// A backend shows whole frames and reports keys. Screen is a
+// template over its backend, so every call into it is resolved
+// at compile time and nothing is virtual, per pixel or per frame.
+//
+// A backend derives from Backend<Self>, provides
+//   void PresentRows(const BYTE* gfx, unsigned first, unsigned last)
+//       gfx is the whole display, rows first - last changed
+// and hides whichever of the defaults in Backend it needs to.
+//
+/////////////////////////////////////////////////////////////////
+
+const constexpr unsigned KEY_HOLD_FRAMES = 6;	// Terminals only report presses
+
+
+template <typename TBackend>
+class Backend
+{
+public:
+	//////////////////////////////////////////////
+	/// \brief Whether the user still wants to run
+	///
+	//////////////////////////////////////////////
+	bool Active() { return true; }
+
+	//////////////////////////////////////////////
+	/// \brief Copies the keyboard into the machine
+	///
+	//////////////////////////////////////////////
+	void PollKeys(Chip8&) {}
+
+	void SetTitle(const std::string&) {}
+
+	//////////////////////////////////////////////
+	/// \brief Returns where the sound goes, nullptr
+	///        for no sound
+	///
+	//////////////////////////////////////////////
+	std::unique_ptr<AudioSink> CreateAudioSink() { return nullptr; }
+
+	//////////////////////////////////////////////
+	/// \brief Called after the last frame
+	///
+	//////////////////////////////////////////////
+	void Destroy() {}
+
+	//////////////////////////////////////////////
+	/// \brief Shows a frame
+	///
+	/// Rows are hashed and compared with the rows
+	/// last shown. A sprite erased and drawn again
+	/// dirties its rows without changing them, a
+	/// frame where no row changed is not shown
+	///
+	/// \param gfx   The whole display
+	/// \param first First row that changed
+	/// \param last  Last row that changed
+	//////////////////////////////////////////////
+	void Present(const BYTE* gfx, unsigned first, unsigned last)
+	{
+		unsigned changedFirst = HEIGHT, changedLast = 0;
+		for (unsigned y = first; y <= last; y++)
+		{
+			uint64_t hash = Chip8::HashBytes(0, gfx + y * WIDTH, WIDTH);
+			if ((m_shownRows & (1u << y)) && m_rowHashes[y] == hash)
+				continue;
+
+			m_rowHashes[y] = hash;
+			m_shownRows |= 1u << y;
+			changedFirst = std::min(changedFirst, y);
+			changedLast = y;
+		}
+
+		if (changedFirst == HEIGHT)
+		{
+			metrics.framesUnchanged.Add();
+			return;
+		}
+
+		ScopedTimer timer(metrics.presentTime);
+		Self().PresentRows(gfx, changedFirst, changedLast);
+		metrics.frames.Add();
+	}
+
+protected:
+	TBackend& Self() { return static_cast<TBackend&>(*this); }
+
+private:
+	uint64_t m_rowHashes[HEIGHT];	// Of the rows last shown
+	uint32_t m_shownRows = 0;		// Bit y is set once row y was shown
+};
+
+
+//////////////////////////////////////////////
+/// \brief Shows nothing, for headless runs
+///
+//////////////////////////////////////////////
+class NullBackend : public Backend<NullBackend>
+{
+public:
+	//////////////////////////////////////////////
+	/// \param wavPath Where the sound is written,
+	///                empty to throw it away
+	//////////////////////////////////////////////
+	NullBackend(const std::string& wavPath = std::string()) : m_sWavPath(wavPath) {}
+
+	void PresentRows(const BYTE*, unsigned, unsigned) {}
+
+	std::unique_ptr<AudioSink> CreateAudioSink()
+	{
+		if (!m_sWavPath.empty())
+			return std::unique_ptr<AudioSink>(new WavSink(m_sWavPath));
+
+		return std::unique_ptr<AudioSink>(new NullSink());
+	}
+
+private:
+	std::string m_sWavPath;
+};
+
+
+#ifdef _WIN32
+//////////////////////////////////////////////
+/// \brief Draws to the Windows console
+///
+//////////////////////////////////////////////
+class ConsoleBackend : public Backend<ConsoleBackend>
+{
+public:
+	ConsoleBackend()
+	{
+		m_nScreenWidth = 80;
+		m_nScreenHeight = 30;
+
+		m_hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
+		m_hConsoleIn = GetStdHandle(STD_INPUT_HANDLE);
+		m_hOriginalConsole = m_hConsole;
+
+		m_sAppName = L"CHIP-8";
+	}
+
+	int ConstructConsole(int width, int height, int fontw, int fonth)
+	{
+		if (m_hConsole == INVALID_HANDLE_VALUE)
+			return Error(L"Bad Handle");
+
+		m_nScreenWidth = width;
+		m_nScreenHeight = height;
+
+		m_rectWindow = { 0, 0, 1, 1 };
+		SetConsoleWindowInfo(m_hConsole, TRUE, &m_rectWindow);
+
+		// Set the size of the screen buffer
+		COORD coord = { (short)m_nScreenWidth, (short)m_nScreenHeight };
+		if (!SetConsoleScreenBufferSize(m_hConsole, coord))
+			Error(L"SetConsoleScreenBufferSize");
+
+		// Assign screen buffer to the console
+		if (!SetConsoleActiveScreenBuffer(m_hConsole))
+			return Error(L"SetConsoleActiveScreenBuffer");
+
+		// Set the font size now that the screen buffer has been assigned to the console
+		CONSOLE_FONT_INFOEX cfi;
+		cfi.cbSize = sizeof(cfi);
+		cfi.nFont = 0;
+		cfi.dwFontSize.X = fontw;
+		cfi.dwFontSize.Y = fonth;
+		cfi.FontFamily = FF_DONTCARE;
+		cfi.FontWeight = FW_NORMAL;
+
+		wcscpy_s(cfi.FaceName, L"Consolas");
+		if (!SetCurrentConsoleFontEx(m_hConsole, false, &cfi))
+			return Error(L"SetCurrentConsoleFontEx");
+
+		// Get screen buffer info and check the maximum allowed window size. Return
+		// error if exceeded, so user knows their dimensions/fontsize are too large
+		CONSOLE_SCREEN_BUFFER_INFO csbi;
+		if (!GetConsoleScreenBufferInfo(m_hConsole, &csbi))
+			return Error(L"GetConsoleScreenBufferInfo");
+		if (m_nScreenHeight > csbi.dwMaximumWindowSize.Y)
+			return Error(L"Screen Height / Font Height Too Big");
+		if (m_nScreenWidth > csbi.dwMaximumWindowSize.X)
+			return Error(L"Screen Width / Font Width Too Big");
+
+		// Set Physical Console Window Size
+		m_rectWindow = { 0, 0, (short)(m_nScreenWidth - 1), (short)(m_nScreenHeight - 1) };
+		if (!SetConsoleWindowInfo(m_hConsole, TRUE, &m_rectWindow))
+			return Error(L"SetConsoleWindowInfo");
+
+		// Set flags to allow mouse input		
+		if (!SetConsoleMode(m_hConsoleIn, ENABLE_EXTENDED_FLAGS | ENABLE_WINDOW_INPUT | ENABLE_MOUSE_INPUT))
+			return Error(L"SetConsoleMode");
+
+		// Allocate memory for screen buffer
+		m_bufScreen = new CHAR_INFO[m_nScreenWidth*m_nScreenHeight];
+		memset(m_bufScreen, 0, sizeof(CHAR_INFO) * m_nScreenWidth * m_nScreenHeight);
+
+		// Sleep() is only accurate to the system timer resolution
+		timeBeginPeriod(1);
+
+		m_bAtomActive = true;
+		SetConsoleCtrlHandler((PHANDLER_ROUTINE)CloseHandler, TRUE);
+		return 1;
+	}
+
+	~ConsoleBackend()
+	{
+		SetConsoleActiveScreenBuffer(m_hOriginalConsole);
+		delete[] m_bufScreen;
+	}
+
+	bool Active()
+	{
+		return m_bAtomActive;
+	}
+
+	void PollKeys(Chip8& machine)
+	{
+		for (auto& k : keymap)
+			machine.SetKey(k.first, GetKeyState(k.second) & 0x8000);
+	}
+
+	void SetTitle(const std::string& title)
+	{
+		std::wstring s = L"OneLoneCoder.com - Console Game Engine - " + m_sAppName + L" - " + std::wstring(title.begin(), title.end());
+		SetConsoleTitle(s.c_str());
+	}
+
+	std::unique_ptr<AudioSink> CreateAudioSink()
+	{
+		return std::unique_ptr<AudioSink>(new WaveOutSink());
+	}
+
+	void PresentRows(const BYTE* gfx, unsigned first, unsigned last)
+	{
+		int width = std::min<int>(WIDTH, m_nScreenWidth);
+		int bottom = std::min<int>(last, m_nScreenHeight - 1);
+
+		for (int y = first; y <= bottom; y++)
+		{
+			for (int x = 0; x < width; x++)
+			{
+				CHAR_INFO& cell = m_bufScreen[y * m_nScreenWidth + x];
+				cell.Char.UnicodeChar = PIXEL_SOLID;
+				cell.Attributes = (gfx[y * WIDTH + x] == 0x00) ? FG_BLACK : FG_WHITE;
+			}
+		}
+
+		// Only the rows that changed go to the console
+		SMALL_RECT region = { 0, (short)first, (short)(m_nScreenWidth - 1), (short)bottom };
+		WriteConsoleOutput(m_hConsole, m_bufScreen, { (short)m_nScreenWidth, (short)m_nScreenHeight }, { 0, (short)first }, &region);
+	}
+
+	void Destroy()
+	{
+		timeEndPeriod(1);
+		SetConsoleActiveScreenBuffer(m_hOriginalConsole);
+		m_cvGameFinished.notify_one();
+	}
+
+protected:
+	int Error(const wchar_t *msg)
+	{
+		wchar_t buf[256];
+		FormatMessage(FORMAT_MESSAGE_FROM_SYSTEM, NULL, GetLastError(), MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), buf, 256, NULL);
+		SetConsoleActiveScreenBuffer(m_hOriginalConsole);
+		wprintf(L"ERROR: %s\n\t%s\n", msg, buf);
+		return 0;
+	}
+
+	static BOOL CloseHandler(DWORD evt)
+	{
+		// Note this gets called in a seperate OS thread, so it must
+		// only exit when the game has finished cleaning up, or else
+		// the process will be killed before Destroy() has finished
+		if (evt == CTRL_CLOSE_EVENT)
+		{
+			m_bAtomActive = false;
+
+			// Wait for thread to be exited
+			std::unique_lock<std::mutex> ul(m_muxGame);
+			m_cvGameFinished.wait(ul);
+		}
+		return true;
+	}
+
+protected:
+	int m_nScreenWidth;
+	int m_nScreenHeight;
+	CHAR_INFO *m_bufScreen = nullptr;
+	std::wstring m_sAppName;
+	HANDLE m_hOriginalConsole;
+	HANDLE m_hConsole;
+	HANDLE m_hConsoleIn;
+	SMALL_RECT m_rectWindow;
+
+	// These need to be static because of the OnDestroy call the OS may make. The OS
+	// spawns a special thread just for that
+	static std::atomic<bool> m_bAtomActive;
+	static std::condition_variable m_cvGameFinished;
+	static std::mutex m_muxGame;
+};
+
+// Define our static variables
+std::atomic<bool> ConsoleBackend::m_bAtomActive(false);
+std::condition_variable ConsoleBackend::m_cvGameFinished;
+std::mutex ConsoleBackend::m_muxGame;
+#else
+//////////////////////////////////////////////
+/// \brief Draws to an ANSI terminal, two pixel
+///        rows per character
+///
+//////////////////////////////////////////////
+class TerminalBackend : public Backend<TerminalBackend>
+{
+public:
+	//////////////////////////////////////////////
+	/// \param sixelScale Draw sixel images at this
+	///                   scale instead of block
+	///                   characters, 0 for blocks
+	//////////////////////////////////////////////
+	TerminalBackend(unsigned sixelScale = 0)
+	{
+		if (sixelScale != 0)
+			m_sixel.reset(new SixelEncoder(sixelScale));
+
+		// No line buffering, no echo, reads never block
+		tcgetattr(STDIN_FILENO, &m_original);
+		termios raw = m_original;
+		raw.c_lflag &= ~(ICANON | ECHO);
+		raw.c_cc[VMIN] = 0;
+		raw.c_cc[VTIME] = 0;
+		tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+
+		m_bAtomInterrupted = false;
+		signal(SIGINT, Interrupt);
+		signal(SIGTERM, Interrupt);
+
+		// Alternate screen, hide cursor, clear
+		Write("\033[?1049h\033[?25l\033[2J");
+	}
+
+	~TerminalBackend()
+	{
+		Destroy();
+	}
+
+	bool Active()
+	{
+		return !m_bAtomInterrupted;
+	}
+
+	//////////////////////////////////////////////
+	/// \brief A terminal only sends key presses, so
+	///        a key counts as held for a few frames
+	///        after each press (or auto repeat)
+	///
+	//////////////////////////////////////////////
+	void PollKeys(Chip8& machine)
+	{
+		char buf[64];
+		ssize_t got;
+		while ((got = read(STDIN_FILENO, buf, sizeof(buf))) > 0)
+		{
+			for (ssize_t i = 0; i < got; i++)
+			{
+				int c = toupper((unsigned char)buf[i]);
+				for (auto& k : keymap)
+					if (k.second == c)
+						m_held[k.first] = KEY_HOLD_FRAMES;
+			}
+		}
+
+		for (BYTE k = 0; k < 16; k++)
+		{
+			machine.SetKey(k, m_held[k] != 0);
+			if (m_held[k] != 0)
+				m_held[k]--;
+		}
+	}
+
+	void SetTitle(const std::string& title)
+	{
+		Write("\033]0;CHIP-8 - " + title + "\007");
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Gives the terminal back as it was
+	///
+	//////////////////////////////////////////////
+	void Destroy()
+	{
+		if (m_bRestored)
+			return;
+
+		Write("\033[0m\033[?25h\033[?1049l");
+		tcsetattr(STDIN_FILENO, TCSANOW, &m_original);
+		m_bRestored = true;
+	}
+
+	void PresentRows(const BYTE* gfx, unsigned first, unsigned last)
+	{
+		if (m_sixel)
+		{
+			// Asked every frame, a resize or font change alters it
+			winsize size = {};
+			unsigned cellHeight = 0;
+			if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_row != 0 && size.ws_ypixel % size.ws_row == 0)
+				cellHeight = size.ws_ypixel / size.ws_row;
+
+			Write(m_sixel->Encode(gfx, first, last, cellHeight));
+			return;
+		}
+
+		std::string out;
+
+		// Upper half block, the top pixel is the foreground colour
+		// and the bottom pixel the background colour
+		for (unsigned row = first / 2; row <= last / 2; row++)
+		{
+			out += "\033[" + std::to_string(row + 1) + ";1H";
+
+			int colours = -1;
+			for (unsigned x = 0; x < WIDTH; x++)
+			{
+				int top = gfx[(row * 2) * WIDTH + x] != 0;
+				int bottom = gfx[(row * 2 + 1) * WIDTH + x] != 0;
+
+				if ((top | (bottom << 1)) != colours)
+				{
+					colours = top | (bottom << 1);
+					out += top ? "\033[97;" : "\033[30;";
+					out += bottom ? "107m" : "40m";
+				}
+				out += "\xE2\x96\x80";
+			}
+		}
+
+		out += "\033[0m";
+		Write(out);
+	}
+
+private:
+	void Write(const std::string& s)
+	{
+		size_t done = 0;
+		while (done < s.size())
+		{
+			ssize_t written = write(STDOUT_FILENO, s.data() + done, s.size() - done);
+			if (written <= 0)
+				break;
+			done += written;
+		}
+	}
+
+	static void Interrupt(int)
+	{
+		m_bAtomInterrupted = true;
+	}
+
+	termios m_original;
+	bool m_bRestored = false;
+	BYTE m_held[16] = {};
+	std::unique_ptr<SixelEncoder> m_sixel;
+
+	static std::atomic<bool> m_bAtomInterrupted;
+};
+
+std::atomic<bool> TerminalBackend::m_bAtomInterrupted(false);
+#endif
+
+
+
+//////////////////////////////////////////////
+/// \brief Runs the machine and hands its frames
+///        to a backend
+///
+//////////////////////////////////////////////
+template <typename TBackend>
+class Screen
+{
+public:
+	Screen(TBackend& backend) : m_backend(backend) {}
+
+	//////////////////////////////////////////////
+	/// \brief Runs the game on its own thread until
+	///        the backend quits
+	///
+	/// \param frames Stop after this many frames,
+	///               0 to run until the backend quits
+	//////////////////////////////////////////////
+	void Start(uint64_t frames = 0)
+	{
+		m_nFrameLimit = frames;
+
+		std::thread t = std::thread(&Screen::GameThread, this);
+		t.join();
+	}
+
+	const FramePacer& Pacer() const
+	{
+		return m_pacer;
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Records every frame from now on
+	///
+	/// \param recorder The recorder, nullptr to stop
+	//////////////////////////////////////////////
+	void Record(MovieRecorder* recorder)
+	{
+		m_recorder = recorder;
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Samples the machine while the game
+	///        thread runs it
+	///
+	/// \param profiler The profiler, has to be set
+	///                 before Start
+	//////////////////////////////////////////////
+	void Profile(GuestProfiler* profiler)
+	{
+		m_profiler = profiler;
+	}
+
+private:
+	void GameThread()
+	{
+		OnUserCreate();
+		m_pacer.Reset();
+
+		if (m_profiler)
+			m_profiler->Attach();
+
+		// One iteration per frame, presented at FRAME_RATE
+		for (uint64_t frame = 0; m_backend.Active() && (m_nFrameLimit == 0 || frame < m_nFrameLimit); frame++)
+		{
+			{
+				ScopedTimer timer(metrics.renderTime);
+				OnUserUpdate();
+			}
+
+			m_pacer.Wait();
+
+			if (chip8.dirtyRows != 0)
+			{
+				unsigned first = 0, last = HEIGHT - 1;
+				while (!(chip8.dirtyRows & (1u << first)))
+					first++;
+				while (!(chip8.dirtyRows & (1u << last)))
+					last--;
+
+				m_backend.Present(chip8.getDisplay(), first, last);
+
+				chip8.dirtyRows = 0;
+				chip8.drawFlag = false;
+			}
+
+			UpdateTitle();
+		}
+
+		if (m_profiler)
+			m_profiler->Detach();
+
+		// Close and Clean up audio system
+		m_beeper.reset();
+		m_audioSink.reset();
+
+		m_backend.Destroy();
+	}
+
+	void OnUserCreate()
+	{
+		chip8.Initialize();
+		chip8.Seed(std::chrono::system_clock::now().time_since_epoch().count());
+#ifdef CHIP8_KIOSK
+		chip8.LoadBoot(KIOSK_BOOT);
+#else
+		chip8.LoadGame(FILENAME);
+#endif
+
+		m_audioSink = m_backend.CreateAudioSink();
+		if (m_audioSink)
+			m_beeper.reset(new Beeper(*m_audioSink));
+	}
+
+	void OnUserUpdate()
+	{
+		m_backend.PollKeys(chip8);
+		if (m_recorder)
+			m_recorder->BeginFrame(chip8);
+
+		// Called once per frame, so this is one timer tick
+		metrics.instructions.Add(chip8.Execute(CYCLES_PER_FRAME));
+
+		if (m_beeper)
+			m_beeper->Update(chip8.sound_timer);
+
+		chip8.UpdateTimers();
+
+		if (m_recorder)
+			m_recorder->EndFrame(chip8);
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Updates the title a few times a
+	///        second, and only if it changed
+	///
+	//////////////////////////////////////////////
+	void UpdateTitle()
+	{
+		auto now = std::chrono::steady_clock::now();
+		if (now - m_lastTitle < std::chrono::milliseconds(1000 / TITLE_RATE))
+			return;
+
+		MetricsSnapshot stats = metrics.Snapshot(m_titleSince);
+
+		char s[256];
+		snprintf(s, sizeof(s), "FPS: %3.2f - IPS: %.0f", stats.framesPerSecond, stats.instructionsPerSecond);
+		if (m_sTitle != s)
+		{
+			m_sTitle = s;
+			m_backend.SetTitle(m_sTitle);
+		}
+		m_lastTitle = now;
+	}
+
+	TBackend& m_backend;
+	FramePacer m_pacer;
+	uint64_t m_nFrameLimit = 0;
+
+	std::unique_ptr<AudioSink> m_audioSink;
+	std::unique_ptr<Beeper> m_beeper;
+	MovieRecorder* m_recorder = nullptr;
+	GuestProfiler* m_profiler = nullptr;
+
+	std::string m_sTitle;
+	std::chrono::steady_clock::time_point m_lastTitle;
+	SnapshotCursor m_titleSince;
+};
+
+
+
+////////////////////////////////////////////////////////////////
+// LATENCY MEASUREMENT
+//
+// Plays a ROM the way Screen does, on the real clock, and presses
+// a key at a random moment. A twin of the machine that never sees
+// the press runs alongside, one instruction at a time. The first
+// instruction after which the two differ is the one that read the
+// key (SKP, SKNP or LD_K). The first one after which their displays
+// differ is the draw it caused. Both are timed from the press, as
+// is the Present that showed the draw.
+//
+/////////////////////////////////////////////////////////////////
+
+const constexpr unsigned LATENCY_TIMEOUT = 30;		// Frames before a press counts as ignored
+const constexpr unsigned LATENCY_SETTLE = 4;		// Frames between a release and the next press
+
+
+struct LatencySettings
+{
+	const char* name;
+	unsigned cycles;		// Instructions per frame
+	bool presentFirst;		// Present right after the frame ran, not after its deadline
+};
+
+
+template <typename TBackend>
+class LatencyHarness
+{
+public:
+	LatencyHarness(TBackend& backend, const RomImage& rom, const LatencySettings& settings, uint64_t seed) :
+		m_backend(backend), m_settings(settings), m_random(seed),
+		m_observed(0.25, 2000), m_drawn(0.25, 2000), m_presented(0.25, 2000)	// Up to 500ms
+	{
+		m_machine.Initialize();
+		m_machine.Seed(seed);
+		m_machine.LoadGame(rom);
+		RunFrames(m_machine, DecodedEngine, {}, 0, 2 * FRAME_RATE);	// Past the title screen
+
+		// Only press keys the game reacts to. Held for a while, as
+		// games do not look at the keys on every frame
+		for (BYTE k = 0; k < 16; k++)
+		{
+			Chip8 pressed = m_machine.Fork();
+			Chip8 released = m_machine.Fork();
+			RunFrames(pressed, DecodedEngine, { (WORD)(1 << k) }, 0, FRAME_RATE / 2);
+			RunFrames(released, DecodedEngine, {}, 0, FRAME_RATE / 2);
+
+			if (pressed.Hash() != released.Hash())
+				m_keys.push_back(k);
+		}
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Presses keys until enough presses
+	///        were seen, in real time
+	///
+	/// \param samples Presses to make
+	//////////////////////////////////////////////
+	void Run(unsigned samples)
+	{
+		if (m_keys.empty())
+			return;
+
+		m_pacer.Reset();
+		for (unsigned i = 0; i < samples && m_backend.Active(); i++)
+			Sample(m_keys[i % m_keys.size()]);
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Prints the latency percentiles, in
+	///        milliseconds from the press
+	///
+	//////////////////////////////////////////////
+	void Report(std::ostream& stream) const
+	{
+		stream << m_settings.name << ": keys " << m_keys.size() << ", " << m_observed.Count() << " presses read, "
+			<< m_nIgnored << " ignored, " << m_nInvisible << " without a draw" << std::endl;
+
+		const std::pair<const char*, const Histogram*> stages[] = {
+			{ "read", &m_observed }, { "drawn", &m_drawn }, { "presented", &m_presented } };
+		for (auto& stage : stages)
+		{
+			stream << "  " << stage.first << ": p50 " << stage.second->Percentile(50) << "ms, p99 "
+				<< stage.second->Percentile(99) << "ms, max " << stage.second->Max() << "ms" << std::endl;
+		}
+	}
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	//////////////////////////////////////////////
+	/// \brief Presses one key at a random moment
+	///        and follows it to the screen
+	///
+	//////////////////////////////////////////////
+	void Sample(BYTE k)
+	{
+		Chip8 twin = m_machine.Fork();
+
+		std::uniform_int_distribution<int> delay(0, 1000000 / FRAME_RATE);
+		Clock::time_point press = Clock::now() + std::chrono::microseconds(delay(m_random));
+		Clock::time_point observed, drawn, presented;
+		bool bObserved = false, bDrawn = false, bPresented = false;
+		unsigned held = 0;
+
+		for (unsigned frame = 0; frame < LATENCY_TIMEOUT && !bPresented && m_backend.Active(); frame++)
+		{
+			// Keys are only looked at once per frame, like PollKeys
+			bool bHeld = Clock::now() >= press && held < KEY_HOLD_FRAMES;
+			m_machine.SetKeys(bHeld ? (1 << k) : 0);
+			held += bHeld;
+
+			for (unsigned i = 0; i < m_settings.cycles && !m_machine.interrupt; i++)
+			{
+				m_machine.Execute(1);
+				twin.Execute(1);
+
+				if (!bObserved && m_machine.Hash() != twin.Hash())
+				{
+					observed = Clock::now();
+					bObserved = true;
+				}
+
+				if (bObserved && !bDrawn && memcmp(m_machine.getDisplay(), twin.getDisplay(), WIDTH * HEIGHT) != 0)
+				{
+					drawn = Clock::now();
+					bDrawn = true;
+				}
+			}
+
+			m_machine.UpdateTimers();
+			twin.UpdateTimers();
+
+			if (m_settings.presentFirst)
+				bPresented = Present(bDrawn, presented);
+
+			m_pacer.Wait();
+
+			if (!m_settings.presentFirst)
+				bPresented = Present(bDrawn, presented);
+		}
+
+		if (!bObserved)
+			m_nIgnored++;
+		else
+			m_observed.Add(Milliseconds(observed - press));
+
+		if (bObserved && !bDrawn)
+			m_nInvisible++;
+
+		if (bDrawn)
+		{
+			m_drawn.Add(Milliseconds(drawn - press));
+			m_presented.Add(Milliseconds(presented - press));
+		}
+
+		// Let go and let the game settle before the next press
+		m_machine.SetKeys(0);
+		for (unsigned frame = 0; frame < LATENCY_SETTLE; frame++)
+		{
+			m_machine.Execute(m_settings.cycles);
+			m_machine.UpdateTimers();
+			Present(false, presented);
+			m_pacer.Wait();
+		}
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Shows the frame if it changed
+	///
+	/// \param bDrawn Whether the press was drawn
+	/// \param when   Set to the time the frame was
+	///               shown
+	/// \return Whether the press is now on screen
+	//////////////////////////////////////////////
+	bool Present(bool bDrawn, Clock::time_point& when)
+	{
+		if (m_machine.dirtyRows == 0)
+			return false;
+
+		unsigned first = 0, last = HEIGHT - 1;
+		while (!(m_machine.dirtyRows & (1u << first)))
+			first++;
+		while (!(m_machine.dirtyRows & (1u << last)))
+			last--;
+
+		m_backend.Present(m_machine.getDisplay(), first, last);
+		m_machine.dirtyRows = 0;
+		m_machine.drawFlag = false;
+
+		if (!bDrawn)
+			return false;
+
+		when = Clock::now();
+		return true;
+	}
+
+	static double Milliseconds(Clock::duration duration)
+	{
+		return std::chrono::duration<double, std::milli>(duration).count();
+	}
+
+	TBackend& m_backend;
+	LatencySettings m_settings;
+	std::mt19937 m_random;
+
+	Chip8 m_machine;
+	std::vector<BYTE> m_keys;		// Keys the game reacts to
+	FramePacer m_pacer;
+
+	Histogram m_observed;
+	Histogram m_drawn;
+	Histogram m_presented;
+	uint64_t m_nIgnored = 0;
+	uint64_t m_nInvisible = 0;
+};
+
+
+
+#ifdef __cpp_impl_coroutine
+////////////////////////////////////////////////////////////////
+// COROUTINE SCHEDULER
+//
+// Alternative to one Screen thread per machine: every session is
+// a coroutine that awaits its next frame deadline, or a key when
+// the ROM blocks on FX0A with its timers stopped. One thread runs
+// all of them from a timer heap, so an idle session is a
+// suspended coroutine frame and a heap entry. Needs C++20
+//
+/////////////////////////////////////////////////////////////////
+
+//////////////////////////////////////////////
+/// \brief Return type of a coroutine that runs
+///        on its own and frees itself when done
+///
+//////////////////////////////////////////////
+struct DetachedTask
+{
+	struct promise_type
+	{
+		DetachedTask get_return_object() { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+
+class Scheduler
+{
+public:
+	using Clock = std::chrono::steady_clock;
+
+	//////////////////////////////////////////////
+	/// \brief Awaitable that resumes at a point in
+	///        time
+	///
+	//////////////////////////////////////////////
+	struct Timer
+	{
+		Scheduler& scheduler;
+		Clock::time_point until;
+
+		bool await_ready() const { return false; }	// Always yield, nobody starves
+		void await_suspend(std::coroutine_handle<> handle) { scheduler.m_timers.push(Entry{ until, handle }); }
+		void await_resume() const {}
+	};
+
+	Timer Until(Clock::time_point until) { return Timer{ *this, until }; }
+
+	//////////////////////////////////////////////
+	/// \brief Resumes a coroutine on the next
+	///        round. Scheduler thread only
+	///
+	//////////////////////////////////////////////
+	void Wake(std::coroutine_handle<> handle)
+	{
+		m_ready.push_back(handle);
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Runs a function on the scheduler
+	///        thread. Can be called from any thread
+	///
+	//////////////////////////////////////////////
+	void Post(std::function<void()> task)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_posted.push_back(std::move(task));
+		m_wake.notify_one();
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Runs coroutines until Stop is called
+	///
+	/// \param untilStop If false, also returns when
+	///                  no coroutine waits on a timer
+	///                  any more
+	//////////////////////////////////////////////
+	void Run(bool untilStop = false)
+	{
+		std::vector<std::function<void()>> posted;
+
+		while (!m_bStop && (untilStop || !m_ready.empty() || !m_timers.empty()))
+		{
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				if (m_ready.empty() && m_posted.empty())
+				{
+					if (m_timers.empty())
+						m_wake.wait(lock, [this] { return !m_posted.empty() || m_bStop; });
+					else
+						m_wake.wait_until(lock, m_timers.top().until, [this] { return !m_posted.empty() || m_bStop; });
+				}
+
+				posted.swap(m_posted);
+			}
+
+			for (auto& task : posted)
+				task();
+			posted.clear();
+
+			auto now = Clock::now();
+			while (!m_timers.empty() && m_timers.top().until <= now)
+			{
+				m_ready.push_back(m_timers.top().handle);
+				m_timers.pop();
+			}
+
+			// Only what is ready now, anything resumed here that
+			// wakes others gets to run on the next round
+			for (size_t i = 0, n = m_ready.size(); i < n; i++)
+			{
+				std::coroutine_handle<> handle = m_ready.front();
+				m_ready.pop_front();
+				handle.resume();
+			}
+		}
+	}
+
+	void Stop()
+	{
+		Post([this] { m_bStop = true; });
+	}
+
+private:
+	struct Entry
+	{
+		Clock::time_point until;
+		std::coroutine_handle<> handle;
+
+		bool operator<(const Entry& other) const { return until > other.until; }	// Earliest on top
+	};
+
+	std::priority_queue<Entry> m_timers;
+	std::deque<std::coroutine_handle<>> m_ready;
+
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+	std::vector<std::function<void()>> m_posted;
+	bool m_bStop = false;
+};
+
+
+//////////////////////////////////////////////
+/// \brief A machine run by a Scheduler
+///
+//////////////////////////////////////////////
+class CoSession
+{
+public:
+	Chip8 machine;
+
+	CoSession(Scheduler& scheduler) : m_scheduler(scheduler) {}
+
+	~CoSession()
+	{
+		if (m_keyWaiter)
+			m_keyWaiter.destroy();	// Never going to get its key
+	}
+
+	//////////////////////////////////////////////
+	/// \brief Awaitable that resumes once a key
+	///        went down, if the machine waits on one
+	///
+	//////////////////////////////////////////////
+	struct KeyPress
+	{
+		CoSession& session;
+
+		bool await_ready() const { return !session.machine.WaitingForKey(); }
+		void await_suspend(std::coroutine_handle<> handle) { session.m_keyWaiter = handle; }
+		void await_resume() const {}
+	};
+
+	KeyPress NextKey() { return KeyPress{ *this }; }
+
+	//////////////////////////////////////////////
+	/// \brief Sets the held keys. Scheduler thread
+	///        only, other threads go through Post
+	///
+	/// \param mask Bit k is set if key k is held
+	//////////////////////////////////////////////
+	void SetKeys(WORD mask)
+	{
+		machine.SetKeys(mask);
+
+		if (m_keyWaiter && !machine.WaitingForKey())
+		{
+			m_scheduler.Wake(m_keyWaiter);
+			m_keyWaiter = nullptr;
+		}
+	}
+
+	bool Idle() const { return (bool)m_keyWaiter; }
+
+private:
+	Scheduler& m_scheduler;
+	std::coroutine_handle<> m_keyWaiter;
+};
+
+
+//////////////////////////////////////////////
+/// \brief The run loop of a session, Screen's
+///        GameThread as a coroutine
+///
+/// \param frames  Frames to run, 0 for no limit
+/// \param onFrame Called after every frame
+//////////////////////////////////////////////
+template<typename TFrame>
+DetachedTask RunSession(Scheduler& scheduler, CoSession& session, uint64_t frames, TFrame onFrame)
+{
+	const Scheduler::Clock::duration period = std::chrono::nanoseconds(1000000000 / FRAME_RATE);
+	Chip8& machine = session.machine;
+	Scheduler::Clock::time_point deadline = Scheduler::Clock::now();
+
+	for (uint64_t frame = 0; (frames == 0 || frame < frames) && !machine.interrupt; frame++)
+	{
+		// Nothing changes until a key goes down, not even the timers
+		if (machine.WaitingForKey() && machine.delay_timer == 0 && machine.sound_timer == 0)
+		{
+			co_await session.NextKey();
+			deadline = Scheduler::Clock::now();
+		}
+
+		// Skip missed periods like FramePacer does
+		deadline += period;
+		if (deadline < Scheduler::Clock::now())
+		{
+			metrics.ticksMissed.Add();
+			deadline = Scheduler::Clock::now();
+		}
+
+		co_await scheduler.Until(deadline);
+
+		metrics.instructions.Add(machine.Execute(CYCLES_PER_FRAME));
+		machine.UpdateTimers();
+		onFrame(session);
+	}
+}
+#endif
+
+
+
+////////////////////////////////////////////////////////////////
+// DEBUG SHELL
+//
+// Line based front end for the debugger, one command per line:
+//   b <addr>           set a breakpoint     d <addr>  delete it
+//   w <from> <to>      watch writes to [from, to)
+//   r <0-F | I> [val]  stop when a register changes / becomes val
+//   x                  remove all watches and conditions
+//   c [frames]         continue              s  step one instruction
+//   p                  print the registers   q  quit
+// Numbers are hex. Runs at CYCLES_PER_FRAME with timers ticking
+// once per frame and no keys pressed, so a machine waiting on
+// FX0A stops. c without a count runs DEBUG_CONTINUE_FRAMES at
+// most, Ctrl+C stops it earlier
+//
+/////////////////////////////////////////////////////////////////
+
+const constexpr uint64_t DEBUG_CONTINUE_FRAMES = FRAME_RATE * 60;	// A minute of guest time
+
+
+void DebugShell(Chip8& machine, std::istream& in, std::ostream& out)
+{
+	static const char* reasons[] = { "", "breakpoint", "write", "register" };
+
+	// Set from SIGINT while running, checked once per frame
+	static std::atomic<bool> bAtomBreak;
+	auto onInterrupt = [](int) { bAtomBreak = true; };
+
+	unsigned cycle = 0;	// Instructions run in the current frame
+	auto run = [&](uint64_t cycles)
+	{
+		bool waiting = false;
+		bAtomBreak = false;
+		auto previous = signal(SIGINT, onInterrupt);
+
+		machine.Resume();
+		while (cycles > 0 && !machine.interrupt && !bAtomBreak)
+		{
+			// No key ever goes down here, nothing would change any more
+			if (machine.WaitingForKey() && machine.delay_timer == 0 && machine.sound_timer == 0)
+			{
+				waiting = true;
+				break;
+			}
+
+			unsigned budget = (unsigned)std::min<uint64_t>(cycles, CYCLES_PER_FRAME - cycle);
+			unsigned done = machine.Execute(budget);
+			cycles -= done;
+			cycle += done;
+
+			if (cycle == CYCLES_PER_FRAME)
+			{
+				machine.UpdateTimers();
+				cycle = 0;
+			}
+		}
+
+		signal(SIGINT, previous);
+
+		if (machine.stopReason != STOP_NONE)
+			out << "Stopped (" << reasons[machine.stopReason] << ") at " << std::hex << std::uppercase << machine.stopAddress << std::dec << std::endl;
+		else if (machine.interrupt)
+			out << "Halted" << std::endl;
+		else if (waiting)
+			out << "Waiting for a key" << std::endl;
+		else if (bAtomBreak)
+			out << "Interrupted" << std::endl;
+
+		machine.DumpRegisters(out);
+	};
+
+	std::string line;
+	while (out << "> " << std::flush, std::getline(in, line))
+	{
+		std::istringstream args(line);
+		std::string command, a, b;
+		args >> command >> a >> b;
+
+		auto hex = [](const std::string& s) { return (WORD)std::stoul(s, nullptr, 16); };
+
+		try
+		{
+			if (command == "b")
+				machine.SetBreakpoint(hex(a));
+			else if (command == "d")
+				machine.ClearBreakpoint(hex(a));
+			else if (command == "w")
+			{
+				if (!machine.WatchWrites(hex(a), hex(b)))
+					out << "Cannot watch that" << std::endl;
+			}
+			else if (command == "r")
+			{
+				BYTE reg = (a == "I" || a == "i") ? REG_I : (BYTE)hex(a);
+				if (!machine.BreakOnRegister(reg, b.empty() ? -1 : hex(b)))
+					out << "Cannot watch that" << std::endl;
+			}
+			else if (command == "x")
+				machine.ClearWatches();
+			else if (command == "c")
+				run((a.empty() ? DEBUG_CONTINUE_FRAMES : (uint64_t)std::stoul(a)) * CYCLES_PER_FRAME);
+			else if (command == "s")
+				run(1);
+			else if (command == "p")
+				machine.DumpRegisters(out);
+			else if (command == "q")
+				break;
+			else if (!command.empty())
+				out << "Unknown command" << std::endl;
+		}
+		catch (const std::exception&)
+		{
+			out << "Bad number" << std::endl;
+		}
+	}
+}
+
+
+
+#ifdef __linux__
+////////////////////////////////////////////////////////////////
+// SESSION SERVER
+//
+// Hosts many headless machines behind one loopback TCP port or
+// Unix socket. One thread does all socket I/O with epoll and
+// ticks the sessions at 60Hz, a fixed pool of workers emulates
+// them.
+//
+// Client -> Server
+//   'K' <key, | 0x80 if pressed>         Key event
+//   'A' <u32 seq>                        Frame seq was applied
+//
+// Server -> Client
+//   'F' <u32 seq> <u32 base> <u16 size> <size bytes of runs>
+//   Frame seq is the frame base (0 = blank screen) with every run
+//   <u8 offset> <u8 count> <count bytes> copied over it. Frames
+//   are packed like Chip8::GetPackedDisplay. base is always the
+//   newest frame the client acknowledged, so a client only has to
+//   keep the frames it acknowledged until a newer base shows up.
+//
+// All integers are little endian
+//
+/////////////////////////////////////////////////////////////////
+
+const constexpr unsigned SESSION_FRAME_HISTORY = 8;		// Sent frames that can still be acknowledged
+const constexpr size_t SESSION_MAX_BACKLOG = 64 * 1024;	// Unsent bytes before frames are dropped
+
+
+struct Session
+{
+	int fd;
+	Chip8 machine;
 
-#ifndef SUPPRESS_PROC_INFO
-		std::cout << "Set I to 0x" << address << std::endl;
-#endif
-	}
+	std::mutex lock;
+	std::atomic<bool> queued{ false };	// Waiting for a worker
 
+	std::string input;					// Bytes received but not parsed yet
+	std::string output;					// Bytes not written to the socket yet
 
-	///////////////////0xBNNN///////////////////
-	/// \brief Jump to location NNN + V0
-	///
-	/// \param address NNN
-	////////////////////////////////////////////
-	void JP_V(WORD address)
+	uint32_t seq = 0;					// Last frame sent
+	uint32_t ackedSeq = 0;				// Last frame the client acknowledged
+	BYTE acked[PACKED_SIZE] = {};		// Contents of frame ackedSeq
+	BYTE frame[PACKED_SIZE] = {};		// Contents of frame seq
+
+	struct SentFrame
 	{
-		pc = address + V[0x0];
+		uint32_t seq;
+		BYTE packed[PACKED_SIZE];
+	} sent[SESSION_FRAME_HISTORY] = {};
+};
 
-#ifndef SUPPRESS_PROC_INFO
-		std::cout << "Jumped to adress " << (WORD)pc << std::endl;
-#endif
-	}
 
-	
-	///////////////////0xCXKK///////////////////
-	/// \brief Sets VX to a random byte ANDed with KK
-	///
-	/// \param regX X
-	/// \param byte KK
-	////////////////////////////////////////////
-	void RND(BYTE regX, BYTE byte)
+class SessionServer
+{
+public:
+	SessionServer(const std::string& rom, unsigned workers)
+		: m_rom(Chip8::Image(rom))
 	{
-		static std::default_random_engine engine(std::chrono::system_clock::now().time_since_epoch().count());
-		static std::uniform_int_distribution<WORD> range(0, 0xFF);
-
-		BYTE rnd = range(engine) & byte;
+		m_nWorkers = workers ? workers : 1;
+	}
 
-		V[regX] = rnd;
+	~SessionServer()
+	{
+		m_bAtomActive = false;
+		m_cvQueue.notify_all();
+		for (std::thread& t : m_workers)
+			t.join();
 
-		pc += 0x02;
+		for (auto& s : m_sessions)
+			close(s.first);
 
-#ifndef SUPPRESS_PROC_INFO
-		std::cout << "(Random) Set V" << (WORD)regX << " to 0x" << (WORD)rnd << std::endl;
-#endif
+		for (int fd : { m_listen, m_timer, m_wake, m_epoll })
+			if (fd >= 0)
+				close(fd);
 	}
 
-
-	///////////////////0xDXYN///////////////////
-	/// \brief Draws sprite that is N bytes long and
-	///        stored at I at position (VX, VY). Set
-	///        VF = 1 if collision
+	//////////////////////////////////////////////
+	/// \brief Opens the listening socket
 	///
-	/// \param regX		x
-	/// \param regY		y
-	/// \param bytes	N
-	////////////////////////////////////////////
-	void DRW(BYTE regX, BYTE regY, BYTE bytes)
+	/// \param address A port on 127.0.0.1, or the
+	///                path of a Unix socket
+	/// \return Whether the socket could be opened
+	//////////////////////////////////////////////
+	bool Listen(const std::string& address)
 	{
-		V[0xF] = 0x00;
-
-		for (BYTE y = 0; y < bytes; y++)
+		if (!address.empty() && address.find_first_not_of("0123456789") == std::string::npos)
+		{
+			sockaddr_in addr = {};
+			addr.sin_family = AF_INET;
+			addr.sin_port = htons((uint16_t)std::stoi(address));
+			addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+			int yes = 1;
+			m_listen = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+			setsockopt(m_listen, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+			if (m_listen < 0 || bind(m_listen, (sockaddr*)&addr, sizeof(addr)) < 0)
+				return Error("bind");
+		}
+		else
 		{
-			BYTE line = memory[I + y];
+			sockaddr_un addr = {};
+			addr.sun_family = AF_UNIX;
+			if (address.size() >= sizeof(addr.sun_path))
+				return Error("Socket path too long");
+			address.copy(addr.sun_path, address.size());
+
+			unlink(address.c_str());
+			m_listen = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+			if (m_listen < 0 || bind(m_listen, (sockaddr*)&addr, sizeof(addr)) < 0)
+				return Error("bind");
+		}
 
-			for (BYTE x = 0; x < 8; x++)
-			{
-				BYTE pixel = line & (0x80 >> x);
-				if (pixel != 0)
-				{
-					BYTE totalX = V[regX] + x;
-					BYTE totalY = V[regY] + y;
-					WORD index = totalY * 64 + totalX;
+		if (listen(m_listen, SOMAXCONN) < 0)
+			return Error("listen");
 
-					if (gfx[index] == 1) {
-						V[0xF] = 1;
-					}
+		m_epoll = epoll_create1(EPOLL_CLOEXEC);
+		m_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		m_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (m_epoll < 0 || m_wake < 0 || m_timer < 0)
+			return Error("epoll");
 
-					gfx[index] ^= 1;
-				}
-				
-			}
-		}
+		itimerspec tick = {};
+		tick.it_interval.tv_nsec = 1000000000 / 60;
+		tick.it_value = tick.it_interval;
+		timerfd_settime(m_timer, 0, &tick, nullptr);
 
-		pc += 0x02;
-		drawFlag = true;
+		for (int fd : { m_listen, m_wake, m_timer })
+			Watch(fd, EPOLLIN, EPOLL_CTL_ADD);
 
-#ifndef SUPPRESS_PROC_INFO
-		std::cout << "Drew Sprite at position (V" << (WORD)regX << ", V" << (WORD)regY << ")[" << std::dec << (WORD)V[regX] << ", " << (WORD)V[regY] << "]" << std::endl;
-#endif
+		return true;
 	}
 
-
-	///////////////////0xEX9E///////////////////
-	/// \brief Skip instruction if key of value VX is pressed
-	///
-	/// \param regX X 
+	//////////////////////////////////////////////
+	/// \brief Serves clients until the server is
+	///        destroyed
 	///
-	////////////////////////////////////////////
-	void SKP(BYTE regX)
+	//////////////////////////////////////////////
+	void Run()
 	{
-		if (GetKeyState(keymap.find(V[regX])->second) & 0x8000)
-		{
-			pc += 0x04;
+		m_bAtomActive = true;
+		for (unsigned i = 0; i < m_nWorkers; i++)
+			m_workers.emplace_back(&SessionServer::Worker, this);
 
-#ifndef SUPPRESS_PROC_INFO
-			std::cout << "Skipped instruction because key " << (WORD)V[regX] << " was pressed" << std::endl;
-#endif	
-		}
-		else
+		epoll_event events[64];
+		while (m_bAtomActive)
 		{
-			pc += 0x02;
+			int count = epoll_wait(m_epoll, events, 64, -1);
 
-#ifndef SUPPRESS_PROC_INFO
-			std::cout << "Didn't skip instruction because key " << (WORD)V[regX] << " was not pressed" << std::endl;
-#endif
+			for (int i = 0; i < count; i++)
+			{
+				int fd = events[i].data.fd;
+
+				if (fd == m_listen)
+					Accept();
+				else if (fd == m_timer)
+					Tick();
+				else if (fd == m_wake)
+					FlushDirty();
+				else
+				{
+					auto it = m_sessions.find(fd);
+					if (it == m_sessions.end())
+						continue;
+
+					std::shared_ptr<Session> session = it->second;
+					if ((events[i].events & (EPOLLERR | EPOLLHUP)) ||
+						((events[i].events & EPOLLIN) && !Read(*session)) ||
+						((events[i].events & EPOLLOUT) && !Flush(*session)))
+					{
+						Close(*session);
+					}
+				}
+			}
 		}
 	}
 
-
-	///////////////////0xEXA1///////////////////
-	/// \brief Skip instruction if key of value VX is not pressed
-	///
-	/// \param regX X 
+private:
+	//////////////////////////////////////////////
+	/// \brief Accepts all pending connections
 	///
-	////////////////////////////////////////////
-	void SKNP(BYTE regX)
+	//////////////////////////////////////////////
+	void Accept()
 	{
-		if (GetKeyState(keymap.find(V[regX])->second) & 0x8000)
-		{
-			pc += 0x02;
-
-#ifndef SUPPRESS_PROC_INFO
-			std::cout << "Didn't skip instruction because key " << (WORD)V[regX] << " was pressed" << std::endl;
-#endif
-		} 
-		else
+		int fd;
+		while ((fd = accept4(m_listen, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
 		{
-			pc += 0x04;
-
-#ifndef SUPPRESS_PROC_INFO
-			std::cout << "Skipped instruction because key " << (WORD)V[regX] << " was not pressed" << std::endl;
-#endif
+			std::shared_ptr<Session> session = std::make_shared<Session>();
+			session->fd = fd;
+			session->machine.Initialize();
+			session->machine.LoadGame(m_rom);
+			session->machine.Seed(std::chrono::steady_clock::now().time_since_epoch().count() ^ fd);
+
+			m_sessions[fd] = session;
+			Watch(fd, EPOLLIN, EPOLL_CTL_ADD);
 		}
 	}
 
-
-	///////////////////0xFX07///////////////////
-	/// \brief Store BCD representation of X at I
-	///
-	/// \param regX X 
+	//////////////////////////////////////////////
+	/// \brief Reads and applies client messages
 	///
-	////////////////////////////////////////////
-	void LD_X(BYTE regX)
+	/// \return False if the session has to close
+	//////////////////////////////////////////////
+	bool Read(Session& session)
 	{
-		V[regX] = delay_timer;
-
-		pc += 0x02;
+		char buf[512];
+		ssize_t got;
+		while ((got = recv(session.fd, buf, sizeof(buf), 0)) > 0)
+			session.input.append(buf, got);
 
-#ifndef SUPPRESS_PROC_INFO
-		std::cout << "Set V" << (WORD)regX << " to delay_timer(" << (WORD)delay_timer << ")" << std::endl;
-#endif
-	}
+		if (got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			return false;
 
+		std::lock_guard<std::mutex> ul(session.lock);
 
-	///////////////////0xFX0A///////////////////
-	/// \brief Halt program until key press. Save key to VX
-	///
-	/// \param regX X 
-	///
-	////////////////////////////////////////////
-	void LD_K(BYTE regX)
-	{
-#ifndef SUPPRESS_PROC_INFO
-		std::cout << "Waiting for Key press..." << std::endl;
-#endif
-		for (BYTE key = 0x0; key < 0xF; key++)
+		size_t pos = 0;
+		while (pos < session.input.size())
 		{
-			if (GetKeyState(keymap.find(key)->second) & 0x8000)
+			const BYTE* msg = (const BYTE*)session.input.data() + pos;
+			size_t left = session.input.size() - pos;
+
+			if (msg[0] == 'K')
 			{
-				V[regX] = key;
-				pc += 0x02;
+				if (left < 2)
+					break;
 
-#ifndef SUPPRESS_PROC_INFO
-				std::cout << "Key pressed: 0x" << (WORD)key << ". Saved to V" << (WORD)regX << std::endl;
-#endif
+				session.machine.SetKey(msg[1] & 0x0F, msg[1] & 0x80);
+				pos += 2;
+			}
+			else if (msg[0] == 'A')
+			{
+				if (left < 5)
+					break;
 
-				break;
+				uint32_t seq = msg[1] | (msg[2] << 8) | (msg[3] << 16) | ((uint32_t)msg[4] << 24);
+				Session::SentFrame& sent = session.sent[seq % SESSION_FRAME_HISTORY];
+				if (sent.seq == seq && seq > session.ackedSeq)
+				{
+					session.ackedSeq = seq;
+					std::copy(sent.packed, sent.packed + PACKED_SIZE, session.acked);
+				}
+				pos += 5;
+			}
+			else
+			{
+				return false;
 			}
 		}
-	}
 
+		session.input.erase(0, pos);
+		return true;
+	}
 
-	///////////////////0xFX15///////////////////
-	/// \brief Set delay timer to VX
-	///
-	/// \param regX X 
+	//////////////////////////////////////////////
+	/// \brief Writes as much pending output as the
+	///        socket takes
 	///
-	////////////////////////////////////////////
-	void LD_DT(BYTE regX)
+	/// \return False if the session has to close
+	//////////////////////////////////////////////
+	bool Flush(Session& session)
 	{
-		delay_timer = V[regX];
+		std::lock_guard<std::mutex> ul(session.lock);
+		ScopedTimer timer(metrics.presentTime);
 
-		pc += 0x02;
+		while (!session.output.empty())
+		{
+			ssize_t sent = send(session.fd, session.output.data(), session.output.size(), MSG_NOSIGNAL);
+			if (sent < 0)
+			{
+				if (errno != EAGAIN && errno != EWOULDBLOCK)
+					return false;
+				break;
+			}
 
-#ifndef SUPPRESS_PROC_INFO
-		std::cout << "Set delay timer to " << (WORD)V[regX] << std::endl;
-#endif
-	}
+			session.output.erase(0, sent);
+		}
 
+		Watch(session.fd, session.output.empty() ? EPOLLIN : EPOLLIN | EPOLLOUT, EPOLL_CTL_MOD);
+		return true;
+	}
 
-	///////////////////0xFX18///////////////////
-	/// \brief Set sound timer to VX
-	///
-	/// \param regX X 
+	//////////////////////////////////////////////
+	/// \brief Flushes every session a worker has
+	///        produced a frame for
 	///
-	////////////////////////////////////////////
-	void LD_ST(BYTE regX)
+	//////////////////////////////////////////////
+	void FlushDirty()
 	{
-		sound_timer = V[regX];
+		uint64_t count;
+		read(m_wake, &count, sizeof(count));
 
-		pc += 0x02;
+		std::vector<std::shared_ptr<Session>> dirty;
+		{
+			std::lock_guard<std::mutex> ul(m_muxDirty);
+			dirty.swap(m_dirty);
+		}
 
-#ifndef SUPPRESS_PROC_INFO
-		std::cout << "Set sound timer to " << (WORD)V[regX] << std::endl;
-#endif
+		for (std::shared_ptr<Session>& session : dirty)
+		{
+			if (m_sessions.count(session->fd) && m_sessions[session->fd] == session && !Flush(*session))
+				Close(*session);
+		}
 	}
 
-
-	///////////////////0xFX1E///////////////////
-	/// \brief Set I = I + VX
-	///
-	/// \param regX X 
+	//////////////////////////////////////////////
+	/// \brief Hands every session that isn't still
+	///        busy with the last tick to the workers
 	///
-	////////////////////////////////////////////
-	void ADD_I(BYTE regX)
+	//////////////////////////////////////////////
+	void Tick()
 	{
-		I += V[regX];
-		pc += 0x02;
+		uint64_t expirations;
+		read(m_timer, &expirations, sizeof(expirations));
 
-#ifndef SUPPRESS_PROC_INFO
-		std::cout << "Added V" << (WORD)regX << "(" << (WORD)V[regX] << ") to I. I = " << (WORD)I << std::endl;
-#endif
+		{
+			std::lock_guard<std::mutex> ul(m_muxQueue);
+			for (auto& s : m_sessions)
+			{
+				if (!s.second->queued.exchange(true))
+					m_queue.push_back(s.second);
+			}
+		}
+		m_cvQueue.notify_all();
 	}
 
-	///////////////////0xFX29///////////////////
-	/// \brief Set I to location of font for digit VX
-	///
-	/// \param regX X 
+	//////////////////////////////////////////////
+	/// \brief Runs one frame of queued sessions
+	///        until the server shuts down
 	///
-	////////////////////////////////////////////
-	void LD_F(BYTE regX)
+	//////////////////////////////////////////////
+	void Worker()
 	{
-		I = 0x0000 + (V[regX] * 5);
-		pc += 0x02;
-
-#ifndef SUPPRESS_PROC_INFO
-		std::cout << "Stored font \"" << (WORD)V[regX] << "\" at I" << std::endl;
-#endif
-	}
+		while (true)
+		{
+			std::shared_ptr<Session> session;
+			{
+				std::unique_lock<std::mutex> ul(m_muxQueue);
+				m_cvQueue.wait(ul, [this] { return !m_queue.empty() || !m_bAtomActive; });
+				if (!m_bAtomActive)
+					return;
 
+				session = std::move(m_queue.front());
+				m_queue.pop_front();
+			}
 
-	///////////////////0xFX33///////////////////
-	/// \brief Store BCD representation of X at I
-	///
-	/// \param regX X 
-	///
-	////////////////////////////////////////////
-	void LD_B(BYTE regX)
-	{
-		BYTE value = V[regX];
+			bool produced = false;
+			{
+				std::lock_guard<std::mutex> ul(session->lock);
+				session->queued = false;
 
-		BYTE hundreds = (value - (value % 100)) / 100;
-		value -= hundreds * 100;
+				ScopedTimer timer(metrics.renderTime);
 
-		BYTE tens = (value - (value % 10)) / 10;
-		value -= tens * 10;
+				Chip8& machine = session->machine;
+				metrics.instructions.Add(machine.Execute(CYCLES_PER_FRAME));
+				machine.UpdateTimers();
 
-		memory[I] = hundreds;
-		memory[I + 1] = tens;
-		memory[I + 2] = value;
+				if (machine.drawFlag && session->output.size() < SESSION_MAX_BACKLOG)
+				{
+					machine.drawFlag = false;
+					produced = SendFrame(*session);
+				}
+			}
 
-		pc += 0x02;
+			if (produced)
+			{
+				{
+					std::lock_guard<std::mutex> ul(m_muxDirty);
+					m_dirty.push_back(std::move(session));
+				}
 
-#ifndef SUPPRESS_PROC_INFO
-		std::cout << "Storing Binary Coded Decimal V" << (WORD)regX << " as {" << std::dec << (WORD)hundreds << ", " << (WORD)tens << ", " << (WORD)value << "}" << std::endl;
-#endif
+				uint64_t one = 1;
+				write(m_wake, &one, sizeof(one));
+			}
+		}
 	}
 
-
-	///////////////////0xFX55///////////////////
-	/// \brief Fill memory at I with values from V0 - VX
-	///
-	/// \param regX X 
+	//////////////////////////////////////////////
+	/// \brief Queues the current display as a
+	///        delta against the acknowledged frame.
+	///        Session lock must be held
 	///
-	////////////////////////////////////////////
-	void LD_55(BYTE regX)
+	/// \return Whether a frame was queued
+	//////////////////////////////////////////////
+	bool SendFrame(Session& session)
 	{
-		for (int offset = 0; offset <= regX; offset++)
-		{
-			memory[I + offset] = V[offset];
-		}
-
-		pc += 0x02;
+		BYTE packed[PACKED_SIZE];
+		session.machine.GetPackedDisplay(packed);
+		if (std::equal(packed, packed + PACKED_SIZE, session.frame))
+			return false;
 
-#ifndef SUPPRESS_PROC_INFO
-		std::cout << "Filled memory starting at 0x" << (WORD)I << " with the values of V0 to V" << (WORD)regX << std::endl;
-#endif
-	}
+		std::copy(packed, packed + PACKED_SIZE, session.frame);
+		session.seq++;
 
+		Session::SentFrame& sent = session.sent[session.seq % SESSION_FRAME_HISTORY];
+		sent.seq = session.seq;
+		std::copy(packed, packed + PACKED_SIZE, sent.packed);
 
-	///////////////////0xFX65///////////////////
-	/// \brief Fill V0 - VX with memory data starting at I
-	///
-	/// \param regX X 
-	///
-	////////////////////////////////////////////
-	void LD_65(BYTE regX)
-	{
-		for (int offset = 0; offset <= regX; offset++)
+		std::string runs;
+		for (unsigned i = 0; i < PACKED_SIZE; )
 		{
-			V[offset] = memory[I + offset];
-		}
-
-		pc += 0x02;
+			if (packed[i] == session.acked[i])
+			{
+				i++;
+				continue;
+			}
 
-#ifndef SUPPRESS_PROC_INFO
-		std::cout << "Filled V0 through V" << (WORD)regX << " with memory values starting at 0x" << I << std::endl;
-#endif
-	}
-} chip8;
+			unsigned start = i;
+			while (i < PACKED_SIZE && i - start < 0xFF && packed[i] != session.acked[i])
+				i++;
 
+			runs += (char)start;
+			runs += (char)(i - start);
+			runs.append((const char*)packed + start, i - start);
+		}
 
+		std::string& out = session.output;
+		out += 'F';
+		for (uint32_t value : { session.seq, session.ackedSeq })
+			for (int shift = 0; shift < 32; shift += 8)
+				out += (char)(value >> shift);
+		out += (char)(runs.size() & 0xFF);
+		out += (char)(runs.size() >> 8);
+		out += runs;
 
+		metrics.frames.Add();
+		return true;
+	}
 
-class olcConsoleGameEngine
-{
-public:
-	olcConsoleGameEngine()
+	//////////////////////////////////////////////
+	/// \brief Drops a session. Workers still holding
+	///        it finish their frame harmlessly
+	///
+	//////////////////////////////////////////////
+	void Close(Session& session)
 	{
-		m_nScreenWidth = 80;
-		m_nScreenHeight = 30;
-
-		m_hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
-		m_hConsoleIn = GetStdHandle(STD_INPUT_HANDLE);
+		int fd = session.fd;
+		epoll_ctl(m_epoll, EPOLL_CTL_DEL, fd, nullptr);
+		m_sessions.erase(fd);
+		close(fd);
+	}
 
-		m_sAppName = L"Default";
+	void Watch(int fd, uint32_t events, int op)
+	{
+		epoll_event ev = {};
+		ev.events = events;
+		ev.data.fd = fd;
+		epoll_ctl(m_epoll, op, fd, &ev);
 	}
 
-	int ConstructConsole(int width, int height, int fontw, int fonth)
+	bool Error(const char* msg)
 	{
-		if (m_hConsole == INVALID_HANDLE_VALUE)
-			return Error(L"Bad Handle");
+		std::cerr << "ERROR: " << msg << ": " << strerror(errno) << std::endl;
+		return false;
+	}
 
-		m_nScreenWidth = width;
-		m_nScreenHeight = height;
+private:
+	RomImage m_rom;		// Shared by every session
+	unsigned m_nWorkers;
 
-		m_rectWindow = { 0, 0, 1, 1 };
-		SetConsoleWindowInfo(m_hConsole, TRUE, &m_rectWindow);
+	int m_listen = -1;
+	int m_epoll = -1;
+	int m_timer = -1;
+	int m_wake = -1;
 
-		// Set the size of the screen buffer
-		COORD coord = { (short)m_nScreenWidth, (short)m_nScreenHeight };
-		if (!SetConsoleScreenBufferSize(m_hConsole, coord))
-			Error(L"SetConsoleScreenBufferSize");
+	// Only touched by the I/O thread
+	std::unordered_map<int, std::shared_ptr<Session>> m_sessions;
 
-		// Assign screen buffer to the console
-		if (!SetConsoleActiveScreenBuffer(m_hConsole))
-			return Error(L"SetConsoleActiveScreenBuffer");
+	std::vector<std::thread> m_workers;
+	std::atomic<bool> m_bAtomActive{ false };
 
-		// Set the font size now that the screen buffer has been assigned to the console
-		CONSOLE_FONT_INFOEX cfi;
-		cfi.cbSize = sizeof(cfi);
-		cfi.nFont = 0;
-		cfi.dwFontSize.X = fontw;
-		cfi.dwFontSize.Y = fonth;
-		cfi.FontFamily = FF_DONTCARE;
-		cfi.FontWeight = FW_NORMAL;
+	std::mutex m_muxQueue;
+	std::condition_variable m_cvQueue;
+	std::deque<std::shared_ptr<Session>> m_queue;
 
-		/*	DWORD version = GetVersion();
-		DWORD major = (DWORD)(LOBYTE(LOWORD(version)));
-		DWORD minor = (DWORD)(HIBYTE(LOWORD(version)));*/
+	std::mutex m_muxDirty;
+	std::vector<std::shared_ptr<Session>> m_dirty;
+};
+#endif
 
-		//if ((major > 6) || ((major == 6) && (minor >= 2) && (minor < 4)))		
-		//	wcscpy_s(cfi.FaceName, L"Raster"); // Windows 8 :(
-		//else
-		//	wcscpy_s(cfi.FaceName, L"Lucida Console"); // Everything else :P
 
-		//wcscpy_s(cfi.FaceName, L"Liberation Mono");
-		wcscpy_s(cfi.FaceName, L"Consolas");
-		if (!SetCurrentConsoleFontEx(m_hConsole, false, &cfi))
-			return Error(L"SetCurrentConsoleFontEx");
 
-		// Get screen buffer info and check the maximum allowed window size. Return
-		// error if exceeded, so user knows their dimensions/fontsize are too large
-		CONSOLE_SCREEN_BUFFER_INFO csbi;
-		if (!GetConsoleScreenBufferInfo(m_hConsole, &csbi))
-			return Error(L"GetConsoleScreenBufferInfo");
-		if (m_nScreenHeight > csbi.dwMaximumWindowSize.Y)
-			return Error(L"Screen Height / Font Height Too Big");
-		if (m_nScreenWidth > csbi.dwMaximumWindowSize.X)
-			return Error(L"Screen Width / Font Width Too Big");
+#ifdef CHIP8_FUZZER
+////////////////////////////////////////////////////////////////
+// IN-PROCESS FUZZING HARNESS (libFuzzer)
+//
+// clang++ -std=c++17 -O2 -g -fsanitize=fuzzer,address
+//         -DCHIP8_FUZZER chip8.cpp -o chip8_fuzz
+//
+// Input layout:
+//   [8 bytes seed][1 byte N][N * 2 bytes key masks][ROM]
+// Every key mask is held for one frame, the ROM runs until it
+// hits an unknown opcode or FUZZ_FRAMES frames have passed
+//
+/////////////////////////////////////////////////////////////////
 
-		// Set Physical Console Window Size
-		m_rectWindow = { 0, 0, (short)m_nScreenWidth - 1, (short)m_nScreenHeight - 1 };
-		if (!SetConsoleWindowInfo(m_hConsole, TRUE, &m_rectWindow))
-			return Error(L"SetConsoleWindowInfo");
+const constexpr unsigned FUZZ_FRAMES = 64;
 
-		// Set flags to allow mouse input		
-		if (!SetConsoleMode(m_hConsoleIn, ENABLE_EXTENDED_FLAGS | ENABLE_WINDOW_INPUT | ENABLE_MOUSE_INPUT))
-			return Error(L"SetConsoleMode");
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+	// Initialize() + fontset copy only happen once, every run
+	// after that starts from a plain copy of this image
+	static const Chip8 bootImage = []()
+	{
+		Chip8 machine;
+		machine.Initialize();
+		return machine;
+	}();
 
-		// Allocate memory for screen buffer
-		m_bufScreen = new CHAR_INFO[m_nScreenWidth*m_nScreenHeight];
-		memset(m_bufScreen, 0, sizeof(CHAR_INFO) * m_nScreenWidth * m_nScreenHeight);
+	if (size < 9)
+		return 0;
 
-		SetConsoleCtrlHandler((PHANDLER_ROUTINE)CloseHandler, TRUE);
-		return 1;
-	}
+	uint64_t seed = 0;
+	for (int i = 0; i < 8; i++)
+		seed = (seed << 8) | data[i];
+
+	size_t frames = data[8];
+	const uint8_t* script = data + 9;
+	if (size < 9 + frames * 2)
+		return 0;
+
+	static Chip8 machine;
+	machine = bootImage;
+	machine.Seed(seed);
+	machine.LoadGame(script + frames * 2, size - 9 - frames * 2);
 
-	virtual void Draw(int x, int y, short c = 0x2588, short col = 0x000F)
+	for (unsigned frame = 0; frame < FUZZ_FRAMES && !machine.interrupt; frame++)
 	{
-		if (x >= 0 && x < m_nScreenWidth && y >= 0 && y < m_nScreenHeight)
+		if (frame < frames)
 		{
-			m_bufScreen[y * m_nScreenWidth + x].Char.UnicodeChar = c;
-			m_bufScreen[y * m_nScreenWidth + x].Attributes = col;
+			WORD mask = (script[frame * 2] << 8) | script[frame * 2 + 1];
+			for (BYTE k = 0; k < 16; k++)
+				machine.SetKey(k, mask & (1 << k));
 		}
-	}
 
-	void Clip(int &x, int &y)
-	{
-		if (x < 0) x = 0;
-		if (x >= m_nScreenWidth) x = m_nScreenWidth;
-		if (y < 0) y = 0;
-		if (y >= m_nScreenHeight) y = m_nScreenHeight;
+		machine.Execute(CYCLES_PER_FRAME);
+
+		machine.UpdateTimers();
 	}
 
-	~olcConsoleGameEngine()
+	return 0;
+}
+#else
+int main(int argc, char** argv)
+{
+	// chip8 --pacing [frames]
+	if (argc > 1 && std::string(argv[1]) == "--pacing")
 	{
-		SetConsoleActiveScreenBuffer(m_hOriginalConsole);
-		delete[] m_bufScreen;
+		unsigned frames = (argc > 2) ? std::stoi(argv[2]) : FRAME_RATE * 10;
+
+		FramePacer pacer;
+		for (unsigned i = 0; i < frames; i++)
+			pacer.Wait();
+
+		pacer.Report(std::cout);
+		return 0;
 	}
 
-public:
-	void Start()
+#ifdef __linux__
+	// chip8 --serve <port | socket path> [rom]
+	if (argc > 2 && std::string(argv[1]) == "--serve")
 	{
-		// Start the thread
-		m_bAtomActive = true;
-		std::thread t = std::thread(&olcConsoleGameEngine::GameThread, this);
+		SessionServer server(argc > 3 ? argv[3] : FILENAME, std::thread::hardware_concurrency());
+		if (!server.Listen(argv[2]))
+			return 1;
 
-		// Wait for thread to be exited
-		t.join();
+		StatsDumper stats(std::cerr, std::chrono::seconds(10));
+		server.Run();
+		return 0;
 	}
+#endif
 
-	int ScreenWidth()
+	// chip8 --debug [rom]
+	if (argc > 1 && std::string(argv[1]) == "--debug")
 	{
-		return m_nScreenWidth;
+		chip8.Initialize();
+		chip8.Seed(0);
+		chip8.LoadGame(argc > 2 ? argv[2] : FILENAME);
+
+		DebugShell(chip8, std::cin, std::cout);
+		return 0;
 	}
 
-	int ScreenHeight()
+	// chip8 --search [branches] [frames] [rom]
+	if (argc > 1 && std::string(argv[1]) == "--search")
 	{
-		return m_nScreenHeight;
+		unsigned branches = (argc > 2) ? std::stoi(argv[2]) : 10000;
+		unsigned frames = (argc > 3) ? std::stoi(argv[3]) : 30;
+
+		chip8.Initialize();
+		chip8.Seed(0);
+		chip8.LoadGame(argc > 4 ? argv[4] : FILENAME);
+		for (unsigned frame = 0; frame < 2 * FRAME_RATE; frame++)
+		{
+			chip8.Execute(CYCLES_PER_FRAME);
+			chip8.UpdateTimers();
+		}
+
+		// Random key presses, every one held for a few frames
+		std::mt19937 random(0);
+		std::vector<std::vector<WORD>> scripts(branches);
+		for (auto& script : scripts)
+		{
+			for (unsigned frame = 0; frame < frames; frame++)
+				script.push_back((frame % 4 == 0) ? (WORD)(1 << (random() % 16)) : script.back());
+		}
+
+		// Fewer lit pixels, fewer blocks left on the board
+		auto start = std::chrono::steady_clock::now();
+		std::vector<int> scores = EvaluateBranches(chip8, scripts, frames, [](const Chip8& branch)
+		{
+			BYTE packed[PACKED_SIZE];
+			branch.GetPackedDisplay(packed);
+
+			int lit = 0;
+			for (BYTE byte : packed)
+				lit += std::bitset<8>(byte).count();
+			return -lit;
+		});
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+		size_t best = std::max_element(scores.begin(), scores.end()) - scores.begin();
+		std::cout << branches << " branches of " << frames << " frames in " << elapsed.count() << "s ("
+			<< (unsigned)(branches / elapsed.count()) << " branches/s), best " << best << " scored " << scores[best] << std::endl;
+		return 0;
 	}
 
-private:
-	void GameThread()
+	// chip8 --env-bench <batch> [steps] [rom] [score address] [end score]
+	// The score is 3 BCD digits as LD_B writes them, every point is a reward of 1
+	if (argc > 2 && std::string(argv[1]) == "--env-bench")
 	{
-		// Create user resources as part of this thread
-		if (!OnUserCreate())
-			m_bAtomActive = false;
+		unsigned batch = std::stoi(argv[2]);
+		unsigned steps = (argc > 3) ? std::stoi(argv[3]) : 1000;
+		const unsigned frameSkip = 4;
 
-		auto tp1 = std::chrono::system_clock::now();
-		auto tp2 = std::chrono::system_clock::now();
+		std::vector<MemoryWatch> watches;
+		if (argc > 5)
+			watches.push_back({ (WORD)std::stoul(argv[5], nullptr, 16), 3, true, 1.0f, (argc > 6) ? std::stoi(argv[6]) : -1 });
 
-		while (m_bAtomActive)
+		Environment env(argc > 4 ? argv[4] : FILENAME, batch, frameSkip, watches);
+		auto score = [&](unsigned i)
 		{
-			// Run as fast as possible
-			while (m_bAtomActive)
+			int value = 0;
+			for (BYTE b = 0; watches.size() && b < 3; b++)
+				value = value * 10 + env.Machine(i).Peek(watches[0].addr + b);
+			return value;
+		};
+
+		// Observations have to be the displays, rewards have to add up
+		// to how far the score went in the episode
+		uint64_t badObservations = 0, badRewards = 0, episodes = 0;
+		double total = 0;
+		std::vector<double> rewards(batch, 0);
+		std::vector<int> scores(batch);
+		auto check = [&]()
+		{
+			BYTE packed[PACKED_SIZE];
+			for (unsigned i = 0; i < batch; i++)
 			{
-				// Handle Timing
-				tp2 = std::chrono::system_clock::now();
-				std::chrono::duration<float> elapsedTime = tp2 - tp1;
-				tp1 = tp2;
-				float fElapsedTime = elapsedTime.count();
-
-
-				// Handle Frame Update
-				if (!OnUserUpdate(fElapsedTime))
-					m_bAtomActive = false;
-
-				// Update Title & Present Screen Buffer
-				wchar_t s[256];
-				swprintf_s(s, 256, L"OneLoneCoder.com - Console Game Engine - %s - FPS: %3.2f", m_sAppName.c_str(), 1.0f / fElapsedTime);
-				SetConsoleTitle(s);
-				WriteConsoleOutput(m_hConsole, m_bufScreen, { (short)m_nScreenWidth, (short)m_nScreenHeight }, { 0,0 }, &m_rectWindow);
+				env.Machine(i).GetPackedDisplay(packed);
+				if (memcmp(packed, env.Observations() + i * PACKED_SIZE, PACKED_SIZE) != 0)
+					badObservations++;
+
+				rewards[i] += env.Rewards()[i];
+				total += env.Rewards()[i];
+				if (rewards[i] != score(i) - scores[i])
+					badRewards++;
 			}
+		};
 
-			if (m_bEnableSound)
-			{
-				// Close and Clean up audio system
-			}
+		env.Reset(0);
+		int initialScore = score(0);
+		std::fill(scores.begin(), scores.end(), initialScore);
+		check();
 
-			// Allow the user to free resources if they have overrided the destroy function
-			if (OnUserDestroy())
-			{
-				// User has permitted destroy, so exit and clean up
-				delete[] m_bufScreen;
-				SetConsoleActiveScreenBuffer(m_hOriginalConsole);
-				m_cvGameFinished.notify_one();
-			}
-			else
+		std::mt19937 random(0);
+		std::vector<WORD> actions(batch, 0);
+		auto start = std::chrono::steady_clock::now();
+		for (unsigned step = 0; step < steps; step++)
+		{
+			// A new episode starts from a fresh machine, with the score every machine loaded with
+			for (unsigned i = 0; i < batch; i++)
 			{
-				// User denied destroy for some reason, so continue running
-				m_bAtomActive = true;
+				if (env.Dones()[i])
+				{
+					episodes++;
+					rewards[i] = 0;
+					scores[i] = initialScore;
+				}
+
+				if (random() % 8 == 0)
+					actions[i] = (WORD)(1 << (random() % 16));
 			}
+
+			env.Step(actions.data());
+			check();
 		}
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+		std::cout << steps << " steps of " << batch << " machines in " << elapsed.count() << "s ("
+			<< (uint64_t)(steps * batch * frameSkip / elapsed.count()) << " frames/s), "
+			<< episodes << " episodes ended, total reward " << total << std::endl;
+		std::cout << badObservations << " observations and " << badRewards << " rewards wrong" << std::endl;
+		return (badObservations || badRewards) ? 1 : 0;
 	}
 
-public:
-	// User MUST OVERRIDE THESE!!
-	virtual bool OnUserCreate() = 0;
-	virtual bool OnUserUpdate(float fElapsedTime) = 0;
+#ifdef __cpp_impl_coroutine
+	// chip8 --sessions <count> [frames] [rom]
+	if (argc > 2 && std::string(argv[1]) == "--sessions")
+	{
+		unsigned count = std::stoi(argv[2]);
+		uint64_t frames = (argc > 3) ? std::stoull(argv[3]) : FRAME_RATE * 10;
+		RomImage rom = Chip8::Image(argc > 4 ? argv[4] : FILENAME);
 
-	// Optional for clean up 
-	virtual bool OnUserDestroy() { return true; }
+		Scheduler scheduler;
+		std::vector<std::unique_ptr<CoSession>> sessions;
 
-	protected:
-		int Error(const wchar_t *msg)
+		for (unsigned i = 0; i < count; i++)
 		{
-			wchar_t buf[256];
-			FormatMessage(FORMAT_MESSAGE_FROM_SYSTEM, NULL, GetLastError(), MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), buf, 256, NULL);
-			SetConsoleActiveScreenBuffer(m_hOriginalConsole);
-			wprintf(L"ERROR: %s\n\t%s\n", msg, buf);
-			return 0;
-		}
+			sessions.emplace_back(new CoSession(scheduler));
+			Chip8& machine = sessions.back()->machine;
+			machine.Initialize();
+			machine.LoadGame(rom);
+			machine.Seed(i);
 
-		static BOOL CloseHandler(DWORD evt)
-		{
-			// Note this gets called in a seperate OS thread, so it must
-			// only exit when the game has finished cleaning up, or else
-			// the process will be killed before OnUserDestroy() has finished
-			if (evt == CTRL_CLOSE_EVENT)
+			RunSession(scheduler, *sessions.back(), frames, [](CoSession& session)
 			{
-				m_bAtomActive = false;
-
-				// Wait for thread to be exited
-				std::unique_lock<std::mutex> ul(m_muxGame);
-				m_cvGameFinished.wait(ul);
-			}
-			return true;
+				metrics.frames.Add();
+				session.machine.dirtyRows = 0;
+			});
 		}
 
-protected:
-	int m_nScreenWidth;
-	int m_nScreenHeight;
-	CHAR_INFO *m_bufScreen;
-	std::wstring m_sAppName;
-	HANDLE m_hOriginalConsole;
-	CONSOLE_SCREEN_BUFFER_INFO m_OriginalConsoleInfo;
-	HANDLE m_hConsole;
-	HANDLE m_hConsoleIn;
-	SMALL_RECT m_rectWindow;
-	short m_keyOldState[256] = { 0 };
-	short m_keyNewState[256] = { 0 };
-	bool m_mouseOldState[5] = { 0 };
-	bool m_mouseNewState[5] = { 0 };
-	bool m_bConsoleInFocus = true;
-	bool m_bEnableSound = false;
+		scheduler.Run();
 
-	// These need to be static because of the OnDestroy call the OS may make. The OS
-	// spawns a special thread just for that
-	static std::atomic<bool> m_bAtomActive;
-	static std::condition_variable m_cvGameFinished;
-	static std::mutex m_muxGame;
-};
+		unsigned idle = 0;
+		for (auto& session : sessions)
+			idle += session->Idle();
 
-// Define our static variables
-std::atomic<bool> olcConsoleGameEngine::m_bAtomActive(false);
-std::condition_variable olcConsoleGameEngine::m_cvGameFinished;
-std::mutex olcConsoleGameEngine::m_muxGame;
+		metrics.Dump(std::cout);
+		std::cout << count << " sessions on one thread, " << idle << " left waiting for a key" << std::endl;
+		return 0;
+	}
+#endif
 
+	// chip8 --diff [frames] [checkpoint] [rom] [keys]
+	//
+	// keys holds a little endian key mask per frame, without it
+	// keys are pressed at random
+	if (argc > 1 && std::string(argv[1]) == "--diff")
+	{
+		uint64_t frames = (argc > 2) ? std::stoull(argv[2]) : FRAME_RATE * 60 * 60;
+		unsigned checkpoint = (argc > 3) ? std::stoi(argv[3]) : FRAME_RATE;
+		RomImage rom = Chip8::Image(argc > 4 ? argv[4] : FILENAME);
 
-//////////////////////////////////////////////
-/// \brief Initializes and handles Screen
-///
-//////////////////////////////////////////////
-class Screen : public olcConsoleGameEngine
-{
-public:
-	Screen(){}
+		std::vector<WORD> keys;
+		if (argc > 5)
+		{
+			std::ifstream file(argv[5], std::ios::binary);
+			for (int low; (low = file.get()) != EOF; )
+				keys.push_back((WORD)(low | (file.get() << 8)));
+		}
+		else
+		{
+			std::mt19937 random(0);
+			for (uint64_t frame = 0; frame < frames; frame++)
+				keys.push_back((frame % 8 == 0) ? (WORD)(1 << (random() % 16)) : keys.back());
+		}
 
-	virtual bool OnUserCreate()
-	{
-		then = std::chrono::system_clock::now();
+		auto start = std::chrono::steady_clock::now();
+		Divergence diff = Lockstep(rom, 0, keys, frames, checkpoint, ReferenceEngine, DecodedEngine);
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
 
-		chip8.Initialize();
-		chip8.LoadGame(FILENAME);
-		//MessageBox(NULL, L"", L"", MB_OK);
+		if (!diff.found)
+		{
+			std::cout << "identical over " << frames << " frames in " << elapsed.count() << "s ("
+				<< (uint64_t)(frames / elapsed.count()) << " frames/s), digest " << std::hex << diff.digest << std::dec << std::endl;
+			return 0;
+		}
 
-		return true;
+		std::cout << "diverged in frame " << diff.frame << " after " << diff.instruction << " instructions" << std::endl;
+		std::cout << "before:" << std::endl;
+		diff.before.DumpRegisters(std::cout);
+		std::cout << "reference:" << std::endl;
+		diff.reference.DumpRegisters(std::cout);
+		std::cout << "candidate:" << std::endl;
+		diff.candidate.DumpRegisters(std::cout);
+		return 1;
+	}
+
+#ifndef _WIN32
+	// chip8 --analyze <directory> [threads]
+	if (argc > 2 && std::string(argv[1]) == "--analyze")
+	{
+		auto start = std::chrono::steady_clock::now();
+		RomAnalysis analysis = AnalyzeCorpus(argv[2], (argc > 3) ? std::stoi(argv[3]) : 0);
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+		analysis.Report(std::cout);
+		std::cout << "Analyzed in " << elapsed.count() << "s" << std::endl;
+		return 0;
 	}
+#endif
 
-	virtual bool OnUserUpdate(float elapsedTime)
+	// chip8 --regress
+	if (argc > 1 && std::string(argv[1]) == "--regress")
 	{
-		chip8.EmulateCycle();
+		auto start = std::chrono::steady_clock::now();
+		unsigned failed = RunRegressionSuite(std::cout);
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+		std::cout << failed << " failed, in " << elapsed.count() << "s" << std::endl;
+		return failed ? 1 : 0;
+	}
 
-		now = std::chrono::system_clock::now();
+	// chip8 --regress-update
+	if (argc > 1 && std::string(argv[1]) == "--regress-update")
+	{
+		PrintRegressionHashes(std::cout);
+		return 0;
+	}
 
-		if (std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count() - std::chrono::duration_cast<std::chrono::milliseconds>(then.time_since_epoch()).count() >= 1000 / 60)
+	// chip8 --latency [samples] [rom ...]
+	if (argc > 1 && std::string(argv[1]) == "--latency")
+	{
+		unsigned samples = (argc > 2) ? std::stoi(argv[2]) : 20;
+		std::vector<std::string> roms(argv + std::min(argc, 3), argv + argc);
+		if (roms.empty())
+			roms.push_back(FILENAME);
+
+		const LatencySettings settings[] = {
+			{ "wait, present", CYCLES_PER_FRAME, false },	// What Screen does
+			{ "present, wait", CYCLES_PER_FRAME, true },
+			{ "present, wait, 2x cycles", 2 * CYCLES_PER_FRAME, true },
+		};
+
+		NullBackend null;
+		for (const std::string& path : roms)
 		{
-			//std::cout << std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count() - std::chrono::duration_cast<std::chrono::milliseconds>(then.time_since_epoch()).count() << std::endl;
+			RomImage rom = Chip8::Image(path);
+			std::cout << path << std::endl;
 
-			if (chip8.delay_timer != 0)
+			for (const LatencySettings& setting : settings)
 			{
-				chip8.delay_timer--;
-			}
-			if (chip8.sound_timer != 0) {
-				chip8.sound_timer--;
+				LatencyHarness<NullBackend> harness(null, rom, setting, 0);
+				harness.Run(samples);
+				harness.Report(std::cout);
 			}
+		}
+		return 0;
+	}
 
-			then = now;
+	// chip8 --screenshot <file.pam> [frames] [rom]
+	if (argc > 2 && std::string(argv[1]) == "--screenshot")
+	{
+		uint64_t frames = (argc > 3) ? std::stoull(argv[3]) : FRAME_RATE * 5;
 
+		chip8.Initialize();
+		chip8.Seed(0);
+		chip8.LoadGame(argc > 4 ? argv[4] : FILENAME);
+		for (uint64_t frame = 0; frame < frames && !chip8.interrupt; frame++)
+		{
+			chip8.Execute(CYCLES_PER_FRAME);
+			chip8.UpdateTimers();
 		}
 
-		if (chip8.drawFlag)
+		Upscaler upscaler;
+		std::vector<uint32_t> rgba(upscaler.Width() * upscaler.Height());
+		upscaler.FromDisplay(chip8.getDisplay(), rgba.data());
+
+		std::ofstream file(argv[2], std::ios::binary);
+		file << "P7\nWIDTH " << upscaler.Width() << "\nHEIGHT " << upscaler.Height()
+			<< "\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n";
+		file.write((const char*)rgba.data(), rgba.size() * sizeof(uint32_t));
+		return file.good() ? 0 : 1;
+	}
+
+	// chip8 --play <movie> [frame]
+	//
+	// Without a frame the whole movie is played and checked
+	if (argc > 2 && std::string(argv[1]) == "--play")
+	{
+		std::ifstream file(argv[2], std::ios::binary);
+		MoviePlayer player(file);
+		if (!player.Valid())
 		{
-			drawGraphics();
+			std::cerr << "Cannot read movie " << argv[2] << std::endl;
+			return 1;
 		}
-		Sleep(1);
 
-		return true;
-	}
+		std::cout << player.Frames() << " frames, " << player.Keyframes() << " keyframes every " << player.Interval() << " frames" << std::endl;
 
-private:
-	std::chrono::system_clock::time_point then, now;
+		auto start = std::chrono::steady_clock::now();
+		if (argc > 3)
+		{
+			uint64_t frame = std::stoull(argv[3]);
+			if (!player.Seek(frame, chip8))
+			{
+				std::cerr << "Cannot seek to frame " << frame << std::endl;
+				return 1;
+			}
+		}
+		else
+		{
+			player.Seek(0, chip8);
+			while (player.Step(chip8))
+				;
+		}
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
 
-	//////////////////////////////////////////////
-	/// \brief Draws the pixel array to the screen
-	///
-	/// \param window The render target
-	/// \param pixels The pixel array
-	///
-	//////////////////////////////////////////////
-	void drawGraphics()
+		std::cout << "at frame " << player.Frame() << " in " << elapsed.count() * 1000 << "ms"
+			<< (player.Desynced() ? ", DESYNCED from the recording" : ", matches the recording") << std::endl;
+		chip8.DumpRegisters(std::cout);
+
+		BYTE recorded[WIDTH * HEIGHT];
+		UnpackDisplay(player.Recorded(), recorded);
+		PrintDisplayDiff(std::cout, chip8.getDisplay(), recorded);
+		return player.Desynced() ? 1 : 0;
+	}
+
+	// chip8 --headless [frames] [movie] [--wav <file>]
+	if (argc > 1 && std::string(argv[1]) == "--headless")
 	{
-		BYTE* gfx = chip8.getDisplay();
+		std::vector<std::string> args;
+		std::string wavPath;
+		for (int arg = 2; arg < argc; arg++)
+		{
+			if (arg + 1 < argc && std::string(argv[arg]) == "--wav")
+				wavPath = argv[++arg];
+			else
+				args.push_back(argv[arg]);
+		}
+
+		NullBackend null(wavPath);
+		Screen<NullBackend> screen(null);
 
-		for (int i = 0; i < WIDTH * HEIGHT; i++)
+		std::unique_ptr<std::ofstream> movieFile;
+		std::unique_ptr<MovieRecorder> recorder;
+		if (args.size() > 1)
 		{
-			int y = floor(i / WIDTH);
-			int x = i - (y * WIDTH);
-			COLOUR col = (gfx[i] == 0x00) ? FG_BLACK : FG_WHITE;
+			movieFile.reset(new std::ofstream(args[1], std::ios::binary));
+			recorder.reset(new MovieRecorder(*movieFile));
+			screen.Record(recorder.get());
+		}
+
+		screen.Start(args.size() > 0 ? std::stoull(args[0]) : 0);
 
-			std::wstring s = std::to_wstring(x) + L", " + std::to_wstring(y);
+		metrics.Dump(std::cout);
+		return 0;
+	}
 
-			Draw(x, y, PIXEL_SOLID, col);
+	// chip8 [--stats <file>] [--sixel [scale]] [--record <movie>] [--profile <folded file>] [--labels <file>]
+	std::unique_ptr<std::ofstream> statsFile;
+	std::unique_ptr<StatsDumper> stats;
+	std::unique_ptr<std::ofstream> movieFile;
+	std::unique_ptr<MovieRecorder> recorder;
+	std::unique_ptr<GuestProfiler> profiler;
+	std::string profilePath, labelsPath;
+	unsigned sixelScale = 0;	// Only the terminal backend draws sixels
+	for (int arg = 1; arg < argc; arg++)
+	{
+		if (arg + 1 < argc && std::string(argv[arg]) == "--stats")
+		{
+			statsFile.reset(new std::ofstream(argv[++arg]));
+			stats.reset(new StatsDumper(*statsFile, std::chrono::seconds(1)));
+		}
+		else if (arg + 1 < argc && std::string(argv[arg]) == "--record")
+		{
+			movieFile.reset(new std::ofstream(argv[++arg], std::ios::binary));
+			recorder.reset(new MovieRecorder(*movieFile));
 		}
+		else if (arg + 1 < argc && std::string(argv[arg]) == "--profile")
+			profilePath = argv[++arg];
+		else if (arg + 1 < argc && std::string(argv[arg]) == "--labels")
+			labelsPath = argv[++arg];
+		else if (std::string(argv[arg]) == "--sixel")
+			sixelScale = (arg + 1 < argc && isdigit((unsigned char)argv[arg + 1][0])) ? std::stoi(argv[++arg]) : SCALE;
+	}
 
-		chip8.drawFlag = false;
+	if (!profilePath.empty())
+	{
+		profiler.reset(new GuestProfiler());
+		if (!labelsPath.empty() && !profiler->LoadLabels(labelsPath))
+			std::cerr << "Cannot read labels from " << labelsPath << std::endl;
 	}
-};
 
+#ifdef _WIN32
+	ConsoleBackend console;
+	console.ConstructConsole(WIDTH, HEIGHT, 16, 16);
+	(void)sixelScale;
 
+	Screen<ConsoleBackend> screen(console);
+	screen.Record(recorder.get());
+	screen.Profile(profiler.get());
+	screen.Start();
+#else
+	TerminalBackend terminal(sixelScale);
 
-int main(int argc, char** argv)
-{
-	Screen screen;
-	screen.ConstructConsole(WIDTH, HEIGHT, 16, 16);
+	Screen<TerminalBackend> screen(terminal);
+	screen.Record(recorder.get());
+	screen.Profile(profiler.get());
 	screen.Start();
+#endif
+	screen.Pacer().Report(std::cerr);
 
-	
+	if (profiler)
+	{
+		std::ofstream folded(profilePath);
+		profiler->WriteFolded(folded, chip8);
+		std::cerr << profiler->Samples() << " samples written to " << profilePath << std::endl;
+	}
 
 	return 0;
 }
+#endif